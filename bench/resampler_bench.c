@@ -0,0 +1,94 @@
+//
+//  resampler_bench.c
+//  x11pulsemux
+//
+// Times each S16 -> FLTP kernel this CPU supports against swresample's own
+// conversion and checks the output matches it bit for bit. Takes an optional
+// round count; the best round is reported.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libswresample/swresample.h>
+#include <libavutil/time.h>
+#include "cpu_features.h"
+#include "resampler.h"
+
+// 100ms of stereo at 48kHz
+#define BENCH_SAMPLES 4800
+
+struct bench_buffers_s {
+  int16_t in[BENCH_SAMPLES * 2];
+  float ref[2][BENCH_SAMPLES];
+  float out[2][BENCH_SAMPLES];
+};
+
+static struct bench_buffers_s buffers;
+
+// Best time of one round in ns; fn NULL times swresample.
+static int64_t bench(resampler_s16_to_fltp_fn fn, struct SwrContext* swr,
+                     int rounds)
+{
+  uint8_t* out[2] = { (uint8_t*)buffers.out[0], (uint8_t*)buffers.out[1] };
+  const uint8_t* in[1] = { (const uint8_t*)buffers.in };
+  int64_t best = INT64_MAX;
+  for (int round = 0; round < rounds; round++) {
+    int64_t start = av_gettime_relative();
+    if (fn) {
+      fn(buffers.in, buffers.out[0], buffers.out[1], BENCH_SAMPLES);
+    } else {
+      swr_convert(swr, out, BENCH_SAMPLES, in, BENCH_SAMPLES);
+    }
+    best = FFMIN(best, (av_gettime_relative() - start) * 1000);
+  }
+  return best;
+}
+
+int main(int argc, char** argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 200;
+  if (rounds < 1) {
+    printf("usage: resampler_bench [ROUNDS]\n");
+    return 1;
+  }
+  unsigned int seed = 0x9e3779b9;
+  for (int i = 0; i < BENCH_SAMPLES * 2; i++) {
+    seed = seed * 1103515245 + 12345;
+    buffers.in[i] = seed >> 16;
+  }
+  // extremes, where a wrong shift or saturation would show
+  buffers.in[0] = INT16_MIN;
+  buffers.in[1] = INT16_MAX;
+
+  struct SwrContext* swr =
+  swr_alloc_set_opts(NULL, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLTP, 48000,
+                     AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, 48000, 0, NULL);
+  if (!swr || swr_init(swr) < 0) {
+    printf("cannot set up swresample\n");
+    swr_free(&swr);
+    return 1;
+  }
+  int64_t swr_ns = bench(NULL, swr, rounds);
+  memcpy(buffers.ref, buffers.out, sizeof(buffers.ref));
+  swr_free(&swr);
+  printf("s16 -> fltp, %d samples, best of %d rounds\n", BENCH_SAMPLES,
+         rounds);
+  printf("  %-12s %8lldns\n", "swresample", swr_ns);
+
+  int failures = 0;
+  int count;
+  const struct resampler_kernel_s* kernels = resampler_get_kernels(&count);
+  for (int i = 0; i < count; i++) {
+    if (!cpu_features_has(kernels[i].cpu_features)) {
+      printf("  %-12s unsupported\n", kernels[i].name);
+      continue;
+    }
+    memset(buffers.out, 0, sizeof(buffers.out));
+    int64_t kernel_ns = bench(kernels[i].fn, NULL, rounds);
+    char exact = !memcmp(buffers.out, buffers.ref, sizeof(buffers.ref));
+    printf("  %-12s %8lldns%s\n", kernels[i].name, kernel_ns,
+           exact ? "" : "  differs from swresample");
+    failures += !exact;
+  }
+  return failures ? 1 : 0;
+}
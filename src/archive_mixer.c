@@ -0,0 +1,454 @@
+//
+//  archive_mixer.c
+//  x11pulsemux
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/samplefmt.h>
+#include "archive_mixer.h"
+#include "cpu_features.h"
+#include "frame_pool.h"
+#include "media_clock.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ARCHIVE_MIXER_X86 1
+#include <immintrin.h>
+#endif
+
+#define ARCHIVE_MIXER_MAX_SOURCES 8
+
+// How long the mix waits on a source that has fallen behind the others
+// before it mixes silence in its place.
+static const int max_wait_ms = 100;
+// Sources stamp frames on their own sample grid; rounding onto the mixer's
+// may move a frame by a sample without anything having been lost.
+static const int max_jitter_samples = 1;
+
+struct archive_mixer_source_s {
+  struct pulse_config_s config;
+  struct pulse_s* pulse;
+  float gain;
+  char running;
+  // samples not mixed yet; the first one always sits at the mixer's
+  // next_index
+  AVAudioFifo* fifo;
+  // mixer sample index just past the last sample in fifo
+  int64_t end_index;
+};
+
+struct archive_mixer_s {
+  struct archive_mixer_source_s sources[ARCHIVE_MIXER_MAX_SOURCES];
+  int source_count;
+  struct archive_mixer_config_s config;
+  int channels;
+  char passthrough;
+  // output sample n is stamped origin_pts + n / sample_rate
+  char has_origin;
+  int64_t origin_pts;
+  int64_t next_index;
+  int64_t max_wait_samples;
+  // one frame of planar float for the second source on, and one of silence
+  uint8_t** scratch;
+  uint8_t** silence;
+  struct frame_pool_s* frame_pool;
+  struct archive_mixer_stats_s stats;
+};
+
+/*
+ * dst += src * gain, over every channel of every source but the first.
+ * The C version is left to the compiler, which vectorizes it for the
+ * baseline (SSE2) at -O3; AVX doubles the width where the CPU has it. No
+ * FMA, so every kernel rounds the same way.
+ */
+typedef void (*mix_fn)(float* dst, const float* src, float gain,
+                       int nb_samples);
+// dst = src * gain, in place for the first source
+typedef void (*scale_fn)(float* dst, const float* src, float gain,
+                         int nb_samples);
+
+static mix_fn mix;
+static scale_fn scale;
+
+static void _mix_c(float* dst, const float* src, float gain,
+                   int nb_samples)
+{
+  for (int i = 0; i < nb_samples; i++) {
+    dst[i] += src[i] * gain;
+  }
+}
+
+static void _scale_c(float* dst, const float* src, float gain,
+                     int nb_samples)
+{
+  for (int i = 0; i < nb_samples; i++) {
+    dst[i] = src[i] * gain;
+  }
+}
+
+#ifdef ARCHIVE_MIXER_X86
+#define AVX __attribute__((target("avx")))
+
+static AVX void _mix_avx(float* dst, const float* src, float gain,
+                         int nb_samples)
+{
+  const __m256 g = _mm256_set1_ps(gain);
+  int i = 0;
+  for (; i + 16 <= nb_samples; i += 16) {
+    __m256 s0 = _mm256_mul_ps(_mm256_loadu_ps(src + i), g);
+    __m256 s1 = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), g);
+    _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), s0));
+    _mm256_storeu_ps(dst + i + 8,
+                     _mm256_add_ps(_mm256_loadu_ps(dst + i + 8), s1));
+  }
+  _mix_c(dst + i, src + i, gain, nb_samples - i);
+}
+
+static AVX void _scale_avx(float* dst, const float* src, float gain,
+                           int nb_samples)
+{
+  const __m256 g = _mm256_set1_ps(gain);
+  int i = 0;
+  for (; i + 16 <= nb_samples; i += 16) {
+    __m256 s0 = _mm256_mul_ps(_mm256_loadu_ps(src + i), g);
+    __m256 s1 = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), g);
+    _mm256_storeu_ps(dst + i, s0);
+    _mm256_storeu_ps(dst + i + 8, s1);
+  }
+  _scale_c(dst + i, src + i, gain, nb_samples - i);
+}
+#endif
+
+struct mix_kernel_s {
+  const char* name;
+  int cpu_features;
+  mix_fn mix;
+  scale_fn scale;
+};
+
+static const struct mix_kernel_s kernels[] = {
+#ifdef ARCHIVE_MIXER_X86
+  { "avx", CPU_FEATURE_AVX, _mix_avx, _scale_avx },
+#endif
+  { "c", 0, _mix_c, _scale_c },
+};
+
+void archive_mixer_init(void) {
+  int i = 0;
+  while (!cpu_features_has(kernels[i].cpu_features)) {
+    i++;
+  }
+  mix = kernels[i].mix;
+  scale = kernels[i].scale;
+  printf("archive_mixer: using %s mixing kernel\n", kernels[i].name);
+}
+
+void archive_mixer_alloc(struct archive_mixer_s** mixer_out) {
+  struct archive_mixer_s* pthis = (struct archive_mixer_s*)
+  calloc(1, sizeof(struct archive_mixer_s));
+  frame_pool_alloc(&pthis->frame_pool);
+  *mixer_out = pthis;
+}
+
+void archive_mixer_free(struct archive_mixer_s* pthis) {
+  if (!pthis) {
+    return;
+  }
+  for (int i = 0; i < pthis->source_count; i++) {
+    pulse_free(pthis->sources[i].pulse);
+    if (pthis->sources[i].fifo) {
+      av_audio_fifo_free(pthis->sources[i].fifo);
+    }
+  }
+  if (pthis->scratch) {
+    av_freep(&pthis->scratch[0]);
+    av_freep(&pthis->scratch);
+  }
+  if (pthis->silence) {
+    av_freep(&pthis->silence[0]);
+    av_freep(&pthis->silence);
+  }
+  frame_pool_free(pthis->frame_pool);
+  free(pthis);
+}
+
+int archive_mixer_add_source(struct archive_mixer_s* pthis,
+                             struct pulse_config_s* config, float gain)
+{
+  if (pthis->source_count == ARCHIVE_MIXER_MAX_SOURCES) {
+    printf("archive_mixer: at most %d sources\n", ARCHIVE_MIXER_MAX_SOURCES);
+    return EINVAL;
+  }
+  struct archive_mixer_source_s* source =
+  &pthis->sources[pthis->source_count++];
+  memcpy(&source->config, config, sizeof(struct pulse_config_s));
+  source->gain = gain;
+  pulse_alloc(&source->pulse);
+  return 0;
+}
+
+int archive_mixer_get_source_count(struct archive_mixer_s* pthis) {
+  return pthis->source_count;
+}
+
+int archive_mixer_start(struct archive_mixer_s* pthis,
+                        struct archive_mixer_config_s* config)
+{
+  int ret;
+  memcpy(&pthis->config, config, sizeof(struct archive_mixer_config_s));
+  pthis->channels =
+  av_get_channel_layout_nb_channels(config->channel_layout);
+  pthis->max_wait_samples = (int64_t)config->sample_rate * max_wait_ms / 1000;
+  pthis->passthrough =
+  pthis->source_count == 1 && pthis->sources[0].gain == 1.0f;
+  if (!pthis->passthrough) {
+    ret = av_samples_alloc_array_and_samples(&pthis->scratch, NULL,
+                                             pthis->channels,
+                                             config->frame_size,
+                                             AV_SAMPLE_FMT_FLTP, 0);
+    if (ret < 0) {
+      return ret;
+    }
+    ret = av_samples_alloc_array_and_samples(&pthis->silence, NULL,
+                                             pthis->channels,
+                                             config->frame_size,
+                                             AV_SAMPLE_FMT_FLTP, 0);
+    if (ret < 0) {
+      return ret;
+    }
+    av_samples_set_silence(pthis->silence, 0, config->frame_size,
+                           pthis->channels, AV_SAMPLE_FMT_FLTP);
+  }
+
+  int running = 0;
+  for (int i = 0; i < pthis->source_count; i++) {
+    struct archive_mixer_source_s* source = &pthis->sources[i];
+    source->config.out_sample_fmt =
+    pthis->passthrough ? config->sample_fmt : AV_SAMPLE_FMT_FLTP;
+    source->config.out_sample_rate = config->sample_rate;
+    source->config.out_channel_layout = config->channel_layout;
+    source->config.out_frame_size = config->frame_size;
+    if (!pthis->passthrough) {
+      // room for the wait plus a few frames, so steady state never grows it
+      source->fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, pthis->channels,
+                                         pthis->max_wait_samples +
+                                         config->frame_size * 4);
+      if (!source->fifo) {
+        return AVERROR(ENOMEM);
+      }
+    }
+    pulse_load_config(source->pulse, &source->config);
+    ret = pulse_start(source->pulse);
+    if (ret) {
+      printf("archive_mixer: cannot record %s (%d), leaving it out\n",
+             source->config.device ? source->config.device : "default", ret);
+      continue;
+    }
+    source->running = 1;
+    running++;
+  }
+  if (!running) {
+    return AVERROR(EIO);
+  }
+  if (!pthis->passthrough) {
+    printf("archive_mixer: mixing %d of %d sources\n", running,
+           pthis->source_count);
+  }
+  return 0;
+}
+
+int archive_mixer_stop(struct archive_mixer_s* pthis) {
+  int ret = 0;
+  for (int i = 0; i < pthis->source_count; i++) {
+    int source_ret = pulse_stop(pthis->sources[i].pulse);
+    if (source_ret) {
+      printf("archive_mixer: pulse_stop failed for source %d with %d\n", i,
+             source_ret);
+      ret = source_ret;
+    }
+    pthis->sources[i].running = 0;
+  }
+  return ret;
+}
+
+static int _fifo_write_silence(struct archive_mixer_s* pthis,
+                               AVAudioFifo* fifo, int64_t nb_samples)
+{
+  while (nb_samples > 0) {
+    int chunk = (int)FFMIN(nb_samples, pthis->config.frame_size);
+    int ret = av_audio_fifo_write(fifo, (void**)pthis->silence, chunk);
+    if (ret < 0) {
+      return ret;
+    }
+    nb_samples -= chunk;
+  }
+  return 0;
+}
+
+// Lines a captured frame up with the mix and queues what is left of it.
+static void _queue_frame(struct archive_mixer_s* pthis,
+                         struct archive_mixer_source_s* source,
+                         AVFrame* frame)
+{
+  if (!pthis->has_origin) {
+    pthis->has_origin = 1;
+    pthis->origin_pts = frame->pts;
+  }
+  int64_t index = av_rescale_rnd(frame->pts - pthis->origin_pts,
+                                 pthis->config.sample_rate,
+                                 MEDIA_CLOCK_NS_PER_SEC, AV_ROUND_NEAR_INF);
+  int64_t offset = index - source->end_index;
+  if (FFABS(offset) <= max_jitter_samples) {
+    offset = 0;
+  }
+  int skip = 0;
+  if (offset > 0) {
+    if (_fifo_write_silence(pthis, source->fifo, offset) < 0) {
+      return;
+    }
+    pthis->stats.samples_padded += offset;
+    source->end_index += offset;
+  } else if (offset < 0) {
+    skip = (int)FFMIN(-offset, frame->nb_samples);
+    pthis->stats.samples_dropped += skip;
+  }
+  int nb_samples = frame->nb_samples - skip;
+  if (!nb_samples) {
+    return;
+  }
+  uint8_t* data[AV_NUM_DATA_POINTERS];
+  for (int ch = 0; ch < pthis->channels; ch++) {
+    data[ch] = frame->extended_data[ch] + skip * sizeof(float);
+  }
+  if (av_audio_fifo_write(source->fifo, (void**)data, nb_samples) < 0) {
+    return;
+  }
+  source->end_index += nb_samples;
+}
+
+// Moves whatever the sources have captured into their fifos.
+static void _pull(struct archive_mixer_s* pthis) {
+  for (int i = 0; i < pthis->source_count; i++) {
+    struct archive_mixer_source_s* source = &pthis->sources[i];
+    while (source->running && pulse_has_next(source->pulse)) {
+      AVFrame* frame = NULL;
+      if (pulse_get_next(source->pulse, &frame)) {
+        break;
+      }
+      _queue_frame(pthis, source, frame);
+      av_frame_free(&frame);
+    }
+  }
+}
+
+static char _ready(struct archive_mixer_s* pthis) {
+  if (!pthis->has_origin) {
+    return 0;
+  }
+  int64_t need = pthis->next_index + pthis->config.frame_size;
+  int64_t lead = INT64_MIN;
+  char covered = 1;
+  for (int i = 0; i < pthis->source_count; i++) {
+    struct archive_mixer_source_s* source = &pthis->sources[i];
+    if (!source->running) {
+      continue;
+    }
+    covered &= source->end_index >= need;
+    lead = FFMAX(lead, source->end_index);
+  }
+  return covered || lead >= need + pthis->max_wait_samples;
+}
+
+char archive_mixer_has_next(struct archive_mixer_s* pthis) {
+  if (pthis->passthrough) {
+    return pulse_has_next(pthis->sources[0].pulse);
+  }
+  _pull(pthis);
+  return _ready(pthis);
+}
+
+int archive_mixer_get_next(struct archive_mixer_s* pthis, AVFrame** frame_out)
+{
+  if (pthis->passthrough) {
+    return pulse_get_next(pthis->sources[0].pulse, frame_out);
+  }
+  if (!archive_mixer_has_next(pthis)) {
+    return AVERROR(EAGAIN);
+  }
+  int frame_size = pthis->config.frame_size;
+  AVFrame* frame = NULL;
+  int ret = frame_pool_get_audio(pthis->frame_pool, frame_size,
+                                 AV_SAMPLE_FMT_FLTP,
+                                 pthis->config.channel_layout, &frame);
+  if (ret) {
+    return ret;
+  }
+  frame->sample_rate = pthis->config.sample_rate;
+  frame->pts = pthis->origin_pts +
+  av_rescale(pthis->next_index, MEDIA_CLOCK_NS_PER_SEC,
+             pthis->config.sample_rate);
+
+  char first = 1;
+  for (int i = 0; i < pthis->source_count; i++) {
+    struct archive_mixer_source_s* source = &pthis->sources[i];
+    if (!source->running) {
+      continue;
+    }
+    int nb_samples = FFMIN(av_audio_fifo_size(source->fifo), frame_size);
+    uint8_t** dst = first ? frame->extended_data : pthis->scratch;
+    av_audio_fifo_read(source->fifo, (void**)dst, nb_samples);
+    if (nb_samples < frame_size) {
+      // a source given up on for this frame
+      av_samples_set_silence(dst, nb_samples, frame_size - nb_samples,
+                             pthis->channels, AV_SAMPLE_FMT_FLTP);
+      pthis->stats.samples_padded += frame_size - nb_samples;
+      source->end_index = pthis->next_index + frame_size;
+    }
+    for (int ch = 0; ch < pthis->channels; ch++) {
+      float* out = (float*)frame->extended_data[ch];
+      if (!first) {
+        mix(out, (const float*)dst[ch], source->gain, frame_size);
+      } else if (source->gain != 1.0f) {
+        scale(out, out, source->gain, frame_size);
+      }
+    }
+    first = 0;
+  }
+  if (first) {
+    av_samples_set_silence(frame->extended_data, 0, frame_size,
+                           pthis->channels, AV_SAMPLE_FMT_FLTP);
+  }
+  pthis->next_index += frame_size;
+  pthis->stats.frames_mixed++;
+  *frame_out = frame;
+  return 0;
+}
+
+int64_t archive_mixer_get_head_ts(struct archive_mixer_s* pthis) {
+  if (pthis->passthrough) {
+    return pulse_get_head_ts(pthis->sources[0].pulse);
+  }
+  if (!archive_mixer_has_next(pthis)) {
+    return EAGAIN;
+  }
+  return pthis->origin_pts +
+  av_rescale(pthis->next_index, MEDIA_CLOCK_NS_PER_SEC,
+             pthis->config.sample_rate);
+}
+
+void archive_mixer_get_stats(struct archive_mixer_s* pthis,
+                             struct archive_mixer_stats_s* stats_out)
+{
+  memcpy(stats_out, &pthis->stats, sizeof(struct archive_mixer_stats_s));
+}
+
+void archive_mixer_get_source_stats(struct archive_mixer_s* pthis, int index,
+                                    struct pulse_stats_s* stats_out)
+{
+  pulse_get_stats(pthis->sources[index].pulse, stats_out);
+}
@@ -0,0 +1,71 @@
+//
+//  archive_mixer.h
+//  x11pulsemux
+//
+
+#ifndef archive_mixer_h
+#define archive_mixer_h
+
+#include <libavutil/frame.h>
+#include "pulse_audio_source.h"
+
+/**
+ * Records several pulse sources at once (say a sink monitor and a
+ * microphone) and mixes them into the one audio track. Every source is
+ * captured as planar float at the encoder's rate and layout and lined up
+ * sample by sample on the shared timeline: a source that starts late or
+ * skips gets silence, one that overlaps what was already mixed loses the
+ * overlap. A frame is mixed once every source has covered it, or once the
+ * furthest source is max_wait_ms ahead and the stragglers are given up on.
+ *
+ * With a single source at unity gain its frames pass straight through in
+ * the encoder's own format.
+ */
+struct archive_mixer_s;
+
+struct archive_mixer_config_s {
+  // what the encoder takes (see file_writer_get_audio_format)
+  enum AVSampleFormat sample_fmt;
+  int sample_rate;
+  uint64_t channel_layout;
+  int frame_size;
+};
+
+struct archive_mixer_stats_s {
+  int64_t frames_mixed;
+  // silence filled in for sources that started late, skipped or lagged
+  int64_t samples_padded;
+  // source samples that fell on time already mixed
+  int64_t samples_dropped;
+};
+
+// Picks the widest mixing kernel this CPU supports. Call once before mixing.
+void archive_mixer_init(void);
+
+void archive_mixer_alloc(struct archive_mixer_s** mixer_out);
+void archive_mixer_free(struct archive_mixer_s* mixer);
+
+// Adds a source to record from archive_mixer_start on. gain is linear. The
+// output format fields of config are filled in at start.
+int archive_mixer_add_source(struct archive_mixer_s* mixer,
+                             struct pulse_config_s* config, float gain);
+int archive_mixer_get_source_count(struct archive_mixer_s* mixer);
+
+// Starts every source. Sources that fail are left out of the mix; fails
+// only if none start.
+int archive_mixer_start(struct archive_mixer_s* mixer,
+                        struct archive_mixer_config_s* config);
+int archive_mixer_stop(struct archive_mixer_s* mixer);
+
+// Same contract as the pulse source: frame pts are on the media clock
+// timeline (ns), and the head ts is EAGAIN while no frame is ready.
+char archive_mixer_has_next(struct archive_mixer_s* mixer);
+int archive_mixer_get_next(struct archive_mixer_s* mixer, AVFrame** frame_out);
+int64_t archive_mixer_get_head_ts(struct archive_mixer_s* mixer);
+
+void archive_mixer_get_stats(struct archive_mixer_s* mixer,
+                             struct archive_mixer_stats_s* stats_out);
+void archive_mixer_get_source_stats(struct archive_mixer_s* mixer, int index,
+                                    struct pulse_stats_s* stats_out);
+
+#endif /* archive_mixer_h */
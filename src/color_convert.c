@@ -0,0 +1,521 @@
+//
+//  color_convert.c
+//  x11pulsemux
+//
+
+#include "color_convert.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libavutil/common.h>
+#include "cpu_features.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COLOR_CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+/**
+ * 8 bit fixed point coefficients, as R, G, B triples. Luma weights sum to
+ * 220 so the full luma expression fits an unsigned 16 bit lane; the chroma
+ * expressions stay within a signed one. Every kernel below evaluates exactly
+ * the same integer math, so all of them are bit-exact with the C path.
+ * Each chroma row sums to zero, so greys come out at exactly 128.
+ * test/color_convert_test.c checks both, and the C path against swscale.
+ */
+struct color_coeffs_s {
+  int16_t y[3];
+  int16_t u[3];
+  int16_t v[3];
+};
+
+static const struct color_coeffs_s matrices[] = {
+  [COLOR_CONVERT_BT601] = {
+    { 66, 129, 25 }, { -38, -74, 112 }, { 112, -94, -18 }
+  },
+  [COLOR_CONVERT_BT709] = {
+    { 47, 157, 16 }, { -26, -86, 112 }, { 112, -102, -10 }
+  },
+};
+
+// Converts as much of a pair of rows as fits the kernel's vector width.
+// Returns the number of pixels done, always even; the C path does the rest.
+typedef int (*convert_rows_fn)(const uint8_t* row0, const uint8_t* row1,
+                               uint8_t* y0, uint8_t* y1,
+                               uint8_t* u, uint8_t* v,
+                               int width, const struct color_coeffs_s* k);
+
+static inline uint8_t _luma(const uint8_t* px, const struct color_coeffs_s* k)
+{
+  return ((k->y[0] * px[2] + k->y[1] * px[1] + k->y[2] * px[0] + 128) >> 8)
+  + 16;
+}
+
+static void _convert_rows_c(const uint8_t* row0, const uint8_t* row1,
+                            uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+                            int start, int width,
+                            const struct color_coeffs_s* k)
+{
+  for (int i = start; i < width; i += 2) {
+    // an odd trailing column is paired with itself
+    int i1 = i + 1 < width ? i + 1 : i;
+    const uint8_t* p00 = row0 + i * 4;
+    const uint8_t* p01 = row0 + i1 * 4;
+    const uint8_t* p10 = row1 + i * 4;
+    const uint8_t* p11 = row1 + i1 * 4;
+    y0[i] = _luma(p00, k);
+    y0[i1] = _luma(p01, k);
+    y1[i] = _luma(p10, k);
+    y1[i1] = _luma(p11, k);
+    int b = (p00[0] + p01[0] + p10[0] + p11[0] + 2) >> 2;
+    int g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+    int r = (p00[2] + p01[2] + p10[2] + p11[2] + 2) >> 2;
+    u[i / 2] = ((k->u[0] * r + k->u[1] * g + k->u[2] * b + 128) >> 8) + 128;
+    v[i / 2] = ((k->v[0] * r + k->v[1] * g + k->v[2] * b + 128) >> 8) + 128;
+  }
+}
+
+static int _convert_rows_none(const uint8_t* row0, const uint8_t* row1,
+                              uint8_t* y0, uint8_t* y1,
+                              uint8_t* u, uint8_t* v,
+                              int width, const struct color_coeffs_s* k)
+{
+  return 0;
+}
+
+#ifdef COLOR_CONVERT_X86
+
+/*
+ * The x86 kernels share one shape. Four registers of BGRA pixels are
+ * transposed into B, G and R byte vectors (pshufb gathers each channel of
+ * four pixels into a dword, then a 4x4 dword transpose). Luma is computed in
+ * 16 bit lanes; chroma sums horizontal pairs with pmaddubsw, adds the second
+ * row and averages before applying the matrix. Wider kernels do the same per
+ * 128 bit lane and fix the pixel order with one cross-lane permute.
+ */
+
+#define SSE41 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+#define AVX512 __attribute__((target("avx512f,avx512bw")))
+
+static SSE41 inline void _deinterleave_sse41(const uint8_t* px, __m128i shuf,
+                                             __m128i* b, __m128i* g,
+                                             __m128i* r)
+{
+  const __m128i* in = (const __m128i*)px;
+  __m128i s0 = _mm_shuffle_epi8(_mm_loadu_si128(in + 0), shuf);
+  __m128i s1 = _mm_shuffle_epi8(_mm_loadu_si128(in + 1), shuf);
+  __m128i s2 = _mm_shuffle_epi8(_mm_loadu_si128(in + 2), shuf);
+  __m128i s3 = _mm_shuffle_epi8(_mm_loadu_si128(in + 3), shuf);
+  __m128i t0 = _mm_unpacklo_epi32(s0, s1);
+  __m128i t1 = _mm_unpackhi_epi32(s0, s1);
+  __m128i t2 = _mm_unpacklo_epi32(s2, s3);
+  __m128i t3 = _mm_unpackhi_epi32(s2, s3);
+  *b = _mm_unpacklo_epi64(t0, t2);
+  *g = _mm_unpackhi_epi64(t0, t2);
+  *r = _mm_unpacklo_epi64(t1, t3);
+}
+
+static SSE41 inline __m128i _matrix_sse41(__m128i r, __m128i g, __m128i b,
+                                          __m128i kr, __m128i kg, __m128i kb)
+{
+  __m128i sum = _mm_add_epi16(_mm_mullo_epi16(r, kr), _mm_mullo_epi16(g, kg));
+  sum = _mm_add_epi16(sum, _mm_mullo_epi16(b, kb));
+  return _mm_add_epi16(sum, _mm_set1_epi16(128));
+}
+
+static SSE41 inline __m128i _luma_sse41(__m128i r, __m128i g, __m128i b,
+                                        const struct color_coeffs_s* k)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i kr = _mm_set1_epi16(k->y[0]);
+  const __m128i kg = _mm_set1_epi16(k->y[1]);
+  const __m128i kb = _mm_set1_epi16(k->y[2]);
+  const __m128i offset = _mm_set1_epi16(16);
+  __m128i lo = _matrix_sse41(_mm_unpacklo_epi8(r, zero),
+                             _mm_unpacklo_epi8(g, zero),
+                             _mm_unpacklo_epi8(b, zero), kr, kg, kb);
+  __m128i hi = _matrix_sse41(_mm_unpackhi_epi8(r, zero),
+                             _mm_unpackhi_epi8(g, zero),
+                             _mm_unpackhi_epi8(b, zero), kr, kg, kb);
+  lo = _mm_add_epi16(_mm_srli_epi16(lo, 8), offset);
+  hi = _mm_add_epi16(_mm_srli_epi16(hi, 8), offset);
+  return _mm_packus_epi16(lo, hi);
+}
+
+// 2x2 box average of one channel, as 16 bit lanes.
+static SSE41 inline __m128i _box_sse41(__m128i c0, __m128i c1) {
+  const __m128i ones = _mm_set1_epi8(1);
+  __m128i sum = _mm_add_epi16(_mm_maddubs_epi16(c0, ones),
+                              _mm_maddubs_epi16(c1, ones));
+  return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+static SSE41 inline __m128i _chroma_sse41(__m128i r, __m128i g, __m128i b,
+                                          const int16_t* coeffs)
+{
+  __m128i c = _matrix_sse41(r, g, b,
+                            _mm_set1_epi16(coeffs[0]),
+                            _mm_set1_epi16(coeffs[1]),
+                            _mm_set1_epi16(coeffs[2]));
+  c = _mm_add_epi16(_mm_srai_epi16(c, 8), _mm_set1_epi16(128));
+  return _mm_packus_epi16(c, c);
+}
+
+static SSE41 int _convert_rows_sse41(const uint8_t* row0, const uint8_t* row1,
+                                     uint8_t* y0, uint8_t* y1,
+                                     uint8_t* u, uint8_t* v,
+                                     int width, const struct color_coeffs_s* k)
+{
+  const __m128i shuf = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13,
+                                     2, 6, 10, 14, 3, 7, 11, 15);
+  int i = 0;
+  for (; i + 16 <= width; i += 16) {
+    __m128i b0, g0, r0, b1, g1, r1;
+    _deinterleave_sse41(row0 + i * 4, shuf, &b0, &g0, &r0);
+    _deinterleave_sse41(row1 + i * 4, shuf, &b1, &g1, &r1);
+    _mm_storeu_si128((__m128i*)(y0 + i), _luma_sse41(r0, g0, b0, k));
+    _mm_storeu_si128((__m128i*)(y1 + i), _luma_sse41(r1, g1, b1, k));
+    __m128i b = _box_sse41(b0, b1);
+    __m128i g = _box_sse41(g0, g1);
+    __m128i r = _box_sse41(r0, r1);
+    _mm_storel_epi64((__m128i*)(u + i / 2), _chroma_sse41(r, g, b, k->u));
+    _mm_storel_epi64((__m128i*)(v + i / 2), _chroma_sse41(r, g, b, k->v));
+  }
+  return i;
+}
+
+static AVX2 inline void _deinterleave_avx2(const uint8_t* px, __m256i shuf,
+                                           __m256i* b, __m256i* g, __m256i* r)
+{
+  // lane 0 of each load holds pixel groups 0, 2, 4, 6; lane 1 the odd ones
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  const __m256i* in = (const __m256i*)px;
+  __m256i s0 = _mm256_shuffle_epi8(_mm256_loadu_si256(in + 0), shuf);
+  __m256i s1 = _mm256_shuffle_epi8(_mm256_loadu_si256(in + 1), shuf);
+  __m256i s2 = _mm256_shuffle_epi8(_mm256_loadu_si256(in + 2), shuf);
+  __m256i s3 = _mm256_shuffle_epi8(_mm256_loadu_si256(in + 3), shuf);
+  __m256i t0 = _mm256_unpacklo_epi32(s0, s1);
+  __m256i t1 = _mm256_unpackhi_epi32(s0, s1);
+  __m256i t2 = _mm256_unpacklo_epi32(s2, s3);
+  __m256i t3 = _mm256_unpackhi_epi32(s2, s3);
+  *b = _mm256_permutevar8x32_epi32(_mm256_unpacklo_epi64(t0, t2), order);
+  *g = _mm256_permutevar8x32_epi32(_mm256_unpackhi_epi64(t0, t2), order);
+  *r = _mm256_permutevar8x32_epi32(_mm256_unpacklo_epi64(t1, t3), order);
+}
+
+static AVX2 inline __m256i _matrix_avx2(__m256i r, __m256i g, __m256i b,
+                                        __m256i kr, __m256i kg, __m256i kb)
+{
+  __m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(r, kr),
+                                 _mm256_mullo_epi16(g, kg));
+  sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(b, kb));
+  return _mm256_add_epi16(sum, _mm256_set1_epi16(128));
+}
+
+static AVX2 inline __m256i _luma_avx2(__m256i r, __m256i g, __m256i b,
+                                      const struct color_coeffs_s* k)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i kr = _mm256_set1_epi16(k->y[0]);
+  const __m256i kg = _mm256_set1_epi16(k->y[1]);
+  const __m256i kb = _mm256_set1_epi16(k->y[2]);
+  const __m256i offset = _mm256_set1_epi16(16);
+  __m256i lo = _matrix_avx2(_mm256_unpacklo_epi8(r, zero),
+                            _mm256_unpacklo_epi8(g, zero),
+                            _mm256_unpacklo_epi8(b, zero), kr, kg, kb);
+  __m256i hi = _matrix_avx2(_mm256_unpackhi_epi8(r, zero),
+                            _mm256_unpackhi_epi8(g, zero),
+                            _mm256_unpackhi_epi8(b, zero), kr, kg, kb);
+  lo = _mm256_add_epi16(_mm256_srli_epi16(lo, 8), offset);
+  hi = _mm256_add_epi16(_mm256_srli_epi16(hi, 8), offset);
+  // unpack and pack are both per lane, so this restores the input order
+  return _mm256_packus_epi16(lo, hi);
+}
+
+static AVX2 inline __m256i _box_avx2(__m256i c0, __m256i c1) {
+  const __m256i ones = _mm256_set1_epi8(1);
+  __m256i sum = _mm256_add_epi16(_mm256_maddubs_epi16(c0, ones),
+                                 _mm256_maddubs_epi16(c1, ones));
+  return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+static AVX2 inline __m128i _chroma_avx2(__m256i r, __m256i g, __m256i b,
+                                        const int16_t* coeffs)
+{
+  __m256i c = _matrix_avx2(r, g, b,
+                           _mm256_set1_epi16(coeffs[0]),
+                           _mm256_set1_epi16(coeffs[1]),
+                           _mm256_set1_epi16(coeffs[2]));
+  c = _mm256_add_epi16(_mm256_srai_epi16(c, 8), _mm256_set1_epi16(128));
+  c = _mm256_packus_epi16(c, c);
+  c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(3, 1, 2, 0));
+  return _mm256_castsi256_si128(c);
+}
+
+static AVX2 int _convert_rows_avx2(const uint8_t* row0, const uint8_t* row1,
+                                   uint8_t* y0, uint8_t* y1,
+                                   uint8_t* u, uint8_t* v,
+                                   int width, const struct color_coeffs_s* k)
+{
+  const __m256i shuf = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13,
+                                        2, 6, 10, 14, 3, 7, 11, 15,
+                                        0, 4, 8, 12, 1, 5, 9, 13,
+                                        2, 6, 10, 14, 3, 7, 11, 15);
+  int i = 0;
+  for (; i + 32 <= width; i += 32) {
+    __m256i b0, g0, r0, b1, g1, r1;
+    _deinterleave_avx2(row0 + i * 4, shuf, &b0, &g0, &r0);
+    _deinterleave_avx2(row1 + i * 4, shuf, &b1, &g1, &r1);
+    _mm256_storeu_si256((__m256i*)(y0 + i), _luma_avx2(r0, g0, b0, k));
+    _mm256_storeu_si256((__m256i*)(y1 + i), _luma_avx2(r1, g1, b1, k));
+    __m256i b = _box_avx2(b0, b1);
+    __m256i g = _box_avx2(g0, g1);
+    __m256i r = _box_avx2(r0, r1);
+    _mm_storeu_si128((__m128i*)(u + i / 2), _chroma_avx2(r, g, b, k->u));
+    _mm_storeu_si128((__m128i*)(v + i / 2), _chroma_avx2(r, g, b, k->v));
+  }
+  return i;
+}
+
+static AVX512 inline void _deinterleave_avx512(const uint8_t* px,
+                                               __m512i shuf,
+                                               __m512i* b, __m512i* g,
+                                               __m512i* r)
+{
+  // lane j of load k holds pixel group 4k + j
+  const __m512i order = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13,
+                                          2, 6, 10, 14, 3, 7, 11, 15);
+  const __m512i* in = (const __m512i*)px;
+  __m512i s0 = _mm512_shuffle_epi8(_mm512_loadu_si512(in + 0), shuf);
+  __m512i s1 = _mm512_shuffle_epi8(_mm512_loadu_si512(in + 1), shuf);
+  __m512i s2 = _mm512_shuffle_epi8(_mm512_loadu_si512(in + 2), shuf);
+  __m512i s3 = _mm512_shuffle_epi8(_mm512_loadu_si512(in + 3), shuf);
+  __m512i t0 = _mm512_unpacklo_epi32(s0, s1);
+  __m512i t1 = _mm512_unpackhi_epi32(s0, s1);
+  __m512i t2 = _mm512_unpacklo_epi32(s2, s3);
+  __m512i t3 = _mm512_unpackhi_epi32(s2, s3);
+  *b = _mm512_permutexvar_epi32(order, _mm512_unpacklo_epi64(t0, t2));
+  *g = _mm512_permutexvar_epi32(order, _mm512_unpackhi_epi64(t0, t2));
+  *r = _mm512_permutexvar_epi32(order, _mm512_unpacklo_epi64(t1, t3));
+}
+
+static AVX512 inline __m512i _matrix_avx512(__m512i r, __m512i g, __m512i b,
+                                            __m512i kr, __m512i kg,
+                                            __m512i kb)
+{
+  __m512i sum = _mm512_add_epi16(_mm512_mullo_epi16(r, kr),
+                                 _mm512_mullo_epi16(g, kg));
+  sum = _mm512_add_epi16(sum, _mm512_mullo_epi16(b, kb));
+  return _mm512_add_epi16(sum, _mm512_set1_epi16(128));
+}
+
+static AVX512 inline __m512i _luma_avx512(__m512i r, __m512i g, __m512i b,
+                                          const struct color_coeffs_s* k)
+{
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i kr = _mm512_set1_epi16(k->y[0]);
+  const __m512i kg = _mm512_set1_epi16(k->y[1]);
+  const __m512i kb = _mm512_set1_epi16(k->y[2]);
+  const __m512i offset = _mm512_set1_epi16(16);
+  __m512i lo = _matrix_avx512(_mm512_unpacklo_epi8(r, zero),
+                              _mm512_unpacklo_epi8(g, zero),
+                              _mm512_unpacklo_epi8(b, zero), kr, kg, kb);
+  __m512i hi = _matrix_avx512(_mm512_unpackhi_epi8(r, zero),
+                              _mm512_unpackhi_epi8(g, zero),
+                              _mm512_unpackhi_epi8(b, zero), kr, kg, kb);
+  lo = _mm512_add_epi16(_mm512_srli_epi16(lo, 8), offset);
+  hi = _mm512_add_epi16(_mm512_srli_epi16(hi, 8), offset);
+  return _mm512_packus_epi16(lo, hi);
+}
+
+static AVX512 inline __m512i _box_avx512(__m512i c0, __m512i c1) {
+  const __m512i ones = _mm512_set1_epi8(1);
+  __m512i sum = _mm512_add_epi16(_mm512_maddubs_epi16(c0, ones),
+                                 _mm512_maddubs_epi16(c1, ones));
+  return _mm512_srli_epi16(_mm512_add_epi16(sum, _mm512_set1_epi16(2)), 2);
+}
+
+static AVX512 inline __m256i _chroma_avx512(__m512i r, __m512i g, __m512i b,
+                                            const int16_t* coeffs)
+{
+  const __m512i order = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
+  __m512i c = _matrix_avx512(r, g, b,
+                             _mm512_set1_epi16(coeffs[0]),
+                             _mm512_set1_epi16(coeffs[1]),
+                             _mm512_set1_epi16(coeffs[2]));
+  c = _mm512_add_epi16(_mm512_srai_epi16(c, 8), _mm512_set1_epi16(128));
+  c = _mm512_packus_epi16(c, c);
+  c = _mm512_permutexvar_epi64(order, c);
+  return _mm512_castsi512_si256(c);
+}
+
+static AVX512 int _convert_rows_avx512(const uint8_t* row0,
+                                       const uint8_t* row1,
+                                       uint8_t* y0, uint8_t* y1,
+                                       uint8_t* u, uint8_t* v,
+                                       int width,
+                                       const struct color_coeffs_s* k)
+{
+  const __m512i shuf = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 4, 8, 12,
+                                                            1, 5, 9, 13,
+                                                            2, 6, 10, 14,
+                                                            3, 7, 11, 15));
+  int i = 0;
+  for (; i + 64 <= width; i += 64) {
+    __m512i b0, g0, r0, b1, g1, r1;
+    _deinterleave_avx512(row0 + i * 4, shuf, &b0, &g0, &r0);
+    _deinterleave_avx512(row1 + i * 4, shuf, &b1, &g1, &r1);
+    _mm512_storeu_si512((__m512i*)(y0 + i), _luma_avx512(r0, g0, b0, k));
+    _mm512_storeu_si512((__m512i*)(y1 + i), _luma_avx512(r1, g1, b1, k));
+    __m512i b = _box_avx512(b0, b1);
+    __m512i g = _box_avx512(g0, g1);
+    __m512i r = _box_avx512(r0, r1);
+    _mm256_storeu_si256((__m256i*)(u + i / 2), _chroma_avx512(r, g, b, k->u));
+    _mm256_storeu_si256((__m256i*)(v + i / 2), _chroma_avx512(r, g, b, k->v));
+  }
+  // finish what fits in narrower vectors before the C tail
+  return i + _convert_rows_avx2(row0 + i * 4, row1 + i * 4, y0 + i, y1 + i,
+                                u + i / 2, v + i / 2, width - i, k);
+}
+
+#endif /* COLOR_CONVERT_X86 */
+
+static const struct {
+  const char* name;
+  int cpu_features;
+  convert_rows_fn fn;
+} kernels[] = {
+#ifdef COLOR_CONVERT_X86
+  { "avx512", CPU_FEATURE_AVX512BW, _convert_rows_avx512 },
+  { "avx2", CPU_FEATURE_AVX2, _convert_rows_avx2 },
+  { "sse4.1", CPU_FEATURE_SSE41, _convert_rows_sse41 },
+#endif
+  { "c", 0, _convert_rows_none },
+};
+
+#define KERNEL_COUNT (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+static int kernel = KERNEL_COUNT - 1;
+static convert_rows_fn convert_rows = _convert_rows_none;
+
+static void _convert(convert_rows_fn fn,
+                     const uint8_t* src, int src_stride,
+                     uint8_t* const dst[3], const int dst_stride[3],
+                     int width, int height, const struct color_coeffs_s* k)
+{
+  for (int j = 0; j < height; j += 2) {
+    // an odd trailing row is paired with itself
+    const uint8_t* row0 = src + (int64_t)j * src_stride;
+    const uint8_t* row1 = j + 1 < height ? row0 + src_stride : row0;
+    uint8_t* y0 = dst[0] + (int64_t)j * dst_stride[0];
+    uint8_t* y1 = j + 1 < height ? y0 + dst_stride[0] : y0;
+    uint8_t* u = dst[1] + (int64_t)(j / 2) * dst_stride[1];
+    uint8_t* v = dst[2] + (int64_t)(j / 2) * dst_stride[2];
+    int done = fn(row0, row1, y0, y1, u, v, width, k);
+    _convert_rows_c(row0, row1, y0, y1, u, v, done, width, k);
+  }
+}
+
+void color_convert_bgra_to_i420(const uint8_t* src, int src_stride,
+                                uint8_t* const dst[3], const int dst_stride[3],
+                                int width, int height,
+                                enum color_convert_matrix matrix)
+{
+  _convert(convert_rows, src, src_stride, dst, dst_stride, width, height,
+           &matrices[matrix]);
+}
+
+void color_convert_pixel(uint8_t b, uint8_t g, uint8_t r,
+                         enum color_convert_matrix matrix,
+                         uint8_t* y, uint8_t* u, uint8_t* v)
+{
+  const struct color_coeffs_s* k = &matrices[matrix];
+  const uint8_t px[3] = { b, g, r };
+  *y = _luma(px, k);
+  *u = ((k->u[0] * r + k->u[1] * g + k->u[2] * b + 128) >> 8) + 128;
+  *v = ((k->v[0] * r + k->v[1] * g + k->v[2] * b + 128) >> 8) + 128;
+}
+
+// Output columns per pass of the half scale path; keeps its scratch rows on
+// the stack and in L1.
+#define HALF_CHUNK 256
+
+// Averages 2x2 blocks of two source rows into one row of width pixels.
+static void _box_half_row(const uint8_t* row0, const uint8_t* row1,
+                          uint8_t* out, int width)
+{
+  for (int i = 0; i < width * 4; i += 4) {
+    const uint8_t* p0 = row0 + i * 2;
+    const uint8_t* p1 = row1 + i * 2;
+    for (int c = 0; c < 4; c++) {
+      out[i + c] = (p0[c] + p0[c + 4] + p1[c] + p1[c + 4] + 2) >> 2;
+    }
+  }
+}
+
+void color_convert_bgra_to_i420_half(const uint8_t* src, int src_stride,
+                                     uint8_t* const dst[3],
+                                     const int dst_stride[3],
+                                     int width, int height,
+                                     enum color_convert_matrix matrix)
+{
+  const struct color_coeffs_s* k = &matrices[matrix];
+  uint8_t scratch[2][HALF_CHUNK * 4];
+  for (int j = 0; j < height; j += 2) {
+    // an odd trailing row is paired with itself
+    const uint8_t* src0 = src + (int64_t)j * 2 * src_stride;
+    const uint8_t* src1 = j + 1 < height ? src0 + 2 * src_stride : src0;
+    uint8_t* y0 = dst[0] + (int64_t)j * dst_stride[0];
+    uint8_t* y1 = j + 1 < height ? y0 + dst_stride[0] : y0;
+    uint8_t* u = dst[1] + (int64_t)(j / 2) * dst_stride[1];
+    uint8_t* v = dst[2] + (int64_t)(j / 2) * dst_stride[2];
+    for (int x = 0; x < width; x += HALF_CHUNK) {
+      int chunk = FFMIN(HALF_CHUNK, width - x);
+      _box_half_row(src0 + x * 8, src0 + src_stride + x * 8,
+                    scratch[0], chunk);
+      _box_half_row(src1 + x * 8, src1 + src_stride + x * 8,
+                    scratch[1], chunk);
+      int done = convert_rows(scratch[0], scratch[1], y0 + x, y1 + x,
+                              u + x / 2, v + x / 2, chunk, k);
+      _convert_rows_c(scratch[0], scratch[1], y0 + x, y1 + x,
+                      u + x / 2, v + x / 2, done, chunk, k);
+    }
+  }
+}
+
+int color_convert_use_kernel(int index) {
+  if (index < 0 || index >= KERNEL_COUNT ||
+      !cpu_features_has(kernels[index].cpu_features))
+  {
+    return EINVAL;
+  }
+  kernel = index;
+  convert_rows = kernels[index].fn;
+  return 0;
+}
+
+void color_convert_init(void) {
+  int i = 0;
+  while (color_convert_use_kernel(i)) {
+    i++;
+  }
+  printf("color_convert: using %s kernel\n", kernels[i].name);
+}
+
+char color_convert_is_accelerated(void) {
+  return kernel != KERNEL_COUNT - 1;
+}
+
+const char* color_convert_kernel_name(void) {
+  return kernels[kernel].name;
+}
+
+int color_convert_get_kernel_count(void) {
+  return KERNEL_COUNT;
+}
+
+const char* color_convert_get_kernel_name(int index) {
+  return kernels[index].name;
+}
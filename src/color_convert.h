@@ -0,0 +1,68 @@
+//
+//  color_convert.h
+//  x11pulsemux
+//
+
+#ifndef color_convert_h
+#define color_convert_h
+
+#include <stdint.h>
+
+enum color_convert_matrix {
+  COLOR_CONVERT_BT601,
+  COLOR_CONVERT_BT709,
+};
+
+/**
+ * Selects the widest conversion kernel this CPU supports (AVX-512, AVX2 or
+ * SSE4.1). Call once before converting.
+ */
+void color_convert_init(void);
+
+/**
+ * Nonzero when a SIMD kernel is active. Otherwise callers should prefer
+ * libswscale for whole frames; color_convert_bgra_to_i420 still works but
+ * runs the portable C path.
+ */
+char color_convert_is_accelerated(void);
+const char* color_convert_kernel_name(void);
+
+// Kernels in this build, widest first; the last is the portable C path.
+int color_convert_get_kernel_count(void);
+const char* color_convert_get_kernel_name(int index);
+// Switches to kernel index, so tests can compare them. EINVAL if this CPU
+// cannot run it. Not synchronized with conversions in flight.
+int color_convert_use_kernel(int index);
+
+/**
+ * Packed 32 bit BGRA/BGR0 to planar I420 (limited range), with 2x2
+ * averaged chroma, in a single pass over the source. The alpha byte is
+ * ignored.
+ *
+ * dst points at the top left output sample of each plane, so callers can
+ * convert a sub-rectangle of a larger picture by offsetting the pointers.
+ * Rectangles should start on even coordinates to keep chroma sites aligned.
+ */
+void color_convert_bgra_to_i420(const uint8_t* src, int src_stride,
+                                uint8_t* const dst[3], const int dst_stride[3],
+                                int width, int height,
+                                enum color_convert_matrix matrix);
+
+// One pixel through the same matrix, for small overlays such as the cursor.
+void color_convert_pixel(uint8_t b, uint8_t g, uint8_t r,
+                         enum color_convert_matrix matrix,
+                         uint8_t* y, uint8_t* u, uint8_t* v);
+
+/**
+ * Same as color_convert_bgra_to_i420, but shrinks by exactly half on the
+ * way: each output pixel is the box average of a 2x2 source block. width and
+ * height are the output size; src must cover twice that. Scaling happens on
+ * a few rows at a time, so no full size intermediate is ever written.
+ */
+void color_convert_bgra_to_i420_half(const uint8_t* src, int src_stride,
+                                     uint8_t* const dst[3],
+                                     const int dst_stride[3],
+                                     int width, int height,
+                                     enum color_convert_matrix matrix);
+
+#endif /* color_convert_h */
@@ -0,0 +1,48 @@
+//
+//  cpu_features.c
+//  x11pulsemux
+//
+
+#include "cpu_features.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_FEATURES_X86 1
+#endif
+
+static int _detect(void) {
+  int features = 0;
+#ifdef CPU_FEATURES_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    features |= CPU_FEATURE_SSE2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    features |= CPU_FEATURE_SSE41;
+  }
+  if (__builtin_cpu_supports("avx")) {
+    features |= CPU_FEATURE_AVX;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    features |= CPU_FEATURE_AVX2;
+  }
+  if (__builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512bw"))
+  {
+    features |= CPU_FEATURE_AVX512BW;
+  }
+#endif
+  return features;
+}
+
+int cpu_features_get(void) {
+  // detection is idempotent, so racing first callers agree
+  static int features = -1;
+  if (features < 0) {
+    features = _detect();
+  }
+  return features;
+}
+
+char cpu_features_has(int features) {
+  return (cpu_features_get() & features) == features;
+}
@@ -0,0 +1,29 @@
+//
+//  cpu_features.h
+//  x11pulsemux
+//
+
+#ifndef cpu_features_h
+#define cpu_features_h
+
+/**
+ * Instruction set extensions the SIMD kernels in this tree are written for.
+ * Each module lists its kernels widest first with the features they need and
+ * takes the first one cpu_features_has allows; the portable C kernel needs
+ * none, so there is always a match.
+ */
+enum cpu_feature {
+  CPU_FEATURE_SSE2 = 1 << 0,
+  CPU_FEATURE_SSE41 = 1 << 1,
+  CPU_FEATURE_AVX = 1 << 2,
+  CPU_FEATURE_AVX2 = 1 << 3,
+  // AVX-512 foundation plus byte and word instructions
+  CPU_FEATURE_AVX512BW = 1 << 4,
+};
+
+// Detected on first use; always 0 off x86.
+int cpu_features_get(void);
+// Nonzero when this CPU has every feature in the mask.
+char cpu_features_has(int features);
+
+#endif /* cpu_features_h */
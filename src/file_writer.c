@@ -6,16 +6,20 @@
 //
 
 #include "file_writer.h"
+#include "media_clock.h"
 #include <stdlib.h>
+#include <string.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavfilter/avfilter.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/audio_fifo.h>
+#include <libavutil/avstring.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
 #include <libswresample/swresample.h>
+#include <libswscale/swscale.h>
 #include <assert.h>
 
 // Workaround C++ issue with ffmpeg macro
@@ -31,35 +35,96 @@ const int out_audio_format = AV_SAMPLE_FMT_FLTP;
 const int out_audio_num_channels = 1;
 
 const char *video_filter_descr = "null";
-const char *audio_filter_descr = "aresample=48000,aformat=sample_fmts=s16:channel_layouts=stereo";
+// The sink's format constraints pull in a single aresample that converts
+// rate, layout and sample format in one pass.
+const char *audio_filter_descr = "anull";
 
 const AVRational global_time_base = { 1, 1000 };
+const double default_max_frame_gap = 1.0;
 const int64_t out_sample_rate = 48000;
 
+// Stage queue depths. Video is shallow: a slow encoder loses the oldest
+// frames after a few, rather than falling further behind. Audio never
+// drops; it has room for ~0.7s of the audio thread waiting out a segment
+// swap. Packets cover both streams' bursts (keyframes, encoder delay
+// flushes).
+static const int video_queue_capacity = 8;
+static const int audio_queue_capacity = 32;
+static const int packet_queue_capacity = 128;
+// packets the latency percentiles are taken over, per stream
+static const int latency_window_size = 1024;
+
+// what travels from the push functions to the encode threads
+struct file_writer_job_s {
+  AVFrame* frame;
+  double timestamp;
+  char duplicate;
+  // video: push order, so the encode thread can tell a frame was evicted
+  int64_t seq;
+};
+
 static int init_audio_filters(struct file_writer_t* file_writer,
-                              const char *filters_descr);
+                              const char *filters_descr, AVFrame* frame);
 static int init_video_filters(struct file_writer_t* file_writer,
                               const char *filters_descr,
                               int out_width, int out_height);
 static int open_output_file(struct file_writer_t* file_writer,
                             const char* filename);
+static int start_threads(struct file_writer_t* file_writer);
+static void stop_threads(struct file_writer_t* file_writer);
+static void latency_map_reset(struct file_writer_latency_map_s* map);
 
 int file_writer_alloc(struct file_writer_t** writer) {
   struct file_writer_t* result =
   (struct file_writer_t*) calloc(1, sizeof(struct file_writer_t));
-  uv_mutex_init(&result->write_lock);
+  uv_mutex_init(&result->segment_lock);
+  h264_skip_alloc(&result->skip);
+  frame_pool_alloc(&result->resize_pool);
+  stage_queue_alloc(&result->video_queue, video_queue_capacity,
+                    sizeof(struct file_writer_job_s));
+  stage_queue_alloc(&result->audio_queue, audio_queue_capacity,
+                    sizeof(struct file_writer_job_s));
+  stage_queue_alloc(&result->packet_queue, packet_queue_capacity,
+                    sizeof(AVPacket));
+  uv_mutex_init(&result->stats_lock);
+  sample_window_alloc(&result->video_latency, latency_window_size);
+  sample_window_alloc(&result->audio_latency, latency_window_size);
+  latency_map_reset(&result->video_latency_map);
+  latency_map_reset(&result->audio_latency_map);
   *writer = result;
   return 0;
 }
 
 void file_writer_free(struct file_writer_t* writer) {
-  uv_mutex_destroy(&writer->write_lock);
+  av_frame_free(&writer->pending_duplicate);
+  h264_skip_free(writer->skip);
+  sws_freeContext(writer->resize_sws);
+  frame_pool_free(writer->resize_pool);
+  av_free(writer->filename);
+  // file_writer_close drained these
+  stage_queue_free(writer->video_queue);
+  stage_queue_free(writer->audio_queue);
+  stage_queue_free(writer->packet_queue);
+  interleaver_free(writer->interleaver);
+  sample_window_free(writer->video_latency);
+  sample_window_free(writer->audio_latency);
+  uv_mutex_destroy(&writer->stats_lock);
+  uv_mutex_destroy(&writer->segment_lock);
   free(writer);
 }
 
-int file_writer_open(struct file_writer_t* file_writer,
-                     const char* filename,
-                     int out_width, int out_height)
+void file_writer_load_config(struct file_writer_t* writer,
+                             struct file_writer_config_s* config)
+{
+  memcpy(&writer->config, config, sizeof(struct file_writer_config_s));
+  if (writer->config.max_frame_gap <= 0) {
+    writer->config.max_frame_gap = default_max_frame_gap;
+  }
+}
+
+static int open_segment(struct file_writer_t* file_writer,
+                        const char* filename,
+                        int out_width, int out_height)
 {
   printf("file_writer_open: width=%d, height=%d filename=%s\n",
          out_width, out_height, filename);
@@ -67,12 +132,9 @@ int file_writer_open(struct file_writer_t* file_writer,
   file_writer->out_height = out_height;
   file_writer->out_width = out_width;
   
-  open_output_file(file_writer, filename);
-  
-  ret = init_audio_filters(file_writer, audio_filter_descr);
-  if (ret < 0)
-  {
-    printf("Error: init audio filters\n");
+  ret = open_output_file(file_writer, filename);
+  if (ret < 0) {
+    printf("Error: open output file %s\n", filename);
     return ret;
   }
   
@@ -86,9 +148,33 @@ int file_writer_open(struct file_writer_t* file_writer,
   return ret;
 }
 
+int file_writer_open(struct file_writer_t* file_writer,
+                     const char* filename,
+                     int out_width, int out_height)
+{
+  av_free(file_writer->filename);
+  file_writer->filename = av_strdup(filename);
+  file_writer->segment_index = 0;
+  file_writer->segment_start_timestamp = 0;
+  int ret = open_segment(file_writer, filename, out_width, out_height);
+  if (ret < 0) {
+    return ret;
+  }
+  ret = start_threads(file_writer);
+  if (ret) {
+    printf("file_writer_open: cannot start the encode threads: %s\n",
+           uv_strerror(ret));
+    // pushes fail from here on instead of filling queues nobody reads
+    stop_threads(file_writer);
+  }
+  return ret;
+}
 
+
+// Builds the audio graph for input shaped like frame. Only needed when the
+// source does not already deliver what the encoder takes.
 static int init_audio_filters(struct file_writer_t* file_writer,
-                              const char *filters_descr)
+                              const char *filters_descr, AVFrame* frame)
 {
   char args[512];
   int ret = 0;
@@ -96,11 +182,10 @@ static int init_audio_filters(struct file_writer_t* file_writer,
   AVFilter *abuffersink = avfilter_get_by_name("abuffersink");
   AVFilterInOut *outputs = avfilter_inout_alloc();
   AVFilterInOut *inputs  = avfilter_inout_alloc();
-  static enum AVSampleFormat out_sample_fmts[2];
-  out_sample_fmts[0] = out_audio_format;
-  out_sample_fmts[1] = -1;
-  static const int64_t out_channel_layouts[] = { AV_CH_LAYOUT_STEREO, -1 };
-  static const int out_sample_rates[] = { 48000, -1 };
+  AVCodecContext* encoder = file_writer->audio_ctx_out;
+  enum AVSampleFormat out_sample_fmts[] = { encoder->sample_fmt, -1 };
+  int64_t out_channel_layouts[] = { encoder->channel_layout, -1 };
+  int out_sample_rates[] = { encoder->sample_rate, -1 };
   const AVFilterLink *outlink;
   AVRational time_base = { 1, out_sample_rate };
   
@@ -110,17 +195,15 @@ static int init_audio_filters(struct file_writer_t* file_writer,
     goto end;
   }
   
-  /* buffer audio source: the decoded frames from the decoder will be inserted here. */
-  if (!file_writer->audio_ctx_out->channel_layout) {
-    file_writer->audio_ctx_out->channel_layout =
-    av_get_default_channel_layout(file_writer->audio_ctx_out->channels);
-  }
+  /* buffer audio source: the captured frames will be inserted here. */
+  uint64_t channel_layout = frame->channel_layout ? frame->channel_layout :
+  av_get_default_channel_layout(frame->channels);
   snprintf(args, sizeof(args),
            "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64,
            time_base.num, time_base.den,
-           file_writer->audio_ctx_out->sample_rate,
-           av_get_sample_fmt_name(file_writer->audio_ctx_out->sample_fmt),
-           file_writer->audio_ctx_out->channel_layout);
+           frame->sample_rate,
+           av_get_sample_fmt_name(frame->format),
+           channel_layout);
   ret = avfilter_graph_create_filter(&file_writer->audio_buffersrc_ctx,
                                      abuffersrc, "in",
                                      args, NULL,
@@ -199,6 +282,12 @@ static int init_audio_filters(struct file_writer_t* file_writer,
   if ((ret = avfilter_graph_config(file_writer->audio_filter_graph,
                                    NULL)) < 0)
     goto end;
+
+  // cut output to the encoder's frame size
+  if (!(encoder->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)) {
+    av_buffersink_set_frame_size(file_writer->audio_buffersink_ctx,
+                                 encoder->frame_size);
+  }
   
   /* Print summary of the sink buffer
    * Note: args buffer is reused to store channel layout string */
@@ -372,6 +461,21 @@ static int init_resampler(AVCodecContext *input_codec_context,
   return 0;
 }
 
+// Releases whatever open_output_file got to, for close or a failed open.
+static void free_output_file(struct file_writer_t* file_writer) {
+  avcodec_free_context(&file_writer->video_ctx_out);
+  avcodec_free_context(&file_writer->audio_ctx_out);
+  if (file_writer->format_ctx_out) {
+    if (!(file_writer->format_ctx_out->oformat->flags & AVFMT_NOFILE)) {
+      avio_closep(&file_writer->format_ctx_out->pb);
+    }
+    avformat_free_context(file_writer->format_ctx_out);
+    file_writer->format_ctx_out = NULL;
+  }
+  file_writer->video_stream = NULL;
+  file_writer->audio_stream = NULL;
+}
+
 static int open_output_file(struct file_writer_t* file_writer,
                             const char* filename)
 {
@@ -389,7 +493,7 @@ static int open_output_file(struct file_writer_t* file_writer,
   // fall back to mpeg
   if (!file_writer->format_ctx_out) {
     printf("Could not allocate format output context");
-    exit(1);
+    return AVERROR(ENOMEM);
   }
   
   av_dump_format(file_writer->format_ctx_out, 0, filename, 1);
@@ -403,7 +507,7 @@ static int open_output_file(struct file_writer_t* file_writer,
     if (ret < 0) {
       fprintf(stderr, "Could not open '%s': %s\n", filename,
               av_err2str(ret));
-      exit(1);
+      goto fail;
     }
   }
   
@@ -411,35 +515,45 @@ static int open_output_file(struct file_writer_t* file_writer,
   file_writer->video_codec_out = avcodec_find_encoder(AV_CODEC_ID_H264);
   if (!file_writer->video_codec_out) {
     printf("Video codec not found\n");
-    exit(1);
+    ret = AVERROR_ENCODER_NOT_FOUND;
+    goto fail;
   }
   
   file_writer->audio_codec_out = avcodec_find_encoder(AV_CODEC_ID_AAC);
   if (!file_writer->audio_codec_out) {
     printf("Audio codec not found\n");
-    exit(1);
+    ret = AVERROR_ENCODER_NOT_FOUND;
+    goto fail;
   }
   
   file_writer->video_stream =
-  avformat_new_stream(file_writer->format_ctx_out,
-                      file_writer->video_codec_out);
+  avformat_new_stream(file_writer->format_ctx_out, NULL);
   file_writer->audio_stream =
-  avformat_new_stream(file_writer->format_ctx_out,
-                      file_writer->audio_codec_out);
+  avformat_new_stream(file_writer->format_ctx_out, NULL);
+  if (!file_writer->video_stream || !file_writer->audio_stream) {
+    printf("Could not allocate output streams\n");
+    ret = AVERROR(ENOMEM);
+    goto fail;
+  }
   
-  file_writer->video_ctx_out = file_writer->video_stream->codec;
+  file_writer->video_ctx_out =
+  avcodec_alloc_context3(file_writer->video_codec_out);
   if (!file_writer->video_ctx_out) {
     printf("Could not allocate video codec context\n");
-    exit(1);
+    ret = AVERROR(ENOMEM);
+    goto fail;
   }
-  file_writer->audio_ctx_out = file_writer->audio_stream->codec;
+  file_writer->audio_ctx_out =
+  avcodec_alloc_context3(file_writer->audio_codec_out);
   if (!file_writer->audio_ctx_out) {
     printf("Could not allocate audio codec context\n");
-    exit(1);
+    ret = AVERROR(ENOMEM);
+    goto fail;
   }
   
   file_writer->audio_stream->time_base.num = 1;
   file_writer->audio_stream->time_base.den = out_sample_rate;
+  file_writer->video_stream->time_base = global_time_base;
   
   // Codec configuration
   file_writer->audio_ctx_out->bit_rate = 192000;
@@ -447,6 +561,7 @@ static int open_output_file(struct file_writer_t* file_writer,
   file_writer->audio_ctx_out->sample_rate = out_sample_rate;
   file_writer->audio_ctx_out->channels = 2;
   file_writer->audio_ctx_out->channel_layout = AV_CH_LAYOUT_STEREO;
+  file_writer->audio_ctx_out->time_base = file_writer->audio_stream->time_base;
   
   /* put sample parameters */
   file_writer->video_ctx_out->qmin = 16;
@@ -456,6 +571,28 @@ static int open_output_file(struct file_writer_t* file_writer,
   file_writer->video_ctx_out->height = file_writer->out_height;
   file_writer->video_ctx_out->pix_fmt = out_pix_format;
   file_writer->video_ctx_out->time_base = global_time_base;
+  file_writer->video_ctx_out->color_range = AVCOL_RANGE_MPEG;
+  file_writer->video_ctx_out->colorspace = file_writer->config.colorspace;
+  if (file_writer->config.colorspace == AVCOL_SPC_BT709) {
+    file_writer->video_ctx_out->color_primaries = AVCOL_PRI_BT709;
+    file_writer->video_ctx_out->color_trc = AVCOL_TRC_BT709;
+  } else if (file_writer->config.colorspace == AVCOL_SPC_SMPTE170M) {
+    file_writer->video_ctx_out->color_primaries = AVCOL_PRI_SMPTE170M;
+    file_writer->video_ctx_out->color_trc = AVCOL_TRC_SMPTE170M;
+  }
+  // 0 threads lets the encoder pick (one per core for x264)
+  file_writer->video_ctx_out->thread_count = file_writer->config.video_threads;
+  if (file_writer->config.video_thread_type == FILE_WRITER_THREAD_FRAME) {
+    file_writer->video_ctx_out->thread_type = FF_THREAD_FRAME;
+  } else if (file_writer->config.video_thread_type ==
+             FILE_WRITER_THREAD_SLICE) {
+    file_writer->video_ctx_out->thread_type = FF_THREAD_SLICE;
+  }
+  if (file_writer->config.profile == FILE_WRITER_PROFILE_LIVE) {
+    // frame threads hold a frame back per thread
+    file_writer->video_ctx_out->thread_type = FF_THREAD_SLICE;
+    file_writer->video_ctx_out->max_b_frames = 0;
+  }
   //video_ctx_out->max_b_frames = 1;
   
   if (fmt->video_codec == AV_CODEC_ID_H264) {
@@ -466,6 +603,16 @@ static int open_output_file(struct file_writer_t* file_writer,
 //    av_opt_set(file_writer->video_ctx_out->priv_data,
 //               "profile", "baseline", 0);
     file_writer->video_ctx_out->profile = FF_PROFILE_H264_BASELINE;
+    if (file_writer->config.profile == FILE_WRITER_PROFILE_LIVE) {
+      av_opt_set(file_writer->video_ctx_out->priv_data,
+                 "tune", "zerolatency", 0);
+      av_opt_set(file_writer->video_ctx_out->priv_data,
+                 "rc-lookahead", "0", 0);
+      // refresh a column of macroblocks per frame rather than sending
+      // whole IDR frames
+      av_opt_set(file_writer->video_ctx_out->priv_data,
+                 "intra-refresh", "1", 0);
+    }
     file_writer->video_ctx_out->pix_fmt = AV_PIX_FMT_YUV420P;
   }
   
@@ -476,17 +623,32 @@ static int open_output_file(struct file_writer_t* file_writer,
   }
   
   /* open the context */
-  if (avcodec_open2(file_writer->video_ctx_out,
-                    file_writer->video_codec_out, NULL) < 0) {
-    printf("Could not open video codec\n");
-    exit(1);
+  ret = avcodec_open2(file_writer->video_ctx_out,
+                      file_writer->video_codec_out, NULL);
+  if (ret < 0) {
+    printf("Could not open video codec: %s\n", av_err2str(ret));
+    goto fail;
   }
+  h264_skip_observe(file_writer->skip, file_writer->video_ctx_out->extradata,
+                    file_writer->video_ctx_out->extradata_size);
   
   /* open the context */
-  if (avcodec_open2(file_writer->audio_ctx_out,
-                    file_writer->audio_codec_out, NULL) < 0) {
-    printf("Could not open audio codec\n");
-    exit(1);
+  ret = avcodec_open2(file_writer->audio_ctx_out,
+                      file_writer->audio_codec_out, NULL);
+  if (ret < 0) {
+    printf("Could not open audio codec: %s\n", av_err2str(ret));
+    goto fail;
+  }
+
+  ret = avcodec_parameters_from_context(file_writer->video_stream->codecpar,
+                                        file_writer->video_ctx_out);
+  if (ret >= 0) {
+    ret = avcodec_parameters_from_context(file_writer->audio_stream->codecpar,
+                                          file_writer->audio_ctx_out);
+  }
+  if (ret < 0) {
+    printf("Could not copy codec parameters: %s\n", av_err2str(ret));
+    goto fail;
   }
   
   /* Write the stream header, if any. */
@@ -494,74 +656,222 @@ static int open_output_file(struct file_writer_t* file_writer,
   if (ret < 0) {
     fprintf(stderr, "Error occurred when opening output file: %s\n",
             av_err2str(ret));
-    exit(1);
+    goto fail;
   }
   
-  printf("Ready to encode video file %s\n", filename);
+  printf("Ready to encode video file %s (%s profile, %d encoder threads, "
+         "%s)\n", filename,
+         file_writer->config.profile == FILE_WRITER_PROFILE_LIVE ?
+         "live" : "archive", file_writer->video_ctx_out->thread_count,
+         file_writer->video_ctx_out->active_thread_type == FF_THREAD_SLICE ?
+         "slice" : "frame");
   
   return 0;
+
+fail:
+  free_output_file(file_writer);
+  return ret;
+}
+
+static void latency_map_reset(struct file_writer_latency_map_s* map) {
+  map->head = 0;
+  map->count = 0;
+  map->last_capture_ts = AV_NOPTS_VALUE;
+}
+
+// Remembers the capture time of a frame about to enter the encoder. The
+// oldest entry goes if the encoder holds more frames than the map.
+static void latency_map_add(struct file_writer_latency_map_s* map,
+                            int64_t pts, int64_t capture_ts)
+{
+  if (capture_ts == AV_NOPTS_VALUE) {
+    return;
+  }
+  if (map->count == FILE_WRITER_LATENCY_MAP_SIZE) {
+    map->head = (map->head + 1) % FILE_WRITER_LATENCY_MAP_SIZE;
+    map->count--;
+  }
+  int tail = (map->head + map->count) % FILE_WRITER_LATENCY_MAP_SIZE;
+  map->pts[tail] = pts;
+  map->capture_ts[tail] = capture_ts;
+  map->count++;
+}
+
+// Capture time of the newest frame that went in at or before pts. An
+// encoder that rechunks (AAC) starts a packet inside an earlier frame; its
+// priming packets come before every frame and take the first one's.
+static int64_t latency_map_match(struct file_writer_latency_map_s* map,
+                                 int64_t pts)
+{
+  while (map->count && map->pts[map->head] <= pts) {
+    map->last_capture_ts = map->capture_ts[map->head];
+    map->head = (map->head + 1) % FILE_WRITER_LATENCY_MAP_SIZE;
+    map->count--;
+  }
+  if (map->last_capture_ts == AV_NOPTS_VALUE && map->count) {
+    return map->capture_ts[map->head];
+  }
+  return map->last_capture_ts;
+}
+
+static void record_latency(struct file_writer_t* pthis,
+                           struct sample_window_s* window, int64_t* packets,
+                           int64_t capture_ts)
+{
+  if (capture_ts == AV_NOPTS_VALUE) {
+    return;
+  }
+  int64_t latency_us = (media_clock_now() - capture_ts) / 1000;
+  uv_mutex_lock(&pthis->stats_lock);
+  sample_window_add(window, latency_us);
+  (*packets)++;
+  uv_mutex_unlock(&pthis->stats_lock);
+}
+
+static void write_ready_packets(struct file_writer_t* pthis, char flush);
+
+// Writes on the calling thread while the write thread is parked or gone,
+// still in dts order when the interleaver is there.
+static int write_packet_inline(struct file_writer_t* pthis, AVPacket* packet)
+{
+  if (!pthis->interleaver) {
+    return av_write_frame(pthis->format_ctx_out, packet);
+  }
+  AVRational time_base =
+  pthis->format_ctx_out->streams[packet->stream_index]->time_base;
+  int ret = interleaver_push(pthis->interleaver, packet, time_base);
+  if (ret) {
+    return ret;
+  }
+  write_ready_packets(pthis, 0);
+  return 0;
 }
 
+// Hands a packet to the write thread, which takes the reference over.
 static int safe_write_packet(struct file_writer_t* file_writer,
                              AVPacket* packet)
 {
-  uv_mutex_lock(&file_writer->write_lock);
-  int ret = av_interleaved_write_frame(file_writer->format_ctx_out, packet);
-  //int ret = av_write_frame(file_writer->format_ctx_out, packet);
-  uv_mutex_unlock(&file_writer->write_lock);
-  return ret;
+  if (file_writer->write_inline) {
+    return write_packet_inline(file_writer, packet);
+  }
+  AVPacket queued;
+  av_packet_move_ref(&queued, packet);
+  int ret = stage_queue_push(file_writer->packet_queue, &queued);
+  if (ret) {
+    av_packet_unref(&queued);
+    return AVERROR(ret);
+  }
+  return 0;
 }
 
-static int write_audio_frame(struct file_writer_t* pthis,
-                             AVFrame* frame)
-{
-  int got_packet, ret;
+// Writes every packet the audio encoder has ready.
+static int receive_audio_packets(struct file_writer_t* pthis) {
   AVPacket pkt = { 0 };
   av_init_packet(&pkt);
-  
-  /* encode the frame */
-  ret = avcodec_encode_audio2(pthis->audio_ctx_out,
-                              &pkt, frame, &got_packet);
-  if (ret < 0) {
-    fprintf(stderr, "Error encoding audio frame: %s\n", av_err2str(ret));
-    return 1;
-  }
-  if (got_packet) {
-    /* rescale output packet timestamp values from codec to stream timebase */
-//    av_packet_rescale_ts(&pkt, file_writer->audio_ctx_out->time_base,
-//                         file_writer->audio_stream->time_base);
+  int ret;
+  while (!(ret = avcodec_receive_packet(pthis->audio_ctx_out, &pkt))) {
     pkt.stream_index = pthis->audio_stream->index;
-
+    record_latency(pthis, pthis->audio_latency, &pthis->audio_latency_packets,
+                   latency_map_match(&pthis->audio_latency_map, pkt.pts));
     /* Write the compressed frame to the media file. */
     printf("file writer: Write audio frame %lld, size=%d pts=%lld "
            "duration=%lld\n",
            pthis->audio_frame_ct, pkt.size, pkt.pts, pkt.duration);
     pthis->audio_frame_ct++;
-    ret = safe_write_packet(pthis, &pkt);
-    if (ret) {
-      printf("write_audio_frame: safe_write_packet failed with %d\n", ret);
+    int write_ret = safe_write_packet(pthis, &pkt);
+    if (write_ret) {
+      printf("write_audio_frame: safe_write_packet failed with %d\n",
+             write_ret);
     }
-  } else {
-    ret = 0;
+    av_packet_unref(&pkt);
   }
-  av_packet_unref(&pkt);
+  if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+    return 0;
+  }
+  fprintf(stderr, "Error encoding audio frame: %s\n", av_err2str(ret));
   return ret;
 }
 
-// inserts audio frame into filtergraph
-int file_writer_push_audio_frame(struct file_writer_t* pthis,
-                                 AVFrame* frame, double timestamp)
+// A NULL frame drains the encoder.
+static int write_audio_frame(struct file_writer_t* pthis,
+                             AVFrame* frame)
+{
+  int ret = avcodec_send_frame(pthis->audio_ctx_out, frame);
+  if (ret < 0) {
+    fprintf(stderr, "Error encoding audio frame: %s\n", av_err2str(ret));
+    return ret;
+  }
+  return receive_audio_packets(pthis);
+}
+
+static char audio_frame_fits_encoder(struct file_writer_t* pthis,
+                                     AVFrame* frame)
+{
+  AVCodecContext* encoder = pthis->audio_ctx_out;
+  return frame->format == encoder->sample_fmt &&
+  frame->sample_rate == encoder->sample_rate &&
+  frame->channel_layout == encoder->channel_layout &&
+  (frame->nb_samples == encoder->frame_size ||
+   (encoder->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE));
+}
+
+void file_writer_get_audio_format(struct file_writer_t* pthis,
+                                  struct file_writer_audio_format_s* format)
+{
+  AVCodecContext* encoder = pthis->audio_ctx_out;
+  format->sample_fmt = encoder->sample_fmt;
+  format->sample_rate = encoder->sample_rate;
+  format->channel_layout = encoder->channel_layout;
+  format->frame_size =
+  encoder->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE ?
+  0 : encoder->frame_size;
+}
+
+// hands audio frame to the encoder, through the filtergraph if it needs
+// converting
+static int encode_audio_frame(struct file_writer_t* pthis,
+                              AVFrame* frame, double timestamp)
 {
   printf("file writer: audio_frame ts=%.02f nb_samples=%d\n",
          timestamp, frame->nb_samples);
+  if (!pthis->format_ctx_out) {
+    return AVERROR(EINVAL);
+  }
+  // audio from before a segment started belongs to the previous file,
+  // which is closed already
+  timestamp -= pthis->segment_start_timestamp;
+  if (timestamp < 0) {
+    return 0;
+  }
 
   // represent the global timestamp in the destination stream's timebase.
   AVRational time_base = pthis->audio_stream->time_base;
   int64_t frame_pts = timestamp * time_base.den;
   frame_pts /= time_base.num;
+  latency_map_add(&pthis->audio_latency_map, frame_pts, frame->pts);
   frame->pts = frame_pts;
 
   int ret;
+  // a source that already delivers the encoder's format skips the graph
+  if (audio_frame_fits_encoder(pthis, frame)) {
+    return write_audio_frame(pthis, frame);
+  }
+  if (!pthis->audio_filter_graph) {
+    printf("file writer: converting audio %s %dHz %d samples/frame to "
+           "%s %dHz %d samples/frame\n",
+           av_get_sample_fmt_name(frame->format), frame->sample_rate,
+           frame->nb_samples,
+           av_get_sample_fmt_name(pthis->audio_ctx_out->sample_fmt),
+           pthis->audio_ctx_out->sample_rate,
+           pthis->audio_ctx_out->frame_size);
+    ret = init_audio_filters(pthis, audio_filter_descr, frame);
+    if (ret < 0) {
+      printf("Error: init audio filters\n");
+      avfilter_graph_free(&pthis->audio_filter_graph);
+      return ret;
+    }
+  }
+
   AVFrame *filt_frame = av_frame_alloc();
   ret = av_buffersrc_add_frame_flags(pthis->audio_buffersrc_ctx,
                                      frame, 0);
@@ -583,57 +893,122 @@ int file_writer_push_audio_frame(struct file_writer_t* pthis,
   return ret;
 }
 
-static int write_video_frame(struct file_writer_t* file_writer,
-                             AVFrame* frame)
-{
-  int got_packet, ret;
+// Writes queued skip frames whose predecessors have all left the encoder.
+static void flush_skip_frames(struct file_writer_t* pthis) {
+  int done = 0;
+  while (done < pthis->nb_pending_skips &&
+         pthis->pending_skip_index[done] <= pthis->video_packets_encoded)
+  {
+    AVPacket pkt = { 0 };
+    av_init_packet(&pkt);
+    int ret = h264_skip_build(pthis->skip, &pkt);
+    if (ret) {
+      printf("flush_skip_frames: h264_skip_build failed with %d\n", ret);
+      break;
+    }
+    pkt.pts = pkt.dts = pthis->pending_skip_pts[done];
+    pkt.stream_index = pthis->video_stream->index;
+    printf("file writer: Write skip frame %lld, size=%d pts=%lld\n",
+           pthis->video_skip_frames, pkt.size, pkt.pts);
+    pthis->video_skip_frames++;
+    record_latency(pthis, pthis->video_latency, &pthis->video_latency_packets,
+                   pthis->pending_skip_capture_ts[done]);
+    ret = safe_write_packet(pthis, &pkt);
+    if (ret) {
+      printf("flush_skip_frames: safe_write_packet failed with %d\n", ret);
+    }
+    av_packet_unref(&pkt);
+    done++;
+  }
+  pthis->nb_pending_skips -= done;
+  memmove(pthis->pending_skip_pts, pthis->pending_skip_pts + done,
+          pthis->nb_pending_skips * sizeof(int64_t));
+  memmove(pthis->pending_skip_index, pthis->pending_skip_index + done,
+          pthis->nb_pending_skips * sizeof(int64_t));
+  memmove(pthis->pending_skip_capture_ts,
+          pthis->pending_skip_capture_ts + done,
+          pthis->nb_pending_skips * sizeof(int64_t));
+}
+
+// Writes every packet the video encoder has ready, then any skip frames
+// that were waiting on them.
+static int receive_video_packets(struct file_writer_t* file_writer) {
   AVPacket pkt = { 0 };
   av_init_packet(&pkt);
-  
-  /* encode the image */
-  ret = avcodec_encode_video2(file_writer->video_ctx_out,
-                              &pkt, frame, &got_packet);
-  if (ret < 0) {
-    fprintf(stderr, "Error encoding video frame: %s\n", av_err2str(ret));
-    exit(1);
-  }
-  
-  if (got_packet) {
-    /*
-     rescale output packet timestamp values from codec to stream timebase
-     */
-//    av_packet_rescale_ts(&pkt, global_time_base,
-//                         file_writer->video_stream->time_base);
+  int ret;
+  while (!(ret = avcodec_receive_packet(file_writer->video_ctx_out, &pkt))) {
     pkt.stream_index = file_writer->video_stream->index;
+    record_latency(file_writer, file_writer->video_latency,
+                   &file_writer->video_latency_packets,
+                   latency_map_match(&file_writer->video_latency_map,
+                                     pkt.pts));
+    // follow any skip frames already written with an unbroken frame_num
+    int skip_ret = h264_skip_renumber(file_writer->skip, &pkt);
+    if (skip_ret) {
+      printf("receive_video_packets: h264_skip_renumber failed with %d\n",
+             skip_ret);
+    }
+    file_writer->video_packets_encoded++;
     /* Write the compressed frame to the media file. */
     printf("file writer: Write video frame %lld, size=%d pts=%lld\n",
            file_writer->video_frame_ct, pkt.size, pkt.pts);
     file_writer->video_frame_ct++;
-    ret = safe_write_packet(file_writer, &pkt);
-    if (ret) {
-      printf("write_video_frame: safe_write_packet failed with %d\n", ret);
+    int write_ret = safe_write_packet(file_writer, &pkt);
+    if (write_ret) {
+      printf("write_video_frame: safe_write_packet failed with %d\n",
+             write_ret);
     }
-    
-  } else {
-    ret = 0;
+    av_packet_unref(&pkt);
+    // a skip frame can go out as soon as the packet it follows has
+    flush_skip_frames(file_writer);
   }
-  
-  av_free_packet(&pkt);
-  
+  flush_skip_frames(file_writer);
+  if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+    return 0;
+  }
+  fprintf(stderr, "Error encoding video frame: %s\n", av_err2str(ret));
   return ret;
 }
 
-int file_writer_push_video_frame(struct file_writer_t* pthis,
-                                 AVFrame* frame, double timestamp)
+// With frame threads the encoder returns each packet a few frames late;
+// a NULL frame drains it.
+static int write_video_frame(struct file_writer_t* file_writer,
+                             AVFrame* frame)
+{
+  if (frame) {
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+    file_writer->video_frames_encoded++;
+  }
+
+  int ret = avcodec_send_frame(file_writer->video_ctx_out, frame);
+  if (ret < 0) {
+    fprintf(stderr, "Error encoding video frame: %s\n", av_err2str(ret));
+    if (frame) {
+      // never coming back out; don't hold skips behind it
+      file_writer->video_frames_encoded--;
+    }
+    return ret;
+  }
+  return receive_video_packets(file_writer);
+}
+
+// Encodes a frame of the encoder's size; timestamp is relative to the
+// start of the segment.
+static int encode_video_frame(struct file_writer_t* pthis,
+                              AVFrame* frame, double timestamp)
 {
   int ret;
   printf("file writer: video_frame ts=%.02f, width=%d, height=%d\n",
          timestamp, frame->width, frame->height);
+  av_frame_free(&pthis->pending_duplicate);
+  pthis->last_video_timestamp = timestamp;
+  pthis->video_frames_pushed++;
 
   // Translate global timestamp to stream timebase.
   AVRational time_base = pthis->video_stream->time_base;
   int64_t frame_pts = timestamp * time_base.den;
   frame_pts /= time_base.num;
+  latency_map_add(&pthis->video_latency_map, frame_pts, frame->pts);
   frame->pts = frame_pts;
 
   ret = av_buffersrc_add_frame_flags(pthis->video_buffersrc_ctx,
@@ -670,20 +1045,445 @@ end:
   return ret;
 }
 
-int file_writer_close(struct file_writer_t* file_writer)
+// Scales a frame to the size the encoder was opened with.
+static int scale_video_frame(struct file_writer_t* pthis, AVFrame** frame) {
+  AVFrame* in = *frame;
+  AVFrame* out = NULL;
+  pthis->resize_sws =
+  sws_getCachedContext(pthis->resize_sws, in->width, in->height, in->format,
+                       pthis->out_width, pthis->out_height,
+                       AV_PIX_FMT_YUV420P, SWS_BICUBIC, NULL, NULL, NULL);
+  if (!pthis->resize_sws) {
+    return AVERROR(EINVAL);
+  }
+  int ret = frame_pool_get_video(pthis->resize_pool,
+                                 pthis->out_width, pthis->out_height,
+                                 AV_PIX_FMT_YUV420P, &out);
+  if (ret) {
+    return ret;
+  }
+  sws_scale(pthis->resize_sws, (const uint8_t* const*)in->data, in->linesize,
+            0, in->height, out->data, out->linesize);
+  av_frame_copy_props(out, in);
+  av_frame_free(frame);
+  *frame = out;
+  return 0;
+}
+
+static void close_segment(struct file_writer_t* file_writer);
+
+// Finishes the current file and opens the next one at the new size. Its
+// name is the original with the segment number before the extension.
+static int start_segment(struct file_writer_t* pthis, int width, int height,
+                         double timestamp)
 {
-  printf("file_writer_close\n");
+  const char* filename = pthis->filename;
+  const char* slash = strrchr(filename, '/');
+  const char* dot = strrchr(filename, '.');
+  if (!dot || (slash && dot < slash)) {
+    dot = filename + strlen(filename);
+  }
+  char* segment_filename =
+  av_asprintf("%.*s.%d%s", (int)(dot - filename), filename,
+              pthis->segment_index + 1, dot);
+  if (!segment_filename) {
+    return AVERROR(ENOMEM);
+  }
+  printf("file_writer: video is now %dx%d, continuing in %s\n",
+         width, height, segment_filename);
+  // Keep the audio thread out and let the write thread finish the old
+  // file's packets; until the new file is open, this thread writes its own.
+  uv_mutex_lock(&pthis->segment_lock);
+  AVPacket flush = { 0 };
+  flush.stream_index = -1;
+  stage_queue_push(pthis->packet_queue, &flush);
+  stage_queue_drain(pthis->packet_queue);
+  pthis->write_inline = 1;
+  close_segment(pthis);
+  pthis->segment_index++;
+  pthis->segment_start_timestamp = timestamp;
+  int ret = open_segment(pthis, segment_filename, width, height);
+  pthis->write_inline = 0;
+  uv_mutex_unlock(&pthis->segment_lock);
+  av_free(segment_filename);
+  return ret;
+}
+
+static int process_video_frame(struct file_writer_t* pthis,
+                               AVFrame* frame, double timestamp)
+{
+  int ret = 0;
+  if (!pthis->format_ctx_out) {
+    // a segment swap failed; there is no file to write into
+    av_frame_free(&frame);
+    return AVERROR(EINVAL);
+  }
+  if (frame->width != pthis->out_width || frame->height != pthis->out_height)
+  {
+    if (pthis->config.resize_mode == FILE_WRITER_RESIZE_SEGMENT) {
+      ret = start_segment(pthis, frame->width, frame->height, timestamp);
+    } else {
+      ret = scale_video_frame(pthis, &frame);
+    }
+    if (ret) {
+      printf("file_writer: cannot adapt to a %dx%d frame: %s\n",
+             frame->width, frame->height, av_err2str(ret));
+      av_frame_free(&frame);
+      return ret;
+    }
+  }
+  return encode_video_frame(pthis, frame,
+                            timestamp - pthis->segment_start_timestamp);
+}
+
+// Repeats the previous picture with a synthesized skip frame when the
+// stream allows it; encodes the frame otherwise. Timestamps are relative to
+// the segment.
+static int write_duplicate_video_frame(struct file_writer_t* pthis,
+                                       AVFrame* frame, double timestamp)
+{
+  if (pthis->config.profile == FILE_WRITER_PROFILE_LIVE ||
+      !pthis->video_frames_pushed || !h264_skip_is_ready(pthis->skip) ||
+      pthis->nb_pending_skips == FILE_WRITER_MAX_PENDING_SKIPS)
+  {
+    return encode_video_frame(pthis, frame, timestamp);
+  }
+  av_frame_free(&pthis->pending_duplicate);
+  pthis->last_video_timestamp = timestamp;
+  AVRational time_base = pthis->video_stream->time_base;
+  int64_t frame_pts = timestamp * time_base.den;
+  frame_pts /= time_base.num;
+  int n = pthis->nb_pending_skips++;
+  pthis->pending_skip_pts[n] = frame_pts;
+  pthis->pending_skip_index[n] = pthis->video_frames_encoded;
+  pthis->pending_skip_capture_ts[n] = frame->pts;
+  av_frame_free(&frame);
+  flush_skip_frames(pthis);
+  return 0;
+}
+
+static int process_duplicate_video_frame(struct file_writer_t* pthis,
+                                         AVFrame* frame, double timestamp)
+{
+  if (!pthis->format_ctx_out) {
+    av_frame_free(&frame);
+    return AVERROR(EINVAL);
+  }
+  if (frame->width != pthis->out_width || frame->height != pthis->out_height)
+  {
+    // repeats a picture this encoder never saw
+    return process_video_frame(pthis, frame, timestamp);
+  }
+  timestamp -= pthis->segment_start_timestamp;
+  if (pthis->config.rate_mode == FILE_WRITER_CFR ||
+      !pthis->video_frames_pushed ||
+      timestamp - pthis->last_video_timestamp >= pthis->config.max_frame_gap)
+  {
+    return write_duplicate_video_frame(pthis, frame, timestamp);
+  }
+  av_frame_free(&pthis->pending_duplicate);
+  pthis->pending_duplicate = frame;
+  pthis->pending_duplicate_timestamp = timestamp;
+  pthis->video_duplicates_skipped++;
+  return 0;
+}
+
+// Sends what the audio graph still buffers, then drains both encoders.
+// Skip frames still waiting go out behind the last video packet.
+static void drain_encoders(struct file_writer_t* pthis) {
+  int ret;
+  if (pthis->audio_filter_graph) {
+    AVFrame* filt_frame = av_frame_alloc();
+    ret = av_buffersrc_add_frame_flags(pthis->audio_buffersrc_ctx, NULL, 0);
+    while (ret >= 0 && filt_frame) {
+      ret = av_buffersink_get_frame(pthis->audio_buffersink_ctx, filt_frame);
+      if (ret < 0) {
+        break;
+      }
+      write_audio_frame(pthis, filt_frame);
+      av_frame_unref(filt_frame);
+    }
+    av_frame_free(&filt_frame);
+  }
+  ret = write_audio_frame(pthis, NULL);
+  if (ret) {
+    printf("file writer: draining the audio encoder failed with %d\n", ret);
+  }
+  ret = write_video_frame(pthis, NULL);
+  if (ret) {
+    printf("file writer: draining the video encoder failed with %d\n", ret);
+  }
+  // skips queued behind frames the encoder dropped have nothing to follow
+  pthis->video_packets_encoded = pthis->video_frames_encoded;
+  flush_skip_frames(pthis);
+}
+
+// Writes out what the current file still owes and closes it, leaving the
+// writer ready to open another.
+static void close_segment(struct file_writer_t* file_writer)
+{
+  if (!file_writer->format_ctx_out) {
+    // a segment that failed to open; nothing to finish
+    av_frame_free(&file_writer->pending_duplicate);
+    return;
+  }
+  if (file_writer->pending_duplicate) {
+    AVFrame* frame = file_writer->pending_duplicate;
+    file_writer->pending_duplicate = NULL;
+    file_writer->video_duplicates_skipped--;
+    write_duplicate_video_frame(file_writer, frame,
+                                file_writer->pending_duplicate_timestamp);
+  }
+  // the encoders hold back frames (one per frame thread for video, the
+  // priming delay for AAC); drain them so the file ends where capture did
+  drain_encoders(file_writer);
+  if (file_writer->interleaver) {
+    write_ready_packets(file_writer, 1);
+    interleaver_reset(file_writer->interleaver);
+  }
   int ret = av_write_trailer(file_writer->format_ctx_out);
   if (ret) {
     printf("no trailer!\n");
   }
-  avcodec_close(file_writer->video_ctx_out);
-  
-  if (!(file_writer->format_ctx_out->oformat->flags & AVFMT_NOFILE)) {
-    avio_closep(&file_writer->format_ctx_out->pb);
+  free_output_file(file_writer);
+  avfilter_graph_free(&file_writer->video_filter_graph);
+  avfilter_graph_free(&file_writer->audio_filter_graph);
+
+  // the next encoder starts its own stream from scratch
+  h264_skip_free(file_writer->skip);
+  h264_skip_alloc(&file_writer->skip);
+  file_writer->nb_pending_skips = 0;
+  file_writer->video_frames_encoded = 0;
+  file_writer->video_packets_encoded = 0;
+  file_writer->video_frames_pushed = 0;
+  file_writer->last_video_timestamp = 0;
+  // and its pts from zero
+  latency_map_reset(&file_writer->video_latency_map);
+  latency_map_reset(&file_writer->audio_latency_map);
+}
+
+static void video_thread_main(void* p) {
+  struct file_writer_t* pthis = (struct file_writer_t*)p;
+  struct file_writer_job_s job;
+  int64_t last_seq = 0;
+  while (!stage_queue_pop(pthis->video_queue, &job)) {
+    // after an eviction, a duplicate may repeat a picture never encoded
+    char follows_gap = job.seq != last_seq + 1;
+    last_seq = job.seq;
+    if (job.duplicate && !follows_gap) {
+      process_duplicate_video_frame(pthis, job.frame, job.timestamp);
+    } else {
+      process_video_frame(pthis, job.frame, job.timestamp);
+    }
+  }
+}
+
+static void audio_thread_main(void* p) {
+  struct file_writer_t* pthis = (struct file_writer_t*)p;
+  struct file_writer_job_s job;
+  while (!stage_queue_pop(pthis->audio_queue, &job)) {
+    uv_mutex_lock(&pthis->segment_lock);
+    int ret = encode_audio_frame(pthis, job.frame, job.timestamp);
+    uv_mutex_unlock(&pthis->segment_lock);
+    if (ret && ret != AVERROR(EAGAIN)) {
+      printf("file writer: encode_audio_frame failed with %d\n", ret);
+    }
+    av_frame_free(&job.frame);
+  }
+}
+
+// Writes what the interleaver lets go of; everything when flushing.
+static void write_ready_packets(struct file_writer_t* pthis, char flush) {
+  AVPacket packet;
+  while (!interleaver_pop(pthis->interleaver, &packet, flush)) {
+    int ret = av_write_frame(pthis->format_ctx_out, &packet);
+    if (ret) {
+      printf("file writer: av_write_frame failed with %d\n", ret);
+    }
+    av_packet_unref(&packet);
+  }
+}
+
+// The only thread that touches the output file while the encode threads
+// run, outside of segment swaps. Packets are already in order when they
+// reach the muxer, so it writes them straight out instead of buffering.
+// A packet with no stream ends the segment: everything held is written.
+static void write_thread_main(void* p) {
+  struct file_writer_t* pthis = (struct file_writer_t*)p;
+  AVPacket packet;
+  while (!stage_queue_pop(pthis->packet_queue, &packet)) {
+    if (packet.stream_index < 0) {
+      write_ready_packets(pthis, 1);
+      interleaver_reset(pthis->interleaver);
+      continue;
+    }
+    AVRational time_base =
+    pthis->format_ctx_out->streams[packet.stream_index]->time_base;
+    if (interleaver_push(pthis->interleaver, &packet, time_base)) {
+      continue;
+    }
+    write_ready_packets(pthis, 0);
+  }
+  write_ready_packets(pthis, 1);
+}
+
+static int start_threads(struct file_writer_t* pthis) {
+  struct interleaver_config_s interleaver_config = { 0 };
+  interleaver_config.nb_streams = pthis->format_ctx_out->nb_streams;
+  interleaver_config.max_delay =
+  pthis->config.max_interleave_delay * MEDIA_CLOCK_NS_PER_SEC;
+  interleaver_config.stall_timeout =
+  pthis->config.stall_timeout * MEDIA_CLOCK_NS_PER_SEC;
+  int ret = interleaver_alloc(&pthis->interleaver, &interleaver_config);
+  if (ret) {
+    return AVERROR(ret);
+  }
+  ret = uv_thread_create(&pthis->write_thread, write_thread_main, pthis);
+  if (ret) {
+    return ret;
+  }
+  ret = uv_thread_create(&pthis->audio_thread, audio_thread_main, pthis);
+  if (ret) {
+    stage_queue_close(pthis->packet_queue);
+    uv_thread_join(&pthis->write_thread);
+    return ret;
+  }
+  ret = uv_thread_create(&pthis->video_thread, video_thread_main, pthis);
+  if (ret) {
+    stage_queue_close(pthis->audio_queue);
+    uv_thread_join(&pthis->audio_thread);
+    stage_queue_close(pthis->packet_queue);
+    uv_thread_join(&pthis->write_thread);
+    return ret;
+  }
+  pthis->threads_running = 1;
+  return 0;
+}
+
+// Lets the encode threads finish what is queued, then the write thread.
+static void stop_threads(struct file_writer_t* pthis) {
+  stage_queue_close(pthis->video_queue);
+  stage_queue_close(pthis->audio_queue);
+  if (pthis->threads_running) {
+    uv_thread_join(&pthis->video_thread);
+    uv_thread_join(&pthis->audio_thread);
+  }
+  stage_queue_close(pthis->packet_queue);
+  if (pthis->threads_running) {
+    uv_thread_join(&pthis->write_thread);
+  }
+  pthis->threads_running = 0;
+  pthis->write_inline = 1;
+}
+
+int file_writer_push_audio_frame(struct file_writer_t* pthis,
+                                 AVFrame* frame, double timestamp)
+{
+  struct file_writer_job_s job = { 0 };
+  job.frame = frame;
+  job.timestamp = timestamp;
+  int ret = stage_queue_push(pthis->audio_queue, &job);
+  if (ret) {
+    av_frame_free(&frame);
+    return AVERROR(ret);
+  }
+  return 0;
+}
+
+// Never blocks the caller, who also feeds audio: a full queue gives up its
+// oldest frame instead.
+static int push_video_job(struct file_writer_t* pthis, AVFrame* frame,
+                          double timestamp, char duplicate)
+{
+  struct file_writer_job_s job = { 0 };
+  struct file_writer_job_s evicted = { 0 };
+  job.frame = frame;
+  job.timestamp = timestamp;
+  job.duplicate = duplicate;
+  job.seq = ++pthis->video_jobs_pushed;
+  int ret = stage_queue_push_evict(pthis->video_queue, &job, &evicted);
+  if (ret == ENOBUFS) {
+    av_frame_free(&evicted.frame);
+    return 0;
+  }
+  if (ret) {
+    av_frame_free(&frame);
+    return AVERROR(ret);
+  }
+  return 0;
+}
+
+int file_writer_push_video_frame(struct file_writer_t* pthis,
+                                 AVFrame* frame, double timestamp)
+{
+  return push_video_job(pthis, frame, timestamp, 0);
+}
+
+int file_writer_push_duplicate_video_frame(struct file_writer_t* pthis,
+                                           AVFrame* frame, double timestamp)
+{
+  return push_video_job(pthis, frame, timestamp, 1);
+}
+
+static void get_latency(struct sample_window_s* window, int64_t packets,
+                        struct file_writer_latency_s* latency_out)
+{
+  latency_out->packets = packets;
+  latency_out->p50_us = sample_window_get_percentile(window, 50);
+  latency_out->p95_us = sample_window_get_percentile(window, 95);
+  latency_out->p99_us = sample_window_get_percentile(window, 99);
+  latency_out->max_us = sample_window_get_percentile(window, 100);
+}
+
+void file_writer_get_stats(struct file_writer_t* pthis,
+                           struct file_writer_stats_s* stats_out)
+{
+  uv_mutex_lock(&pthis->stats_lock);
+  get_latency(pthis->video_latency, pthis->video_latency_packets,
+              &stats_out->video_latency);
+  get_latency(pthis->audio_latency, pthis->audio_latency_packets,
+              &stats_out->audio_latency);
+  uv_mutex_unlock(&pthis->stats_lock);
+}
+
+static void print_stage_stats(const char* name, struct stage_queue_s* queue)
+{
+  struct stage_queue_stats_s stats;
+  stage_queue_get_stats(queue, &stats);
+  printf("file_writer_close: %s queue took %lld items, high water %d/%d, "
+         "producer waited %lld times, %lld evicted\n", name,
+         stats.items_pushed, stats.high_water_mark, stats.capacity,
+         stats.producer_waits, stats.items_evicted);
+}
+
+int file_writer_close(struct file_writer_t* file_writer)
+{
+  printf("file_writer_close\n");
+  stop_threads(file_writer);
+  print_stage_stats("video", file_writer->video_queue);
+  print_stage_stats("audio", file_writer->audio_queue);
+  print_stage_stats("packet", file_writer->packet_queue);
+  // the encoders' tails pass through the interleaver too
+  close_segment(file_writer);
+  if (file_writer->interleaver) {
+    struct interleaver_stats_s stats;
+    interleaver_get_stats(file_writer->interleaver, &stats);
+    printf("file_writer_close: interleaved %lld packets, %lld released "
+           "early, %lld late, %lld stalls, max depth %d\n", stats.packets,
+           stats.forced, stats.late, stats.stalls, stats.max_depth);
+  }
+  if (file_writer->video_skip_frames) {
+    printf("file_writer_close: wrote %lld synthesized skip frames\n",
+           file_writer->video_skip_frames);
+  }
+  if (file_writer->video_duplicates_skipped) {
+    printf("file_writer_close: skipped %lld duplicate video frames\n",
+           file_writer->video_duplicates_skipped);
+  }
+  if (file_writer->segment_index) {
+    printf("file_writer_close: wrote %d segments after size changes\n",
+           file_writer->segment_index);
   }
-  
-  avformat_free_context(file_writer->format_ctx_out);
   
   printf("File write done!\n");
   return 0;
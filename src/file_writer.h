@@ -12,8 +12,116 @@
 #include <libavformat/avformat.h>
 #include <libavfilter/avfilter.h>
 #include <uv.h>
+#include "h264_skip.h"
+#include "frame_pool.h"
+#include "stage_queue.h"
+#include "interleaver.h"
+#include "sample_window.h"
+
+// skip frames waiting for the encoder to catch up (see h264_skip.h)
+#define FILE_WRITER_MAX_PENDING_SKIPS 64
+// frames in flight between encode and packet whose capture time is kept
+#define FILE_WRITER_LATENCY_MAP_SIZE 256
+
+enum file_writer_rate_mode {
+  // encode every frame pushed, duplicates included
+  FILE_WRITER_CFR,
+  // skip duplicate frames; container timestamps carry the gap
+  FILE_WRITER_VFR,
+};
+
+enum file_writer_resize_mode {
+  // scale frames of a new size to the size the encoder was opened with
+  FILE_WRITER_RESIZE_SCALE,
+  // finish the current file and carry on in a new one (out.1.mp4,
+  // out.2.mp4, ...) with an encoder opened at the new size
+  FILE_WRITER_RESIZE_SEGMENT,
+};
+
+enum file_writer_profile {
+  // ultrafast at crf 18, encoder threading as configured
+  FILE_WRITER_PROFILE_ARCHIVE,
+  // for watching while recording: tune=zerolatency with slice threads and
+  // no lookahead, so a frame leaves the encoder as soon as it is coded, and
+  // periodic intra refresh instead of IDR frames, so the bitrate has no
+  // keyframe spikes. Duplicates are encoded rather than replaced by skip
+  // frames, which would carry no refresh column and put the encoder's
+  // recovery points out of step with the stream.
+  FILE_WRITER_PROFILE_LIVE,
+};
+
+enum file_writer_thread_type {
+  // whatever the encoder prefers (frame threads for x264)
+  FILE_WRITER_THREAD_AUTO,
+  // frames encoded in parallel: best throughput, a frame of delay per thread
+  FILE_WRITER_THREAD_FRAME,
+  // each frame split across threads: no added delay, less throughput
+  FILE_WRITER_THREAD_SLICE,
+};
+
+struct file_writer_config_s {
+  enum file_writer_profile profile;
+  // tagged on the video stream so players pick the matching YUV matrix
+  enum AVColorSpace colorspace;
+  enum file_writer_rate_mode rate_mode;
+  // VFR only: longest stretch, in seconds, without an encoded frame. A
+  // duplicate is encoded anyway once this much time has passed, so players
+  // seeking into a static stretch still find frames nearby.
+  double max_frame_gap;
+  // what to do when video frames stop matching the encoder's size
+  enum file_writer_resize_mode resize_mode;
+  // Packets are put in dts order across streams before they are written.
+  // A packet waits at most max_interleave_delay seconds for the other
+  // streams, and a stream silent for stall_timeout seconds is not waited
+  // on. 0 keeps the defaults (see interleaver.h).
+  double max_interleave_delay;
+  double stall_timeout;
+  // video encoder threading; 0 threads picks one per core. The live profile
+  // always uses slice threads.
+  enum file_writer_thread_type video_thread_type;
+  int video_threads;
+};
+
+// What the audio encoder takes, so sources can deliver it as is.
+struct file_writer_audio_format_s {
+  enum AVSampleFormat sample_fmt;
+  int sample_rate;
+  uint64_t channel_layout;
+  // samples per frame; 0 if the encoder takes any size
+  int frame_size;
+};
+
+/**
+ * Capture-to-packet latency: from the capture time a frame's pts carries
+ * (media clock) to the encoder handing back the packet holding it, over
+ * the last few seconds of packets. Percentiles in microseconds.
+ */
+struct file_writer_latency_s {
+  int64_t packets;
+  int64_t p50_us;
+  int64_t p95_us;
+  int64_t p99_us;
+  int64_t max_us;
+};
+
+struct file_writer_stats_s {
+  struct file_writer_latency_s video_latency;
+  struct file_writer_latency_s audio_latency;
+};
+
+// Capture times of frames the encoder still holds, by output pts, in the
+// order the frames went in.
+struct file_writer_latency_map_s {
+  int64_t pts[FILE_WRITER_LATENCY_MAP_SIZE];
+  int64_t capture_ts[FILE_WRITER_LATENCY_MAP_SIZE];
+  int head;
+  int count;
+  // capture time of the newest frame a packet was matched to
+  int64_t last_capture_ts;
+};
 
 struct file_writer_t {
+  struct file_writer_config_s config;
   int out_width;
   int out_height;
   
@@ -35,20 +143,109 @@ struct file_writer_t {
   AVStream* audio_stream;
   int64_t video_frame_ct;
   int64_t audio_frame_ct;
-  
-  uv_mutex_t write_lock;
+
+  /* variable frame rate */
+  double last_video_timestamp;
+  // newest skipped duplicate, encoded at close so the static tail keeps
+  // its length
+  AVFrame* pending_duplicate;
+  double pending_duplicate_timestamp;
+  int64_t video_frames_pushed;
+  int64_t video_duplicates_skipped;
+
+  /* synthesized skip frames */
+  struct h264_skip_s* skip;
+  // frames handed to the encoder and packets it has returned so far
+  int64_t video_frames_encoded;
+  int64_t video_packets_encoded;
+  // a skip frame is written once the encoder has returned a packet for
+  // every frame submitted before it
+  int64_t pending_skip_pts[FILE_WRITER_MAX_PENDING_SKIPS];
+  int64_t pending_skip_index[FILE_WRITER_MAX_PENDING_SKIPS];
+  int64_t pending_skip_capture_ts[FILE_WRITER_MAX_PENDING_SKIPS];
+  int nb_pending_skips;
+  int64_t video_skip_frames;
+
+  /* size changes */
+  char* filename;
+  int segment_index;
+  // timestamp the current segment starts at; pushed timestamps are
+  // rebased onto it so every segment starts at zero
+  double segment_start_timestamp;
+  struct SwsContext* resize_sws;
+  struct frame_pool_s* resize_pool;
+
+  /* pipeline: push -> video / audio encode threads -> write thread */
+  struct stage_queue_s* video_queue;
+  // video jobs queued so far; only the pushing thread touches it
+  int64_t video_jobs_pushed;
+  struct stage_queue_s* audio_queue;
+  struct stage_queue_s* packet_queue;
+  uv_thread_t video_thread;
+  uv_thread_t audio_thread;
+  uv_thread_t write_thread;
+  // owned by the write thread
+  struct interleaver_s* interleaver;
+  char threads_running;
+  // Held by the audio thread for each frame, and by the video thread while
+  // it swaps segments, which replaces both encoders and the output file.
+  uv_mutex_t segment_lock;
+  // packets bypass the write thread: set during a segment swap and after
+  // the threads are gone
+  char write_inline;
+
+  /* latency, added to by the encode threads */
+  struct file_writer_latency_map_s video_latency_map;
+  struct file_writer_latency_map_s audio_latency_map;
+  struct sample_window_s* video_latency;
+  struct sample_window_s* audio_latency;
+  int64_t video_latency_packets;
+  int64_t audio_latency_packets;
+  uv_mutex_t stats_lock;
 };
 
 int file_writer_alloc(struct file_writer_t** writer);
 void file_writer_free(struct file_writer_t* writer);
+void file_writer_load_config(struct file_writer_t* writer,
+                             struct file_writer_config_s* config);
 
 int file_writer_open(struct file_writer_t* writer,
                      const char* filename,
                      int out_width, int out_height);
+// Valid once the writer is open; stays the same across segments.
+void file_writer_get_audio_format(struct file_writer_t* file_writer,
+                                  struct file_writer_audio_format_s* format);
+/*
+ * The push functions only queue the frame and take ownership of it. A
+ * frame's pts, if set, is its capture time on the media clock
+ * (media_clock.h); latency is measured from it. Video and audio are
+ * encoded on threads of their own and their packets written by a third.
+ * Video pushes never block: when the encoder falls behind, the oldest
+ * queued frame is dropped (counted as evicted in the close stats), so one
+ * thread can feed both streams without a slow video frame holding up
+ * audio. Audio is never dropped, and its push blocks while the queue is
+ * full. Both fail with ECANCELED once the writer is closing.
+ */
+
+// Frames already in the encoder's format and frame size go straight to the
+// encoder; anything else is converted and rechunked by a filter graph
+// built on the first such frame.
 int file_writer_push_audio_frame(struct file_writer_t* file_writer,
                                  AVFrame* frame, double timestamp);
+// A frame whose size differs from the encoder's is scaled or starts a new
+// segment, following config.resize_mode.
 int file_writer_push_video_frame(struct file_writer_t* file_writer,
                                  AVFrame* frame, double timestamp);
+// Same as file_writer_push_video_frame for a frame known to repeat the
+// previous one. In VFR mode it is dropped unless max_frame_gap has elapsed.
+// Duplicates that are written become synthesized all-skip P frames when the
+// encoder's stream allows it, and are only encoded otherwise.
+int file_writer_push_duplicate_video_frame(struct file_writer_t* file_writer,
+                                           AVFrame* frame, double timestamp);
+void file_writer_get_stats(struct file_writer_t* file_writer,
+                           struct file_writer_stats_s* stats_out);
+// Encodes and writes everything queued, drains the encoders of the frames
+// they still hold back, then finishes the file.
 int file_writer_close(struct file_writer_t* writer);
 
 #endif /* file_writer_h */
@@ -0,0 +1,206 @@
+//
+//  frame_pool.c
+//  x11pulsemux
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavutil/buffer.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/channel_layout.h>
+#include "frame_pool.h"
+
+// Line and buffer alignment: enough for AVX-512 loads in the converters and
+// for the encoder's own SIMD.
+#define FRAME_POOL_ALIGN 64
+
+struct frame_pool_s {
+  AVBufferPool* pool;
+  int width;
+  int height;
+  enum AVPixelFormat format;
+  int nb_samples;
+  enum AVSampleFormat sample_fmt;
+  int channels;
+  int linesize[4];
+  int buffer_size;
+  struct frame_pool_stats_s stats;
+};
+
+// Only reached when the pool has no free buffer, so every call is a miss.
+static AVBufferRef* _pool_alloc(void* opaque, int size) {
+  struct frame_pool_s* pthis = (struct frame_pool_s*)opaque;
+  pthis->stats.misses++;
+  return av_buffer_alloc(size);
+}
+
+static int _configure(struct frame_pool_s* pthis, int width, int height,
+                      enum AVPixelFormat format)
+{
+  int ret;
+  uint8_t* data[4];
+  av_buffer_pool_uninit(&pthis->pool);
+  pthis->width = 0;
+  ret = av_image_fill_linesizes(pthis->linesize, format,
+                                FFALIGN(width, FRAME_POOL_ALIGN));
+  if (ret < 0) {
+    return ret;
+  }
+  for (int i = 0; i < 4; i++) {
+    pthis->linesize[i] = FFALIGN(pthis->linesize[i], FRAME_POOL_ALIGN);
+  }
+  ret = av_image_fill_pointers(data, format, height, NULL, pthis->linesize);
+  if (ret < 0) {
+    return ret;
+  }
+  // Tail padding for kernels that read a little past the last line.
+  pthis->buffer_size = ret + FRAME_POOL_ALIGN;
+  pthis->pool = av_buffer_pool_init2(pthis->buffer_size, pthis,
+                                     _pool_alloc, NULL);
+  if (!pthis->pool) {
+    return AVERROR(ENOMEM);
+  }
+  pthis->width = width;
+  pthis->height = height;
+  pthis->format = format;
+  pthis->sample_fmt = AV_SAMPLE_FMT_NONE;
+  pthis->stats.reconfigures++;
+  return 0;
+}
+
+static int _configure_audio(struct frame_pool_s* pthis, int nb_samples,
+                            enum AVSampleFormat format, int channels)
+{
+  av_buffer_pool_uninit(&pthis->pool);
+  pthis->nb_samples = 0;
+  int ret = av_samples_get_buffer_size(&pthis->linesize[0], channels,
+                                       nb_samples, format, FRAME_POOL_ALIGN);
+  if (ret < 0) {
+    return ret;
+  }
+  pthis->buffer_size = ret + FRAME_POOL_ALIGN;
+  pthis->pool = av_buffer_pool_init2(pthis->buffer_size, pthis,
+                                     _pool_alloc, NULL);
+  if (!pthis->pool) {
+    return AVERROR(ENOMEM);
+  }
+  pthis->nb_samples = nb_samples;
+  pthis->sample_fmt = format;
+  pthis->channels = channels;
+  pthis->width = 0;
+  pthis->format = AV_PIX_FMT_NONE;
+  pthis->stats.reconfigures++;
+  return 0;
+}
+
+void frame_pool_alloc(struct frame_pool_s** pool_out) {
+  struct frame_pool_s* pthis = (struct frame_pool_s*)
+  calloc(1, sizeof(struct frame_pool_s));
+  pthis->format = AV_PIX_FMT_NONE;
+  pthis->sample_fmt = AV_SAMPLE_FMT_NONE;
+  *pool_out = pthis;
+}
+
+void frame_pool_free(struct frame_pool_s* pthis) {
+  if (!pthis) {
+    return;
+  }
+  // Buffers still held downstream keep the underlying pool alive; they are
+  // released to the heap as they come back.
+  av_buffer_pool_uninit(&pthis->pool);
+  free(pthis);
+}
+
+int frame_pool_get_video(struct frame_pool_s* pthis, int width, int height,
+                         enum AVPixelFormat format, AVFrame** frame_out)
+{
+  int ret;
+  *frame_out = NULL;
+  if (!pthis->pool || width != pthis->width || height != pthis->height ||
+      format != pthis->format)
+  {
+    ret = _configure(pthis, width, height, format);
+    if (ret) {
+      printf("frame_pool: cannot configure %dx%d %s: %s\n",
+             width, height, av_get_pix_fmt_name(format), av_err2str(ret));
+      return ret;
+    }
+  }
+
+  AVFrame* frame = av_frame_alloc();
+  if (!frame) {
+    return AVERROR(ENOMEM);
+  }
+  int64_t misses = pthis->stats.misses;
+  frame->buf[0] = av_buffer_pool_get(pthis->pool);
+  if (!frame->buf[0]) {
+    av_frame_free(&frame);
+    return AVERROR(ENOMEM);
+  }
+  if (misses == pthis->stats.misses) {
+    pthis->stats.hits++;
+  }
+  frame->width = width;
+  frame->height = height;
+  frame->format = format;
+  memcpy(frame->linesize, pthis->linesize, sizeof(pthis->linesize));
+  av_image_fill_pointers(frame->data, format, height, frame->buf[0]->data,
+                         frame->linesize);
+  frame->extended_data = frame->data;
+  *frame_out = frame;
+  return 0;
+}
+
+int frame_pool_get_audio(struct frame_pool_s* pthis, int nb_samples,
+                         enum AVSampleFormat format, uint64_t channel_layout,
+                         AVFrame** frame_out)
+{
+  int ret;
+  int channels = av_get_channel_layout_nb_channels(channel_layout);
+  *frame_out = NULL;
+  if (!pthis->pool || format != pthis->sample_fmt ||
+      channels != pthis->channels || nb_samples > pthis->nb_samples)
+  {
+    ret = _configure_audio(pthis, nb_samples, format, channels);
+    if (ret) {
+      printf("frame_pool: cannot configure %d samples of %d channel %s: %s\n",
+             nb_samples, channels, av_get_sample_fmt_name(format),
+             av_err2str(ret));
+      return ret;
+    }
+  }
+
+  AVFrame* frame = av_frame_alloc();
+  if (!frame) {
+    return AVERROR(ENOMEM);
+  }
+  int64_t misses = pthis->stats.misses;
+  frame->buf[0] = av_buffer_pool_get(pthis->pool);
+  if (!frame->buf[0]) {
+    av_frame_free(&frame);
+    return AVERROR(ENOMEM);
+  }
+  if (misses == pthis->stats.misses) {
+    pthis->stats.hits++;
+  }
+  frame->nb_samples = nb_samples;
+  frame->format = format;
+  frame->channel_layout = channel_layout;
+  frame->channels = channels;
+  av_samples_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+                         channels, pthis->nb_samples, format,
+                         FRAME_POOL_ALIGN);
+  frame->extended_data = frame->data;
+  *frame_out = frame;
+  return 0;
+}
+
+void frame_pool_get_stats(struct frame_pool_s* pthis,
+                          struct frame_pool_stats_s* stats_out)
+{
+  memcpy(stats_out, &pthis->stats, sizeof(struct frame_pool_stats_s));
+}
@@ -0,0 +1,55 @@
+//
+//  frame_pool.h
+//  x11pulsemux
+//
+
+#ifndef frame_pool_h
+#define frame_pool_h
+
+#include <libavutil/frame.h>
+
+/**
+ * Recycles the pixel buffers of video frames with one geometry, or the
+ * sample buffers of audio frames with one format. Frames handed out hold a
+ * reference into an AVBufferPool, so freeing them anywhere (typically after
+ * encoding) returns the memory to the pool instead of the heap. Asking for
+ * a different width/height/format starts a new pool; frames from the old
+ * one stay valid until they are freed. A pool serves one kind of frame.
+ *
+ * Only the buffers are recycled. Each frame is still a fresh AVFrame and
+ * AVBufferRef (two small mallocs): frames are freed by whichever thread
+ * ends up owning them, with nothing that hands the shell back here.
+ */
+struct frame_pool_s;
+
+struct frame_pool_stats_s {
+  // frames served from a recycled buffer
+  int64_t hits;
+  // frames that needed a fresh allocation
+  int64_t misses;
+  // times the geometry changed and the pool started over
+  int64_t reconfigures;
+};
+
+void frame_pool_alloc(struct frame_pool_s** pool_out);
+void frame_pool_free(struct frame_pool_s* pool);
+
+// Returns a frame with width, height, format and data filled in. The pixel
+// contents are whatever the last user left behind.
+int frame_pool_get_video(struct frame_pool_s* pool, int width, int height,
+                         enum AVPixelFormat format, AVFrame** frame_out);
+
+// Returns an audio frame with room for nb_samples, with nb_samples, format,
+// channel_layout, channels and data filled in. Buffers are sized for the
+// largest request seen so far, so sizes that vary a little (device
+// fragments) share one pool.
+int frame_pool_get_audio(struct frame_pool_s* pool, int nb_samples,
+                         enum AVSampleFormat format, uint64_t channel_layout,
+                         AVFrame** frame_out);
+
+// Not synchronized with frame_pool_get_video or frame_pool_get_audio; read
+// from the owning thread or accept a slightly stale snapshot.
+void frame_pool_get_stats(struct frame_pool_s* pool,
+                          struct frame_pool_stats_s* stats_out);
+
+#endif /* frame_pool_h */
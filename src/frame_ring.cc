@@ -0,0 +1,177 @@
+//
+//  frame_ring.cc
+//  x11pulsemux
+//
+
+extern "C" {
+
+#include <errno.h>
+#include <stdlib.h>
+#include <libavutil/time.h>
+#include "frame_ring.h"
+
+}
+
+#include <atomic>
+
+// How long a blocked producer sleeps between checks for room.
+static const unsigned int block_poll_us = 500;
+
+// The pts rides along in the slot so peeking never dereferences a frame the
+// producer might be evicting at the same time.
+struct frame_ring_slot_s {
+  std::atomic<AVFrame*> frame;
+  std::atomic<int64_t> pts;
+};
+
+/*
+ * head and tail are free running counters. Only the producer moves head.
+ * Both sides move tail, with compare-and-swap: the consumer to pop and the
+ * producer to evict under FRAME_RING_DROP_OLDEST. Whoever wins the swap owns
+ * the frame in that slot. A slot is only rewritten once tail has passed it,
+ * so a side that read a slot and then won the swap read the right frame.
+ */
+struct frame_ring_s {
+  struct frame_ring_slot_s* slots;
+  int capacity;
+  enum frame_ring_overflow policy;
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  std::atomic<bool> aborted;
+  std::atomic<int64_t> frames_pushed;
+  std::atomic<int64_t> dropped_oldest;
+  std::atomic<int64_t> dropped_newest;
+  std::atomic<int> high_water_mark;
+};
+
+int frame_ring_alloc(struct frame_ring_s** ring_out, int capacity,
+                     enum frame_ring_overflow policy)
+{
+  if (capacity < 1) {
+    return EINVAL;
+  }
+  struct frame_ring_s* pthis = new frame_ring_s();
+  pthis->slots = new frame_ring_slot_s[capacity]();
+  pthis->capacity = capacity;
+  pthis->policy = policy;
+  pthis->head = 0;
+  pthis->tail = 0;
+  pthis->aborted = false;
+  pthis->frames_pushed = 0;
+  pthis->dropped_oldest = 0;
+  pthis->dropped_newest = 0;
+  pthis->high_water_mark = 0;
+  *ring_out = pthis;
+  return 0;
+}
+
+void frame_ring_free(struct frame_ring_s* pthis) {
+  if (!pthis) {
+    return;
+  }
+  AVFrame* frame;
+  while (!frame_ring_pop(pthis, &frame)) {
+    av_frame_free(&frame);
+  }
+  delete[] pthis->slots;
+  delete pthis;
+}
+
+// Tries to take the frame at tail. Returns 0 and the frame if we won it.
+static int _take_tail(struct frame_ring_s* pthis, uint64_t tail,
+                      AVFrame** frame_out)
+{
+  AVFrame* frame = pthis->slots[tail % pthis->capacity].frame.load();
+  if (!pthis->tail.compare_exchange_strong(tail, tail + 1)) {
+    return EAGAIN;
+  }
+  *frame_out = frame;
+  return 0;
+}
+
+int frame_ring_push(struct frame_ring_s* pthis, AVFrame* frame) {
+  uint64_t head = pthis->head.load(std::memory_order_relaxed);
+  uint64_t tail = pthis->tail.load();
+  while (head - tail >= (uint64_t)pthis->capacity) {
+    AVFrame* oldest = NULL;
+    switch (pthis->policy) {
+      case FRAME_RING_DROP_NEWEST:
+        av_frame_free(&frame);
+        pthis->dropped_newest++;
+        return ENOBUFS;
+      case FRAME_RING_DROP_OLDEST:
+        if (!_take_tail(pthis, tail, &oldest)) {
+          av_frame_free(&oldest);
+          pthis->dropped_oldest++;
+        }
+        break;
+      case FRAME_RING_BLOCK:
+        if (pthis->aborted) {
+          av_frame_free(&frame);
+          return ECANCELED;
+        }
+        av_usleep(block_poll_us);
+        break;
+    }
+    tail = pthis->tail.load();
+  }
+
+  struct frame_ring_slot_s* slot = &pthis->slots[head % pthis->capacity];
+  slot->pts.store(frame->pts, std::memory_order_relaxed);
+  slot->frame.store(frame, std::memory_order_relaxed);
+  pthis->head.store(head + 1, std::memory_order_release);
+  pthis->frames_pushed++;
+
+  int depth = (int)(head + 1 - tail);
+  if (depth > pthis->high_water_mark.load(std::memory_order_relaxed)) {
+    pthis->high_water_mark.store(depth, std::memory_order_relaxed);
+  }
+  return 0;
+}
+
+void frame_ring_abort(struct frame_ring_s* pthis) {
+  pthis->aborted = true;
+}
+
+int frame_ring_pop(struct frame_ring_s* pthis, AVFrame** frame_out) {
+  *frame_out = NULL;
+  for (;;) {
+    uint64_t tail = pthis->tail.load();
+    if (tail == pthis->head.load(std::memory_order_acquire)) {
+      return EAGAIN;
+    }
+    if (!_take_tail(pthis, tail, frame_out)) {
+      return 0;
+    }
+    // lost the slot to an eviction; look again
+  }
+}
+
+int frame_ring_peek_pts(struct frame_ring_s* pthis, int64_t* pts_out) {
+  for (;;) {
+    uint64_t tail = pthis->tail.load();
+    if (tail == pthis->head.load(std::memory_order_acquire)) {
+      return EAGAIN;
+    }
+    int64_t pts = pthis->slots[tail % pthis->capacity].pts.load();
+    // only trust the read if nobody evicted that slot meanwhile
+    if (pthis->tail.load() == tail) {
+      *pts_out = pts;
+      return 0;
+    }
+  }
+}
+
+char frame_ring_has_next(struct frame_ring_s* pthis) {
+  return pthis->tail.load() != pthis->head.load(std::memory_order_acquire);
+}
+
+void frame_ring_get_stats(struct frame_ring_s* pthis,
+                          struct frame_ring_stats_s* stats_out)
+{
+  stats_out->frames_pushed = pthis->frames_pushed;
+  stats_out->dropped_oldest = pthis->dropped_oldest;
+  stats_out->dropped_newest = pthis->dropped_newest;
+  stats_out->high_water_mark = pthis->high_water_mark;
+  stats_out->capacity = pthis->capacity;
+}
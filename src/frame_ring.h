@@ -0,0 +1,54 @@
+//
+//  frame_ring.h
+//  x11pulsemux
+//
+
+#ifndef frame_ring_h
+#define frame_ring_h
+
+#include <libavutil/frame.h>
+
+/**
+ * Bounded single producer/single consumer queue of frames. Neither side ever
+ * takes a lock, so the consumer can poll it as often as it likes. What
+ * happens when the producer finds it full is chosen per ring.
+ */
+struct frame_ring_s;
+
+enum frame_ring_overflow {
+  // evict the oldest queued frame to make room (the producer wins)
+  FRAME_RING_DROP_OLDEST,
+  // discard the frame being pushed (the queue wins)
+  FRAME_RING_DROP_NEWEST,
+  // wait for the consumer to make room, or for frame_ring_abort
+  FRAME_RING_BLOCK,
+};
+
+struct frame_ring_stats_s {
+  int64_t frames_pushed;
+  int64_t dropped_oldest;
+  int64_t dropped_newest;
+  int high_water_mark;
+  int capacity;
+};
+
+int frame_ring_alloc(struct frame_ring_s** ring_out, int capacity,
+                     enum frame_ring_overflow policy);
+// Frees any frames still queued.
+void frame_ring_free(struct frame_ring_s* ring);
+
+// Producer side. Always takes ownership of frame. Returns ENOBUFS when the
+// frame was dropped and ECANCELED when a blocked push was aborted.
+int frame_ring_push(struct frame_ring_s* ring, AVFrame* frame);
+// Releases a producer blocked in frame_ring_push, now and in the future.
+void frame_ring_abort(struct frame_ring_s* ring);
+
+// Consumer side. Both return EAGAIN on an empty ring.
+int frame_ring_pop(struct frame_ring_s* ring, AVFrame** frame_out);
+int frame_ring_peek_pts(struct frame_ring_s* ring, int64_t* pts_out);
+char frame_ring_has_next(struct frame_ring_s* ring);
+
+void frame_ring_get_stats(struct frame_ring_s* ring,
+                          struct frame_ring_stats_s* stats_out);
+
+#endif /* frame_ring_h */
@@ -0,0 +1,540 @@
+//
+//  h264_skip.c
+//  x11pulsemux
+//
+
+#include "h264_skip.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NAL_SLICE 1
+#define NAL_IDR_SLICE 5
+#define NAL_SPS 7
+#define NAL_PPS 8
+
+#define MAX_SPS 32
+#define MAX_PPS 256
+
+// ue(v) of the largest skip run we expect, plus a header, fits easily.
+#define SKIP_RBSP_SIZE 64
+
+struct h264_sps_s {
+  char valid;
+  int chroma_format_idc;
+  int log2_max_frame_num;
+  int poc_type;
+  int max_num_ref_frames;
+  int mb_width;
+  int mb_height;
+  char frame_mbs_only;
+};
+
+struct h264_pps_s {
+  char valid;
+  int sps_id;
+  char cabac;
+  char bottom_field_pic_order;
+  int num_slice_groups;
+  int num_ref_idx_l0_active;
+  char weighted_pred;
+  char deblocking_filter_control;
+  char redundant_pic_cnt;
+};
+
+struct h264_skip_s {
+  struct h264_sps_s sps[MAX_SPS];
+  struct h264_pps_s pps[MAX_PPS];
+  // parameter set used by the encoder's most recent slice
+  int pps_id;
+  int frame_num;
+  // skip frames built since the encoder's last IDR, modulo MaxFrameNum;
+  // added to the frame_num of each encoder slice
+  int frame_num_offset;
+  char seen_slice;
+  char warned;
+};
+
+/* Reads the escaped payload of one NAL, dropping emulation prevention
+ * bytes on the fly. Running off the end yields zeros. */
+struct bit_reader_s {
+  const uint8_t* data;
+  int size;
+  int pos;
+  int bit;
+  int zeros;
+  // bits read so far, counted in the unescaped payload
+  int rbsp_bits;
+  char overrun;
+};
+
+static void _reader_init(struct bit_reader_s* br, const uint8_t* data,
+                         int size)
+{
+  memset(br, 0, sizeof(struct bit_reader_s));
+  br->data = data;
+  br->size = size;
+}
+
+static int _read_bit(struct bit_reader_s* br) {
+  if (br->bit == 0) {
+    if (br->zeros >= 2 && br->pos < br->size && br->data[br->pos] == 3) {
+      br->pos++;
+      br->zeros = 0;
+    }
+    if (br->pos >= br->size) {
+      br->overrun = 1;
+      return 0;
+    }
+    br->zeros = br->data[br->pos] ? 0 : br->zeros + 1;
+  }
+  int value = (br->data[br->pos] >> (7 - br->bit)) & 1;
+  br->rbsp_bits++;
+  if (++br->bit == 8) {
+    br->bit = 0;
+    br->pos++;
+  }
+  return value;
+}
+
+static unsigned _read_bits(struct bit_reader_s* br, int n) {
+  unsigned value = 0;
+  while (n--) {
+    value = (value << 1) | _read_bit(br);
+  }
+  return value;
+}
+
+static unsigned _read_ue(struct bit_reader_s* br) {
+  int leading_zeros = 0;
+  while (!_read_bit(br)) {
+    if (++leading_zeros > 31 || br->overrun) {
+      br->overrun = 1;
+      return 0;
+    }
+  }
+  return (1u << leading_zeros) - 1 + _read_bits(br, leading_zeros);
+}
+
+static int _read_se(struct bit_reader_s* br) {
+  unsigned value = _read_ue(br);
+  return value & 1 ? (int)((value + 1) / 2) : -(int)(value / 2);
+}
+
+struct bit_writer_s {
+  uint8_t data[SKIP_RBSP_SIZE];
+  int bits;
+};
+
+static void _write_bits(struct bit_writer_s* bw, unsigned value, int n) {
+  while (n--) {
+    int byte = bw->bits >> 3;
+    if (byte >= SKIP_RBSP_SIZE) {
+      return;
+    }
+    if ((value >> n) & 1) {
+      bw->data[byte] |= 0x80 >> (bw->bits & 7);
+    }
+    bw->bits++;
+  }
+}
+
+static void _write_ue(struct bit_writer_s* bw, unsigned value) {
+  int length = 0;
+  while ((value + 1) >> (length + 1)) {
+    length++;
+  }
+  _write_bits(bw, 0, length);
+  _write_bits(bw, value + 1, length + 1);
+}
+
+static void _skip_scaling_list(struct bit_reader_s* br, int size) {
+  int last = 8, next = 8;
+  for (int i = 0; i < size && next; i++) {
+    next = (last + _read_se(br) + 256) % 256;
+    last = next ? next : last;
+  }
+}
+
+static void _parse_sps(struct h264_skip_s* pthis, struct bit_reader_s* br) {
+  int profile_idc = _read_bits(br, 8);
+  _read_bits(br, 16); // constraint flags, level_idc
+  unsigned sps_id = _read_ue(br);
+  if (sps_id >= MAX_SPS) {
+    return;
+  }
+  struct h264_sps_s sps = { 0 };
+  sps.chroma_format_idc = 1;
+  if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 ||
+      profile_idc == 244 || profile_idc == 44 || profile_idc == 83 ||
+      profile_idc == 86 || profile_idc == 118 || profile_idc == 128 ||
+      profile_idc == 138 || profile_idc == 139 || profile_idc == 134 ||
+      profile_idc == 135)
+  {
+    sps.chroma_format_idc = _read_ue(br);
+    if (sps.chroma_format_idc == 3) {
+      _read_bits(br, 1); // separate_colour_plane_flag
+    }
+    _read_ue(br); // bit_depth_luma_minus8
+    _read_ue(br); // bit_depth_chroma_minus8
+    _read_bits(br, 1); // qpprime_y_zero_transform_bypass_flag
+    if (_read_bits(br, 1)) {
+      int nb_lists = sps.chroma_format_idc == 3 ? 12 : 8;
+      for (int i = 0; i < nb_lists; i++) {
+        if (_read_bits(br, 1)) {
+          _skip_scaling_list(br, i < 6 ? 16 : 64);
+        }
+      }
+    }
+  }
+  sps.log2_max_frame_num = _read_ue(br) + 4;
+  sps.poc_type = _read_ue(br);
+  if (sps.poc_type == 0) {
+    _read_ue(br); // log2_max_pic_order_cnt_lsb_minus4
+  } else if (sps.poc_type == 1) {
+    // not supported; the rest of the SPS is not needed to say so
+    pthis->sps[sps_id] = sps;
+    pthis->sps[sps_id].valid = !br->overrun;
+    return;
+  }
+  sps.max_num_ref_frames = _read_ue(br);
+  _read_bits(br, 1); // gaps_in_frame_num_value_allowed_flag
+  sps.mb_width = _read_ue(br) + 1;
+  sps.mb_height = _read_ue(br) + 1;
+  sps.frame_mbs_only = _read_bits(br, 1);
+  sps.valid = !br->overrun;
+  pthis->sps[sps_id] = sps;
+}
+
+static void _parse_pps(struct h264_skip_s* pthis, struct bit_reader_s* br) {
+  unsigned pps_id = _read_ue(br);
+  if (pps_id >= MAX_PPS) {
+    return;
+  }
+  struct h264_pps_s pps = { 0 };
+  pps.sps_id = _read_ue(br);
+  pps.cabac = _read_bits(br, 1);
+  pps.bottom_field_pic_order = _read_bits(br, 1);
+  pps.num_slice_groups = _read_ue(br) + 1;
+  if (pps.num_slice_groups == 1) {
+    pps.num_ref_idx_l0_active = _read_ue(br) + 1;
+    _read_ue(br); // num_ref_idx_l1_default_active_minus1
+    pps.weighted_pred = _read_bits(br, 1);
+    _read_bits(br, 2); // weighted_bipred_idc
+    _read_se(br); // pic_init_qp_minus26
+    _read_se(br); // pic_init_qs_minus26
+    _read_se(br); // chroma_qp_index_offset
+    pps.deblocking_filter_control = _read_bits(br, 1);
+    _read_bits(br, 1); // constrained_intra_pred_flag
+    pps.redundant_pic_cnt = _read_bits(br, 1);
+  }
+  pps.valid = !br->overrun && pps.sps_id < MAX_SPS;
+  pthis->pps[pps_id] = pps;
+}
+
+// Reads a slice header up to frame_num. Returns the SPS the slice uses, or
+// NULL if it cannot be followed.
+static struct h264_sps_s* _parse_slice_header(struct h264_skip_s* pthis,
+                                              struct bit_reader_s* br,
+                                              unsigned* pps_id_out,
+                                              int* frame_num_out)
+{
+  _read_ue(br); // first_mb_in_slice
+  _read_ue(br); // slice_type
+  unsigned pps_id = _read_ue(br);
+  if (pps_id >= MAX_PPS || !pthis->pps[pps_id].valid) {
+    return NULL;
+  }
+  struct h264_sps_s* sps = &pthis->sps[pthis->pps[pps_id].sps_id];
+  if (!sps->valid) {
+    return NULL;
+  }
+  if (sps->chroma_format_idc == 3) {
+    // colour_plane_id would come first; such streams are never ready
+    return NULL;
+  }
+  *pps_id_out = pps_id;
+  *frame_num_out = _read_bits(br, sps->log2_max_frame_num);
+  return br->overrun ? NULL : sps;
+}
+
+static void _parse_slice(struct h264_skip_s* pthis, struct bit_reader_s* br) {
+  unsigned pps_id;
+  int frame_num;
+  if (_parse_slice_header(pthis, br, &pps_id, &frame_num)) {
+    pthis->pps_id = pps_id;
+    pthis->frame_num = frame_num;
+    pthis->seen_slice = 1;
+  }
+}
+
+void h264_skip_alloc(struct h264_skip_s** skip_out) {
+  struct h264_skip_s* pthis = (struct h264_skip_s*)
+  calloc(1, sizeof(struct h264_skip_s));
+  *skip_out = pthis;
+}
+
+void h264_skip_free(struct h264_skip_s* pthis) {
+  free(pthis);
+}
+
+void h264_skip_observe(struct h264_skip_s* pthis,
+                       const uint8_t* data, int size)
+{
+  int i = 0;
+  while (i + 3 < size) {
+    // find the next start code
+    if (data[i] || data[i + 1] || data[i + 2] != 1) {
+      i++;
+      continue;
+    }
+    i += 3;
+    int end = i;
+    while (end + 2 < size &&
+           (data[end] || data[end + 1] || data[end + 2] > 1))
+    {
+      end++;
+    }
+    if (end + 2 >= size) {
+      end = size;
+    }
+    int nal_ref_idc = (data[i] >> 5) & 3;
+    int nal_type = data[i] & 0x1f;
+    struct bit_reader_s br;
+    _reader_init(&br, data + i + 1, end - i - 1);
+    if (nal_type == NAL_SPS) {
+      _parse_sps(pthis, &br);
+    } else if (nal_type == NAL_PPS) {
+      _parse_pps(pthis, &br);
+    } else if ((nal_type == NAL_SLICE || nal_type == NAL_IDR_SLICE) &&
+               nal_ref_idc)
+    {
+      _parse_slice(pthis, &br);
+    }
+    i = end;
+  }
+}
+
+// Explains, once, why a stream cannot take skip frames.
+static char _check_supported(struct h264_skip_s* pthis) {
+  const char* reason = NULL;
+  struct h264_pps_s* pps = &pthis->pps[pthis->pps_id];
+  struct h264_sps_s* sps = &pthis->sps[pps->sps_id];
+  if (!pthis->seen_slice || !pps->valid || !sps->valid) {
+    return 0;
+  }
+  if (pps->cabac) {
+    reason = "CABAC";
+  } else if (sps->poc_type != 2) {
+    reason = "pic_order_cnt_type other than 2";
+  } else if (sps->max_num_ref_frames > 1) {
+    // skip frames would push the encoder's own references out of the DPB
+    reason = "more than one reference frame";
+  } else if (!sps->frame_mbs_only) {
+    reason = "interlacing";
+  } else if (sps->chroma_format_idc == 3) {
+    reason = "4:4:4";
+  } else if (pps->num_slice_groups != 1) {
+    reason = "slice groups";
+  } else if (pps->weighted_pred) {
+    reason = "weighted prediction";
+  } else if (pps->redundant_pic_cnt) {
+    reason = "redundant pictures";
+  }
+  if (reason && !pthis->warned) {
+    printf("h264_skip: stream uses %s; encoding idle frames instead\n",
+           reason);
+    pthis->warned = 1;
+  }
+  return !reason;
+}
+
+char h264_skip_is_ready(struct h264_skip_s* pthis) {
+  return _check_supported(pthis);
+}
+
+int h264_skip_build(struct h264_skip_s* pthis, AVPacket* pkt) {
+  if (!_check_supported(pthis)) {
+    return AVERROR(ENOSYS);
+  }
+  struct h264_pps_s* pps = &pthis->pps[pthis->pps_id];
+  struct h264_sps_s* sps = &pthis->sps[pps->sps_id];
+  int frame_num = (pthis->frame_num + 1) & ((1 << sps->log2_max_frame_num) - 1);
+
+  struct bit_writer_s bw = { { 0 }, 0 };
+  _write_ue(&bw, 0); // first_mb_in_slice
+  _write_ue(&bw, 5); // slice_type: P, as are all slices of the picture
+  _write_ue(&bw, pthis->pps_id);
+  _write_bits(&bw, frame_num, sps->log2_max_frame_num);
+  // pic_order_cnt_type 2 derives POC from frame_num; nothing to send
+  if (pps->num_ref_idx_l0_active != 1) {
+    _write_bits(&bw, 1, 1); // num_ref_idx_active_override_flag
+    _write_ue(&bw, 0);
+  } else {
+    _write_bits(&bw, 0, 1);
+  }
+  _write_bits(&bw, 0, 1); // ref_pic_list_modification_flag_l0
+  _write_bits(&bw, 0, 1); // adaptive_ref_pic_marking_mode_flag
+  _write_ue(&bw, 0); // slice_qp_delta (se 0)
+  if (pps->deblocking_filter_control) {
+    _write_ue(&bw, 1); // disable_deblocking_filter_idc
+  }
+  _write_ue(&bw, sps->mb_width * sps->mb_height); // mb_skip_run
+  _write_bits(&bw, 1, 1); // rbsp_stop_one_bit
+  int rbsp_size = (bw.bits + 7) >> 3;
+
+  // start code, NAL header, then the payload with emulation prevention
+  int ret = av_new_packet(pkt, 5 + rbsp_size * 3 / 2 + 1);
+  if (ret) {
+    return ret;
+  }
+  uint8_t* out = pkt->data;
+  int size = 0;
+  out[size++] = 0;
+  out[size++] = 0;
+  out[size++] = 0;
+  out[size++] = 1;
+  out[size++] = (2 << 5) | NAL_SLICE;
+  int zeros = 0;
+  for (int i = 0; i < rbsp_size; i++) {
+    if (zeros >= 2 && bw.data[i] <= 3) {
+      out[size++] = 3;
+      zeros = 0;
+    }
+    out[size++] = bw.data[i];
+    zeros = bw.data[i] ? 0 : zeros + 1;
+  }
+  pkt->size = size;
+  pkt->flags &= ~AV_PKT_FLAG_KEY;
+  pthis->frame_num = frame_num;
+  pthis->frame_num_offset =
+  (pthis->frame_num_offset + 1) & ((1 << sps->log2_max_frame_num) - 1);
+  return 0;
+}
+
+// Overwrites n bits at bit offset pos of an unescaped payload.
+static void _patch_bits(uint8_t* data, int pos, unsigned value, int n) {
+  while (n--) {
+    uint8_t mask = 0x80 >> (pos & 7);
+    if ((value >> n) & 1) {
+      data[pos >> 3] |= mask;
+    } else {
+      data[pos >> 3] &= ~mask;
+    }
+    pos++;
+  }
+}
+
+// Copies one slice NAL (header byte on) to out with frame_num shifted by
+// the offset. Returns the bytes written, or 0 if the slice cannot be
+// followed and should be copied as is.
+static int _renumber_slice(struct h264_skip_s* pthis, const uint8_t* nal,
+                           int size, uint8_t* out)
+{
+  struct bit_reader_s br;
+  _reader_init(&br, nal + 1, size - 1);
+  unsigned pps_id;
+  int frame_num;
+  struct h264_sps_s* sps = _parse_slice_header(pthis, &br, &pps_id,
+                                               &frame_num);
+  if (!sps) {
+    return 0;
+  }
+  int frame_num_pos = br.rbsp_bits - sps->log2_max_frame_num;
+  frame_num = (frame_num + pthis->frame_num_offset) &
+  ((1 << sps->log2_max_frame_num) - 1);
+
+  // unescape, patch, then escape again: the new bits may need emulation
+  // prevention where the old ones did not, or the other way round
+  uint8_t* rbsp = (uint8_t*)av_malloc(size);
+  if (!rbsp) {
+    return 0;
+  }
+  int rbsp_size = 0;
+  int zeros = 0;
+  for (int i = 1; i < size; i++) {
+    if (zeros >= 2 && nal[i] == 3) {
+      zeros = 0;
+      continue;
+    }
+    rbsp[rbsp_size++] = nal[i];
+    zeros = nal[i] ? 0 : zeros + 1;
+  }
+  _patch_bits(rbsp, frame_num_pos, frame_num, sps->log2_max_frame_num);
+
+  int written = 0;
+  out[written++] = nal[0];
+  zeros = 0;
+  for (int i = 0; i < rbsp_size; i++) {
+    if (zeros >= 2 && rbsp[i] <= 3) {
+      out[written++] = 3;
+      zeros = 0;
+    }
+    out[written++] = rbsp[i];
+    zeros = rbsp[i] ? 0 : zeros + 1;
+  }
+  av_free(rbsp);
+  return written;
+}
+
+int h264_skip_renumber(struct h264_skip_s* pthis, AVPacket* pkt) {
+  const uint8_t* data = pkt->data;
+  int size = pkt->size;
+  AVPacket* out = NULL;
+  int out_size = 0;
+  // input bytes already in out
+  int copied = 0;
+  int i = 0;
+  while (i + 3 < size) {
+    if (data[i] || data[i + 1] || data[i + 2] != 1) {
+      i++;
+      continue;
+    }
+    i += 3;
+    int end = i;
+    while (end + 2 < size &&
+           (data[end] || data[end + 1] || data[end + 2] > 1))
+    {
+      end++;
+    }
+    if (end + 2 >= size) {
+      end = size;
+    }
+    int nal_type = data[i] & 0x1f;
+    if (nal_type == NAL_IDR_SLICE) {
+      // the encoder restarts the chain itself
+      pthis->frame_num_offset = 0;
+    } else if (nal_type == NAL_SLICE && pthis->frame_num_offset) {
+      if (!out) {
+        out = av_packet_alloc();
+        // escaping at most grows a payload by half
+        if (!out || av_new_packet(out, size * 3 / 2 + 16)) {
+          av_packet_free(&out);
+          return AVERROR(ENOMEM);
+        }
+      }
+      memcpy(out->data + out_size, data + copied, i - copied);
+      out_size += i - copied;
+      int written = _renumber_slice(pthis, data + i, end - i,
+                                    out->data + out_size);
+      if (!written) {
+        memcpy(out->data + out_size, data + i, end - i);
+        written = end - i;
+      }
+      out_size += written;
+      copied = end;
+    }
+    i = end;
+  }
+  if (out) {
+    memcpy(out->data + out_size, data + copied, size - copied);
+    out_size += size - copied;
+    av_shrink_packet(out, out_size);
+    av_packet_copy_props(out, pkt);
+    av_packet_unref(pkt);
+    av_packet_move_ref(pkt, out);
+    av_packet_free(&out);
+  }
+  h264_skip_observe(pthis, pkt->data, pkt->size);
+  return 0;
+}
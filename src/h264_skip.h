@@ -0,0 +1,52 @@
+//
+//  h264_skip.h
+//  x11pulsemux
+//
+
+#ifndef h264_skip_h
+#define h264_skip_h
+
+#include <libavcodec/avcodec.h>
+
+/**
+ * Synthesizes H.264 P frames in which every macroblock is skipped, i.e. an
+ * exact repeat of the previous picture, without running the encoder. The
+ * builder learns the stream layout by watching the encoder's own output
+ * (extradata and packets, Annex B): SPS/PPS give the picture size and slice
+ * header syntax, and each reference slice gives the frame_num to continue
+ * from.
+ *
+ * Only the shapes x264 produces without B-frames are supported: CAVLC,
+ * progressive, pic_order_cnt_type 2, one slice group, one reference frame.
+ * Anything else leaves the builder unready and callers should encode as
+ * usual.
+ *
+ * Skip frames are reference frames and advance frame_num, which the encoder
+ * does not know about. Callers pass every encoder packet through
+ * h264_skip_renumber, which shifts its frame_num past the skip frames so the
+ * chain stays unbroken without forcing an IDR. With one reference frame the
+ * encoder's next picture predicts from a skip frame that is identical to
+ * the picture it predicted from.
+ */
+struct h264_skip_s;
+
+void h264_skip_alloc(struct h264_skip_s** skip_out);
+void h264_skip_free(struct h264_skip_s* skip);
+
+// Feeds Annex B data written by the encoder. Parameter sets configure the
+// builder; slices update the frame_num to continue from.
+void h264_skip_observe(struct h264_skip_s* skip,
+                       const uint8_t* data, int size);
+
+// Rewrites the slices of an encoder packet (Annex B) to follow the skip
+// frames built so far, then observes it. pkt gets a new buffer if anything
+// changed; its properties are kept.
+int h264_skip_renumber(struct h264_skip_s* skip, AVPacket* pkt);
+
+char h264_skip_is_ready(struct h264_skip_s* skip);
+
+// Builds the next skip frame into pkt (data, size and flags only; timing is
+// up to the caller).
+int h264_skip_build(struct h264_skip_s* skip, AVPacket* pkt);
+
+#endif /* h264_skip_h */
@@ -0,0 +1,229 @@
+//
+//  interleaver.c
+//  x11pulsemux
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+#include "interleaver.h"
+#include "media_clock.h"
+
+static const int64_t default_max_delay = 500000000;
+static const int64_t default_stall_timeout = 2000000000;
+
+struct interleaver_entry_s {
+  AVPacket packet;
+  // dts on the timeline (ns)
+  int64_t ts;
+  // push order, so equal timestamps keep it
+  uint64_t seq;
+};
+
+struct interleaver_stream_s {
+  // latest ts sent; nothing earlier is expected from this stream
+  int64_t last_ts;
+  // wall time (media clock) of the last push
+  int64_t last_push;
+  char stalled;
+};
+
+struct interleaver_s {
+  struct interleaver_config_s config;
+  struct interleaver_stream_s* streams;
+  // binary min-heap on (ts, seq)
+  struct interleaver_entry_s* heap;
+  unsigned int heap_size;
+  int count;
+  uint64_t next_seq;
+  // newest ts pushed and last ts released, across streams
+  int64_t max_ts;
+  int64_t released_ts;
+  struct interleaver_stats_s stats;
+};
+
+static char _before(struct interleaver_entry_s* a,
+                    struct interleaver_entry_s* b)
+{
+  return a->ts < b->ts || (a->ts == b->ts && a->seq < b->seq);
+}
+
+static void _swap(struct interleaver_entry_s* a, struct interleaver_entry_s* b)
+{
+  struct interleaver_entry_s tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static void _sift_up(struct interleaver_s* pthis, int i) {
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!_before(&pthis->heap[i], &pthis->heap[parent])) {
+      break;
+    }
+    _swap(&pthis->heap[i], &pthis->heap[parent]);
+    i = parent;
+  }
+}
+
+static void _sift_down(struct interleaver_s* pthis, int i) {
+  while (1) {
+    int first = i;
+    int left = i * 2 + 1;
+    int right = left + 1;
+    if (left < pthis->count && _before(&pthis->heap[left], &pthis->heap[first]))
+    {
+      first = left;
+    }
+    if (right < pthis->count &&
+        _before(&pthis->heap[right], &pthis->heap[first]))
+    {
+      first = right;
+    }
+    if (first == i) {
+      break;
+    }
+    _swap(&pthis->heap[i], &pthis->heap[first]);
+    i = first;
+  }
+}
+
+int interleaver_alloc(struct interleaver_s** interleaver_out,
+                      struct interleaver_config_s* config)
+{
+  if (config->nb_streams < 1) {
+    return EINVAL;
+  }
+  struct interleaver_s* pthis = (struct interleaver_s*)
+  calloc(1, sizeof(struct interleaver_s));
+  memcpy(&pthis->config, config, sizeof(struct interleaver_config_s));
+  if (pthis->config.max_delay <= 0) {
+    pthis->config.max_delay = default_max_delay;
+  }
+  if (pthis->config.stall_timeout <= 0) {
+    pthis->config.stall_timeout = default_stall_timeout;
+  }
+  pthis->streams = (struct interleaver_stream_s*)
+  calloc(config->nb_streams, sizeof(struct interleaver_stream_s));
+  interleaver_reset(pthis);
+  *interleaver_out = pthis;
+  return 0;
+}
+
+void interleaver_free(struct interleaver_s* pthis) {
+  if (!pthis) {
+    return;
+  }
+  for (int i = 0; i < pthis->count; i++) {
+    av_packet_unref(&pthis->heap[i].packet);
+  }
+  av_free(pthis->heap);
+  free(pthis->streams);
+  free(pthis);
+}
+
+void interleaver_reset(struct interleaver_s* pthis) {
+  int64_t now = media_clock_now();
+  for (int i = 0; i < pthis->config.nb_streams; i++) {
+    pthis->streams[i].last_ts = INT64_MIN;
+    // a stream that never sends stalls stall_timeout from now
+    pthis->streams[i].last_push = now;
+    pthis->streams[i].stalled = 0;
+  }
+  pthis->max_ts = INT64_MIN;
+  pthis->released_ts = INT64_MIN;
+}
+
+int interleaver_push(struct interleaver_s* pthis, AVPacket* packet,
+                     AVRational time_base)
+{
+  int index = packet->stream_index;
+  if (index < 0 || index >= pthis->config.nb_streams) {
+    av_packet_unref(packet);
+    return AVERROR(EINVAL);
+  }
+  struct interleaver_entry_s* heap =
+  av_fast_realloc(pthis->heap, &pthis->heap_size,
+                  (pthis->count + 1) * sizeof(struct interleaver_entry_s));
+  if (!heap) {
+    av_packet_unref(packet);
+    return AVERROR(ENOMEM);
+  }
+  pthis->heap = heap;
+
+  int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+  ts = av_rescale_q(ts, time_base, av_make_q(1, MEDIA_CLOCK_NS_PER_SEC));
+  struct interleaver_entry_s* entry = &pthis->heap[pthis->count];
+  av_packet_move_ref(&entry->packet, packet);
+  entry->ts = ts;
+  entry->seq = pthis->next_seq++;
+  _sift_up(pthis, pthis->count++);
+
+  struct interleaver_stream_s* stream = &pthis->streams[index];
+  stream->last_ts = FFMAX(stream->last_ts, ts);
+  stream->last_push = media_clock_now();
+  if (stream->stalled) {
+    printf("interleaver: stream %d is back\n", index);
+    stream->stalled = 0;
+  }
+  pthis->max_ts = FFMAX(pthis->max_ts, ts);
+  pthis->stats.packets++;
+  if (ts < pthis->released_ts) {
+    pthis->stats.late++;
+  }
+  pthis->stats.max_depth = FFMAX(pthis->stats.max_depth, pthis->count);
+  return 0;
+}
+
+// Whether the head may go out: no stream still being waited on can send
+// anything earlier, or the head has waited long enough.
+static char _can_release(struct interleaver_s* pthis) {
+  struct interleaver_entry_s* head = &pthis->heap[0];
+  int64_t now = media_clock_now();
+  char waiting = 0;
+  for (int i = 0; i < pthis->config.nb_streams; i++) {
+    struct interleaver_stream_s* stream = &pthis->streams[i];
+    if (i == head->packet.stream_index || stream->last_ts >= head->ts) {
+      continue;
+    }
+    if (!stream->stalled &&
+        now - stream->last_push > pthis->config.stall_timeout)
+    {
+      printf("interleaver: nothing from stream %d for %lldms, "
+             "not waiting on it\n", i, (now - stream->last_push) / 1000000);
+      stream->stalled = 1;
+      pthis->stats.stalls++;
+    }
+    waiting |= !stream->stalled;
+  }
+  if (!waiting) {
+    return 1;
+  }
+  if (pthis->max_ts - head->ts >= pthis->config.max_delay) {
+    pthis->stats.forced++;
+    return 1;
+  }
+  return 0;
+}
+
+int interleaver_pop(struct interleaver_s* pthis, AVPacket* packet_out,
+                    char flush)
+{
+  if (!pthis->count || (!flush && !_can_release(pthis))) {
+    return AVERROR(EAGAIN);
+  }
+  pthis->released_ts = FFMAX(pthis->released_ts, pthis->heap[0].ts);
+  av_packet_move_ref(packet_out, &pthis->heap[0].packet);
+  pthis->heap[0] = pthis->heap[--pthis->count];
+  _sift_down(pthis, 0);
+  return 0;
+}
+
+void interleaver_get_stats(struct interleaver_s* pthis,
+                           struct interleaver_stats_s* stats_out)
+{
+  memcpy(stats_out, &pthis->stats, sizeof(struct interleaver_stats_s));
+}
@@ -0,0 +1,61 @@
+//
+//  interleaver.h
+//  x11pulsemux
+//
+
+#ifndef interleaver_h
+#define interleaver_h
+
+#include <libavcodec/avcodec.h>
+
+/**
+ * Orders the packets of any number of streams by dts on one timeline before
+ * they are written, so the container never has to buffer for us. A packet
+ * is released once every other stream has sent something at least as late,
+ * since nothing earlier can follow from it then. Two limits keep one slow
+ * stream from holding the rest: a packet is released anyway once the newest
+ * packet queued is max_delay past it, and a stream that has sent nothing
+ * for stall_timeout of wall time is not waited on at all until it sends
+ * again.
+ */
+struct interleaver_s;
+
+struct interleaver_config_s {
+  int nb_streams;
+  // both in ns; 0 keeps the default (500ms and 2s)
+  int64_t max_delay;
+  int64_t stall_timeout;
+};
+
+struct interleaver_stats_s {
+  int64_t packets;
+  // released because of max_delay rather than because every stream caught
+  // up
+  int64_t forced;
+  // packets that arrived behind one already released
+  int64_t late;
+  // times a stream was given up on for stall_timeout
+  int64_t stalls;
+  int max_depth;
+};
+
+int interleaver_alloc(struct interleaver_s** interleaver_out,
+                      struct interleaver_config_s* config);
+// Frees packets still queued.
+void interleaver_free(struct interleaver_s* interleaver);
+
+// Queues a packet of stream packet->stream_index, whose timestamps are in
+// time_base. Takes the reference over.
+int interleaver_push(struct interleaver_s* interleaver, AVPacket* packet,
+                     AVRational time_base);
+// Moves the next packet out if it may be written, else returns EAGAIN.
+// With flush set, every queued packet may be written, in order.
+int interleaver_pop(struct interleaver_s* interleaver, AVPacket* packet_out,
+                    char flush);
+// Forgets what each stream has sent, for a new output file. Flush first.
+void interleaver_reset(struct interleaver_s* interleaver);
+
+void interleaver_get_stats(struct interleaver_s* interleaver,
+                           struct interleaver_stats_s* stats_out);
+
+#endif /* interleaver_h */
@@ -9,10 +9,52 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <libavutil/parseutils.h>
 #include "muxer.h"
 
 void usage() {
-  printf("usage: x11pulsemux [-d X11DEVICE] -o OUTFILE_PATH\n");
+  printf("usage: x11pulsemux [-d X11DEVICE] [-F FBDIR | -w WINDOW] [-D] [-P] "
+         "[-m bt601|bt709] [-t THREADS] [-c WxH+X+Y] [-s WxH] [-r RATE] "
+         "[-R scale|segment] [-L] [-e THREADS] [-E frame|slice] [-V] "
+         "[-g SECONDS] [-A avdevice|native] [-a SOURCE[=GAIN]]... [-f MS] "
+         "-o OUTFILE_PATH\n");
+  printf("  -F, --fbdir   read pixels from Xvfb's framebuffer file in FBDIR "
+         "(Xvfb -fbdir)\n");
+  printf("  -w, --window  capture one window, by id or title substring\n");
+  printf("  -D, --damage  only grab and convert regions reported by XDamage\n");
+  printf("  -P, --no-cursor leave the mouse pointer out of the recording "
+         "(with -F, Xvfb\n"
+         "                paints it into the framebuffer regardless)\n");
+  printf("  -m, --matrix  YUV conversion matrix (default bt601)\n");
+  printf("  -t, --threads color conversion threads (default: one per CPU)\n");
+  printf("  -c, --capture capture rectangle (default: whole screen)\n");
+  printf("  -s, --size    output size, scaled from the capture rectangle\n");
+  printf("  -r, --framerate capture rate, e.g. 60, 30000/1001 or ntsc "
+         "(default ntsc)\n");
+  printf("  -R, --resize  on a screen/window size change, scale into the "
+         "starting size or\n"
+         "                start a new segment file (default scale)\n");
+  printf("  -L, --live    low latency encoding for watching while "
+         "recording\n"
+         "                (zerolatency, slice threads, intra refresh)\n");
+  printf("  -e, --encoder-threads H.264 encoder threads (default: one per "
+         "CPU)\n");
+  printf("  -E, --encoder-threading encode whole frames in parallel, or "
+         "split each\n"
+         "                frame into slices for less delay (default frame)\n");
+  printf("  -V, --vfr     variable frame rate: do not encode repeated frames\n");
+  printf("  -g, --max-gap with -V, encode at least one frame every SECONDS "
+         "(default 1)\n");
+  printf("  -A, --audio-backend record through libavdevice or libpulse "
+         "directly\n"
+         "                (default avdevice)\n");
+  printf("  -a, --audio-source pulse source to record, with an optional "
+         "gain in dB;\n"
+         "                repeat to mix up to %d sources (default: the "
+         "server default)\n", MUXER_MAX_PULSE_SOURCES);
+  printf("  -f, --fragment with -A native, audio fragment size in ms "
+         "(default 10)\n");
 }
 
 volatile char interrupted = 0;
@@ -27,17 +69,57 @@ int main(int argc, char **argv)
   int c;
   char* outfile_path = NULL;
   char* device_name = ":0.0";
+  char* fbdir = NULL;
+  unsigned long window_id = 0;
+  char* window_name = NULL;
+  char* end = NULL;
+  char use_damage = 0;
+  char hide_cursor = 0;
+  char use_bt709 = 0;
+  int convert_threads = 0;
+  int capture_x = 0, capture_y = 0, capture_width = 0, capture_height = 0;
+  int output_width = 0, output_height = 0;
+  AVRational framerate = { 0, 0 };
+  char segment_on_resize = 0;
+  char live_profile = 0;
+  int encoder_threads = 0;
+  char encoder_slice_threads = 0;
+  char use_vfr = 0;
+  double max_frame_gap = 0;
+  char use_native_pulse = 0;
+  const char* pulse_devices[MUXER_MAX_PULSE_SOURCES] = { 0 };
+  double pulse_gains_db[MUXER_MAX_PULSE_SOURCES] = { 0 };
+  int pulse_device_count = 0;
+  int pulse_fragment_ms = 0;
 
   static struct option long_options[] =
   {
     {"output", required_argument,       0, 'o'},
     {"device", optional_argument,       0, 'd'},
+    {"fbdir", required_argument,        0, 'F'},
+    {"window", required_argument,       0, 'w'},
+    {"damage", no_argument,             0, 'D'},
+    {"no-cursor", no_argument,          0, 'P'},
+    {"matrix", required_argument,       0, 'm'},
+    {"threads", required_argument,      0, 't'},
+    {"capture", required_argument,      0, 'c'},
+    {"size", required_argument,         0, 's'},
+    {"framerate", required_argument,    0, 'r'},
+    {"resize", required_argument,       0, 'R'},
+    {"live", no_argument,               0, 'L'},
+    {"encoder-threads", required_argument, 0, 'e'},
+    {"encoder-threading", required_argument, 0, 'E'},
+    {"vfr", no_argument,                0, 'V'},
+    {"max-gap", required_argument,      0, 'g'},
+    {"audio-backend", required_argument, 0, 'A'},
+    {"audio-source", required_argument, 0, 'a'},
+    {"fragment", required_argument,     0, 'f'},
     {0, 0, 0, 0}
   };
   /* getopt_long stores the option index here. */
   int option_index = 0;
 
-  while ((c = getopt_long(argc, argv, "o:d:",
+  while ((c = getopt_long(argc, argv, "o:d:F:w:DPm:t:c:s:r:R:Le:E:Vg:A:a:f:",
                           long_options, &option_index)) != -1)
   {
     switch (c)
@@ -48,6 +130,111 @@ int main(int argc, char **argv)
       case 'd':
         device_name = optarg;
         break;
+      case 'F':
+        fbdir = optarg;
+        break;
+      case 'w':
+        // a number (0x... for hex) is a window id, anything else a title
+        window_id = strtoul(optarg, &end, 0);
+        if (*end || end == optarg) {
+          window_id = 0;
+          window_name = optarg;
+        }
+        break;
+      case 'D':
+        use_damage = 1;
+        break;
+      case 'P':
+        hide_cursor = 1;
+        break;
+      case 'm':
+        if (!strcmp(optarg, "bt709")) {
+          use_bt709 = 1;
+        } else if (strcmp(optarg, "bt601")) {
+          usage();
+          return 1;
+        }
+        break;
+      case 't':
+        convert_threads = atoi(optarg);
+        break;
+      case 'c':
+        // the offset is optional: WxH or WxH+X+Y
+        if (sscanf(optarg, "%dx%d+%d+%d", &capture_width, &capture_height,
+                   &capture_x, &capture_y) < 2 ||
+            capture_width <= 0 || capture_height <= 0)
+        {
+          usage();
+          return 1;
+        }
+        break;
+      case 's':
+        if (sscanf(optarg, "%dx%d", &output_width, &output_height) != 2 ||
+            output_width <= 0 || output_height <= 0)
+        {
+          usage();
+          return 1;
+        }
+        break;
+      case 'r':
+        if (av_parse_video_rate(&framerate, optarg) < 0) {
+          usage();
+          return 1;
+        }
+        break;
+      case 'R':
+        if (!strcmp(optarg, "segment")) {
+          segment_on_resize = 1;
+        } else if (strcmp(optarg, "scale")) {
+          usage();
+          return 1;
+        }
+        break;
+      case 'L':
+        live_profile = 1;
+        break;
+      case 'e':
+        encoder_threads = atoi(optarg);
+        break;
+      case 'E':
+        if (!strcmp(optarg, "slice")) {
+          encoder_slice_threads = 1;
+        } else if (strcmp(optarg, "frame")) {
+          usage();
+          return 1;
+        }
+        break;
+      case 'V':
+        use_vfr = 1;
+        break;
+      case 'g':
+        max_frame_gap = atof(optarg);
+        break;
+      case 'A':
+        if (!strcmp(optarg, "native")) {
+          use_native_pulse = 1;
+        } else if (strcmp(optarg, "avdevice")) {
+          usage();
+          return 1;
+        }
+        break;
+      case 'a':
+        if (pulse_device_count == MUXER_MAX_PULSE_SOURCES) {
+          usage();
+          return 1;
+        }
+        // SOURCE or SOURCE=GAIN; pulse names never contain '='
+        pulse_gains_db[pulse_device_count] = 0;
+        end = strchr(optarg, '=');
+        if (end) {
+          *end = '\0';
+          pulse_gains_db[pulse_device_count] = atof(end + 1);
+        }
+        pulse_devices[pulse_device_count++] = optarg;
+        break;
+      case 'f':
+        pulse_fragment_ms = atoi(optarg);
+        break;
       case '?':
         if (isprint (optopt))
           fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -70,6 +257,32 @@ int main(int argc, char **argv)
   struct muxer_config_s config = { 0 };
   config.outfile_path = outfile_path;
   config.device_name = device_name;
+  config.fbdir = fbdir;
+  config.window_id = window_id;
+  config.window_name = window_name;
+  config.use_damage = use_damage;
+  config.hide_cursor = hide_cursor;
+  config.use_bt709 = use_bt709;
+  config.convert_threads = convert_threads;
+  config.capture_x = capture_x;
+  config.capture_y = capture_y;
+  config.capture_width = capture_width;
+  config.capture_height = capture_height;
+  config.output_width = output_width;
+  config.output_height = output_height;
+  config.framerate_num = framerate.num;
+  config.framerate_den = framerate.den;
+  config.segment_on_resize = segment_on_resize;
+  config.live_profile = live_profile;
+  config.encoder_threads = encoder_threads;
+  config.encoder_slice_threads = encoder_slice_threads;
+  config.use_vfr = use_vfr;
+  config.max_frame_gap = max_frame_gap;
+  config.use_native_pulse = use_native_pulse;
+  memcpy(config.pulse_devices, pulse_devices, sizeof(pulse_devices));
+  memcpy(config.pulse_gains_db, pulse_gains_db, sizeof(pulse_gains_db));
+  config.pulse_device_count = pulse_device_count;
+  config.pulse_fragment_ms = pulse_fragment_ms;
   struct muxer_s* muxer = NULL;
   muxer_initialize();
   muxer_open(&muxer, &config);
@@ -78,11 +291,13 @@ int main(int argc, char **argv)
     return -1;
   }
   signal(SIGINT, handle_interrupt);
-  while (!interrupted) {
+  while (!interrupted && muxer_is_running(muxer)) {
     usleep(10000);
   }
-  fprintf(stderr, "interrupted. closing...\n");
+  char failed = !interrupted;
+  fprintf(stderr, failed ? "muxer stopped. closing...\n" :
+          "interrupted. closing...\n");
   muxer_close(muxer);
   fprintf(stderr, "muxer closed. exit.\n");
-  return 0;
+  return failed;
 }
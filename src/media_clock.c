@@ -0,0 +1,188 @@
+//
+//  media_clock.c
+//  x11pulsemux
+//
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include <uv.h>
+#include <libavutil/time.h>
+#include "media_clock.h"
+
+// one point per second of samples, ten minutes of them
+static const int history_capacity = 600;
+// seconds of history before the slope is trusted over plain offset
+static const int min_drift_points = 30;
+// reports further than this off the line are outliers...
+static const double max_error_ns = 50e6;
+// ...and this many in a row mean the samples themselves jumped
+static const int max_outliers = 4;
+
+struct media_clock_point_s {
+  int64_t index;
+  // capture time minus the nominal time of index
+  double residual;
+};
+
+struct media_clock_s {
+  int sample_rate;
+  double period_ns;
+  struct media_clock_point_s* points;
+  int count;
+  int next;
+  // least delayed report of the second being collected
+  char started;
+  char has_best;
+  struct media_clock_point_s best;
+  int64_t interval_end;
+  int outliers;
+  // residual = offset + slope * (index - origin)
+  int64_t origin;
+  double offset;
+  double slope;
+  int64_t resets;
+};
+
+static uv_once_t wall_once = UV_ONCE_INIT;
+static int64_t wall_offset_ns;
+
+static void _init_wall_offset(void) {
+  wall_offset_ns = media_clock_now() - av_gettime() * 1000;
+}
+
+int64_t media_clock_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * MEDIA_CLOCK_NS_PER_SEC + ts.tv_nsec;
+}
+
+int64_t media_clock_from_wall_us(int64_t wall_us) {
+  uv_once(&wall_once, _init_wall_offset);
+  return wall_us * 1000 + wall_offset_ns;
+}
+
+double media_clock_to_seconds(int64_t ns) {
+  return ns / (double)MEDIA_CLOCK_NS_PER_SEC;
+}
+
+int media_clock_alloc(struct media_clock_s** clock_out, int sample_rate) {
+  if (sample_rate < 1) {
+    return EINVAL;
+  }
+  struct media_clock_s* pthis = (struct media_clock_s*)
+  calloc(1, sizeof(struct media_clock_s));
+  pthis->points = (struct media_clock_point_s*)
+  calloc(history_capacity, sizeof(struct media_clock_point_s));
+  pthis->sample_rate = sample_rate;
+  pthis->period_ns = MEDIA_CLOCK_NS_PER_SEC / (double)sample_rate;
+  *clock_out = pthis;
+  return 0;
+}
+
+void media_clock_free(struct media_clock_s* pthis) {
+  if (!pthis) {
+    return;
+  }
+  free(pthis->points);
+  free(pthis);
+}
+
+static double _get_residual(struct media_clock_s* pthis, int64_t index) {
+  return pthis->offset + pthis->slope * (index - pthis->origin);
+}
+
+static void _fit(struct media_clock_s* pthis) {
+  int first = (pthis->next - pthis->count + history_capacity) %
+  history_capacity;
+  pthis->origin = pthis->points[first].index;
+  double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+  for (int i = 0; i < pthis->count; i++) {
+    struct media_clock_point_s* point =
+    &pthis->points[(first + i) % history_capacity];
+    double x = point->index - pthis->origin;
+    sum_x += x;
+    sum_y += point->residual;
+    sum_xx += x * x;
+    sum_xy += x * point->residual;
+  }
+  double n = pthis->count;
+  double denominator = n * sum_xx - sum_x * sum_x;
+  if (pthis->count < min_drift_points || denominator <= 0) {
+    pthis->slope = 0;
+    pthis->offset = sum_y / n;
+    return;
+  }
+  pthis->slope = (n * sum_xy - sum_x * sum_y) / denominator;
+  pthis->offset = (sum_y - pthis->slope * sum_x) / n;
+}
+
+static void _reset(struct media_clock_s* pthis) {
+  pthis->count = 0;
+  pthis->next = 0;
+  pthis->started = 0;
+  pthis->has_best = 0;
+  pthis->outliers = 0;
+  pthis->slope = 0;
+  pthis->resets++;
+}
+
+char media_clock_observe(struct media_clock_s* pthis, int64_t sample_index,
+                         int64_t time)
+{
+  char reset = 0;
+  double residual = time - sample_index * pthis->period_ns;
+  if (pthis->started &&
+      fabs(residual - _get_residual(pthis, sample_index)) > max_error_ns)
+  {
+    if (++pthis->outliers < max_outliers) {
+      return 0;
+    }
+    _reset(pthis);
+    reset = 1;
+  }
+  pthis->outliers = 0;
+  if (!pthis->started) {
+    pthis->started = 1;
+    pthis->interval_end = sample_index + pthis->sample_rate;
+    pthis->origin = sample_index;
+    pthis->offset = residual;
+  }
+  if (!pthis->has_best || residual < pthis->best.residual) {
+    pthis->best.index = sample_index;
+    pthis->best.residual = residual;
+    pthis->has_best = 1;
+    if (!pthis->count) {
+      // nothing fitted yet; the least delayed report is all we have
+      pthis->origin = sample_index;
+      pthis->offset = residual;
+    }
+  }
+  if (sample_index >= pthis->interval_end) {
+    pthis->points[pthis->next] = pthis->best;
+    pthis->next = (pthis->next + 1) % history_capacity;
+    if (pthis->count < history_capacity) {
+      pthis->count++;
+    }
+    pthis->has_best = 0;
+    pthis->interval_end = sample_index + pthis->sample_rate;
+    _fit(pthis);
+  }
+  return reset;
+}
+
+int64_t media_clock_get_time(struct media_clock_s* pthis,
+                             int64_t sample_index)
+{
+  return llrint(sample_index * pthis->period_ns +
+                _get_residual(pthis, sample_index));
+}
+
+double media_clock_get_drift(struct media_clock_s* pthis) {
+  return pthis->period_ns / (pthis->period_ns + pthis->slope) - 1;
+}
+
+int64_t media_clock_get_resets(struct media_clock_s* pthis) {
+  return pthis->resets;
+}
@@ -0,0 +1,55 @@
+//
+//  media_clock.h
+//  x11pulsemux
+//
+
+#ifndef media_clock_h
+#define media_clock_h
+
+#include <stdint.h>
+
+/**
+ * The timeline every source stamps its frames on: CLOCK_MONOTONIC in
+ * nanoseconds. It never steps, so timestamps from different threads and
+ * different devices compare directly.
+ */
+#define MEDIA_CLOCK_NS_PER_SEC 1000000000LL
+
+int64_t media_clock_now(void);
+// Maps a wall clock time in us (av_gettime) onto the timeline. The offset
+// between the two clocks is taken once, so later wall clock steps do not
+// show up in mapped timestamps.
+int64_t media_clock_from_wall_us(int64_t wall_us);
+double media_clock_to_seconds(int64_t ns);
+
+/**
+ * Tracks where the samples of a sample clocked source (an audio device)
+ * land on the timeline. The device's crystal runs a little fast or slow
+ * against CLOCK_MONOTONIC, so "sample n is at start + n / rate" drifts off
+ * by tens of milliseconds an hour.
+ *
+ * Callers report the capture time of sample indices as they arrive. Those
+ * times are late by scheduling noise, never early, so each second keeps
+ * only its least delayed report, and a least squares line through the
+ * last few minutes of those gives both where a sample really is and how
+ * fast the device runs. A report far off the line that persists means
+ * samples were lost or repeated; the estimate then starts over.
+ */
+struct media_clock_s;
+
+int media_clock_alloc(struct media_clock_s** clock_out, int sample_rate);
+void media_clock_free(struct media_clock_s* clock);
+
+// Reports that sample_index was captured at time. Returns nonzero when the
+// report broke with the estimate and it started over.
+char media_clock_observe(struct media_clock_s* clock, int64_t sample_index,
+                         int64_t time);
+// Estimated timeline position of sample_index.
+int64_t media_clock_get_time(struct media_clock_s* clock,
+                             int64_t sample_index);
+// Device rate error: actual / nominal - 1, positive when the device runs
+// fast. 0 until there are enough reports to tell.
+double media_clock_get_drift(struct media_clock_s* clock);
+int64_t media_clock_get_resets(struct media_clock_s* clock);
+
+#endif /* media_clock_h */
@@ -2,11 +2,16 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavdevice/avdevice.h>
+#include <math.h>
 #include <signal.h>
 #include <uv.h>
 #include "pulse_audio_source.h"
+#include "archive_mixer.h"
 #include "x11_video_source.h"
 #include "file_writer.h"
+#include "color_convert.h"
+#include "resampler.h"
+#include "media_clock.h"
 #include "muxer.h"
 
 struct muxer_s {
@@ -14,13 +19,27 @@ struct muxer_s {
   char* device_name;
   uv_thread_t worker_thread;
   volatile sig_atomic_t interrupted;
-  struct pulse_s* pulse;
   struct x11_s* x11grab;
   struct file_writer_t* file_writer;
+  // every pulse source, mixed down to the one audio track
   struct archive_mixer_s* mixer;
+  const char* pulse_devices[MUXER_MAX_PULSE_SOURCES];
 
   char audio_up;
   char video_up;
+
+  // Sources signal wake_cond as they queue frames; muxer_main sleeps on it
+  // whenever a pass over both queues moved nothing.
+  uv_mutex_t wake_lock;
+  uv_cond_t wake_cond;
+  char wake_pending;
+
+  enum file_writer_rate_mode rate_mode;
+  double max_frame_gap;
+  enum file_writer_resize_mode resize_mode;
+  enum file_writer_profile profile;
+  enum file_writer_thread_type encoder_thread_type;
+  int encoder_threads;
 };
 
 int setup_outputs(struct muxer_s* pthis, AVFrame* first_video_frame)
@@ -33,38 +52,95 @@ int setup_outputs(struct muxer_s* pthis, AVFrame* first_video_frame)
     printf("file_writer_alloc failed with %d\n", ret);
     return ret;
   }
+  struct file_writer_config_s writer_config = { 0 };
+  writer_config.colorspace = first_video_frame->colorspace;
+  writer_config.rate_mode = pthis->rate_mode;
+  writer_config.max_frame_gap = pthis->max_frame_gap;
+  writer_config.resize_mode = pthis->resize_mode;
+  writer_config.profile = pthis->profile;
+  writer_config.video_thread_type = pthis->encoder_thread_type;
+  writer_config.video_threads = pthis->encoder_threads;
+  file_writer_load_config(pthis->file_writer, &writer_config);
   ret = file_writer_open(pthis->file_writer, pthis->outfile_path, width, height);
   if (ret) {
     printf("file_writer_open failed with %d\n", ret);
     return ret;
   }
-  // late start (see also muxer_open)
-//  ret = pulse_start(pthis->pulse);
+  // late start (see also muxer_open): capture straight into the format and
+  // frame size the audio encoder takes
+  struct file_writer_audio_format_s audio_format;
+  file_writer_get_audio_format(pthis->file_writer, &audio_format);
+  struct archive_mixer_config_s mixer_config = { 0 };
+  mixer_config.sample_fmt = audio_format.sample_fmt;
+  mixer_config.sample_rate = audio_format.sample_rate;
+  mixer_config.channel_layout = audio_format.channel_layout;
+  mixer_config.frame_size = audio_format.frame_size;
+  ret = archive_mixer_start(pthis->mixer, &mixer_config);
   if (ret) {
-    printf("failed to open pulse audio! ichabod will be silent.\n");
+    // muxer_main paces video by the audio head, so without a source it
+    // would never write another frame
+    printf("failed to open pulse audio (%d); stopping\n", ret);
   }
   return ret;
 }
 
+// Upper bound on a wait, in case a source stalls without a frame to report.
+static const uint64_t max_wait_ns = 100000000;
+
+static void _wake(struct muxer_s* pthis) {
+  uv_mutex_lock(&pthis->wake_lock);
+  pthis->wake_pending = 1;
+  uv_cond_signal(&pthis->wake_cond);
+  uv_mutex_unlock(&pthis->wake_lock);
+}
+
+static void _on_video_data(struct x11_s* x11, void* p) {
+  _wake((struct muxer_s*)p);
+}
+
+static void _on_audio_data(struct pulse_s* pulse, void* p) {
+  _wake((struct muxer_s*)p);
+}
+
+// Sleeps until a source queued something since the last wait.
+static void _wait_for_data(struct muxer_s* pthis) {
+  uv_mutex_lock(&pthis->wake_lock);
+  if (!pthis->wake_pending && !pthis->interrupted) {
+    uv_cond_timedwait(&pthis->wake_cond, &pthis->wake_lock, max_wait_ns);
+  }
+  pthis->wake_pending = 0;
+  uv_mutex_unlock(&pthis->wake_lock);
+}
+
 void muxer_main(void* p) {
   int ret;
   struct muxer_s* pthis = (struct muxer_s*)p;
   printf("muxer main\n");
   int64_t first_pts = -1;
   while (!pthis->interrupted) {
+    char progressed = 0;
     while (
       !pthis->interrupted && x11_has_next(pthis->x11grab)
-      && x11_get_head_ts(pthis->x11grab) < pulse_get_head_ts(pthis->pulse)
+      // the first frame opens the outputs, which starts audio
+      && (!pthis->file_writer ||
+          x11_get_head_ts(pthis->x11grab) <
+          archive_mixer_get_head_ts(pthis->mixer))
     ) {
       pthis->video_up = 1;
+      progressed = 1;
       AVFrame* frame = NULL;
       ret = x11_get_next(pthis->x11grab, &frame);
       if (ret) {
         printf("muxer_main: x11_get_next failed with %d\n", ret);
         continue;
       }
-      if (!pthis->file_writer) {
-        setup_outputs(pthis, frame);
+      if (!pthis->file_writer && setup_outputs(pthis, frame)) {
+        // nowhere to write, or nothing to pace it by; stop instead of
+        // capturing into the void
+        printf("muxer_main: cannot set up the outputs, stopping\n");
+        av_frame_free(&frame);
+        pthis->interrupted = 1;
+        break;
       }
       if (!pthis->audio_up) {
         printf("muxer_main: skip x11 frame (wait for audio)\n");
@@ -76,8 +152,15 @@ void muxer_main(void* p) {
       }
       int64_t adjusted_pts = frame->pts;
       adjusted_pts -= first_pts;
-      double timestamp = x11_convert_pts(pthis->x11grab, adjusted_pts);
-      ret = file_writer_push_video_frame(pthis->file_writer, frame, timestamp);
+      double timestamp = media_clock_to_seconds(adjusted_pts);
+      const struct x11_frame_meta_s* meta = x11_frame_get_meta(frame);
+      if (meta && meta->is_duplicate) {
+        ret = file_writer_push_duplicate_video_frame(pthis->file_writer,
+                                                     frame, timestamp);
+      } else {
+        ret = file_writer_push_video_frame(pthis->file_writer,
+                                           frame, timestamp);
+      }
       if (ret) {
         printf("muxer_main: file_writer_push_video_frame failed with %d\n",
                ret);
@@ -85,12 +168,14 @@ void muxer_main(void* p) {
     }
     
     while (
-      !pthis->interrupted && pulse_has_next(pthis->pulse)
-      && pulse_get_head_ts(pthis->pulse) < x11_get_head_ts(pthis->x11grab)
+      !pthis->interrupted && archive_mixer_has_next(pthis->mixer)
+      && archive_mixer_get_head_ts(pthis->mixer) <
+      x11_get_head_ts(pthis->x11grab)
     ) {
       pthis->audio_up = 1;
+      progressed = 1;
       AVFrame* frame = NULL;
-      ret = pulse_get_next(pthis->pulse, &frame);
+      ret = archive_mixer_get_next(pthis->mixer, &frame);
       if (ret) {
         continue;
       }
@@ -104,13 +189,16 @@ void muxer_main(void* p) {
       }
       int64_t adjusted_pts = frame->pts;
       adjusted_pts -= first_pts;
-      double timestamp = x11_convert_pts(pthis->x11grab, adjusted_pts);
+      double timestamp = media_clock_to_seconds(adjusted_pts);
       ret = file_writer_push_audio_frame(pthis->file_writer, frame, timestamp);
-      if (ret && ret != AVERROR(EAGAIN)) {
+      if (ret) {
         printf("muxer_main: file_writer_push_audio_frame failed with %d\n",
                ret);
       }
-      av_frame_free(&frame);
+    }
+
+    if (!progressed) {
+      _wait_for_data(pthis);
     }
   }
   printf("muxer main: exit loop\n");
@@ -118,6 +206,9 @@ void muxer_main(void* p) {
 
 void muxer_initialize() {
   avdevice_register_all();
+  color_convert_init();
+  resampler_init();
+  archive_mixer_init();
 }
 
 int muxer_open(struct muxer_s** muxer, struct muxer_config_s* config) {
@@ -126,25 +217,76 @@ int muxer_open(struct muxer_s** muxer, struct muxer_config_s* config) {
   pthis->device_name = calloc(strlen(config->device_name) + 1, 1);
   strcpy(pthis->outfile_path, config->outfile_path);
   strcat(pthis->device_name, config->device_name);
+  pthis->rate_mode = config->use_vfr ? FILE_WRITER_VFR : FILE_WRITER_CFR;
+  pthis->max_frame_gap = config->max_frame_gap;
+  pthis->resize_mode = config->segment_on_resize ?
+  FILE_WRITER_RESIZE_SEGMENT : FILE_WRITER_RESIZE_SCALE;
+  pthis->profile = config->live_profile ?
+  FILE_WRITER_PROFILE_LIVE : FILE_WRITER_PROFILE_ARCHIVE;
+  pthis->encoder_thread_type = config->encoder_slice_threads ?
+  FILE_WRITER_THREAD_SLICE : FILE_WRITER_THREAD_FRAME;
+  pthis->encoder_threads = config->encoder_threads;
   int ret;
+  uv_mutex_init(&pthis->wake_lock);
+  uv_cond_init(&pthis->wake_cond);
   x11_alloc(&pthis->x11grab);
   struct x11_grab_config_s x11_config = { 0 };
+  x11_config.on_video_data = _on_video_data;
+  x11_config.video_data_cb_p = pthis;
   x11_config.device_name = config->device_name;
-  // oops wire this up to the cli
-  x11_config.width = 2560;
-  x11_config.height = 1440;
+  x11_config.fbdir = config->fbdir;
+  x11_config.window_id = config->window_id;
+  x11_config.window_name = config->window_name;
+  x11_config.x = config->capture_x;
+  x11_config.y = config->capture_y;
+  x11_config.width = config->capture_width;
+  x11_config.height = config->capture_height;
+  x11_config.output_width = config->output_width;
+  x11_config.output_height = config->output_height;
+  // Scaling is cheapest fused into capture conversion; segments need the
+  // new size to reach the writer.
+  x11_config.follow_resize = config->segment_on_resize;
+  x11_config.framerate.num = config->framerate_num;
+  x11_config.framerate.den = config->framerate_den;
+  x11_config.use_damage = config->use_damage;
+  x11_config.draw_cursor = !config->hide_cursor;
+  x11_config.convert_threads = config->convert_threads;
+  x11_config.colorspace =
+  config->use_bt709 ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+  // Keep the freshest picture when the encoder falls behind.
+  x11_config.overflow_policy = FRAME_RING_DROP_OLDEST;
   ret = x11_start(pthis->x11grab, &x11_config);
   if (ret) {
     printf("x11_start failed with %d\n", ret);
     return ret;
   }
   
-  pulse_alloc(&pthis->pulse);
-  ret = pulse_start(pthis->pulse);
-  if (ret) {
-    printf("pulse_start failed with %d\n", ret);
-    return ret;
+  archive_mixer_alloc(&pthis->mixer);
+  struct pulse_config_s pulse_config = { 0 };
+  pulse_config.on_audio_data = _on_audio_data;
+  pulse_config.audio_data_cb_p = pthis;
+  // Dropping audio leaves audible gaps; hold the capture thread instead.
+  // (The native backend cannot wait on its mainloop thread and drops.)
+  pulse_config.overflow_policy = FRAME_RING_BLOCK;
+  pulse_config.backend = config->use_native_pulse ?
+  PULSE_BACKEND_NATIVE : PULSE_BACKEND_AVDEVICE;
+  pulse_config.fragment_ms = config->pulse_fragment_ms;
+  int pulse_device_count = FFMAX(config->pulse_device_count, 1);
+  for (int i = 0; i < pulse_device_count; i++) {
+    double gain_db = 0;
+    pulse_config.device = NULL;
+    if (config->pulse_device_count) {
+      pulse_config.device = config->pulse_devices[i];
+      gain_db = config->pulse_gains_db[i];
+    }
+    pthis->pulse_devices[i] = pulse_config.device;
+    ret = archive_mixer_add_source(pthis->mixer, &pulse_config,
+                                   powf(10, gain_db / 20));
+    if (ret) {
+      return ret;
+    }
   }
+  // started by setup_outputs once the audio encoder is known
   pthis->interrupted = 0;
   ret = uv_thread_create(&pthis->worker_thread, muxer_main, pthis);
   if (!ret) {
@@ -153,10 +295,48 @@ int muxer_open(struct muxer_s** muxer, struct muxer_config_s* config) {
   return ret;
 }
 
+static void print_queue_stats(const char* name,
+                              struct frame_ring_stats_s* stats)
+{
+  printf("muxer_close: %s queue pushed %lld frames, dropped %lld oldest "
+         "%lld newest, high water %d/%d\n",
+         name, stats->frames_pushed, stats->dropped_oldest,
+         stats->dropped_newest, stats->high_water_mark, stats->capacity);
+}
+
+static void print_pulse_stats(const char* name, struct pulse_stats_s* stats)
+{
+  print_queue_stats(name, &stats->queue);
+  printf("muxer_close: %s reordered %lld frames (%lld too late, dropped), "
+         "reorder depth %d\n", name, stats->reorder_events,
+         stats->reorder_late, stats->reorder_depth);
+  printf("muxer_close: %s clock drift %.1fppm, compensation %d "
+         "samples/s, %lld estimate resets, %lld gaps jumped\n",
+         name, stats->drift_ppm, stats->compensation,
+         stats->clock_resets, stats->clock_resyncs);
+}
+
+char muxer_is_running(struct muxer_s* pthis) {
+  return !pthis->interrupted;
+}
+
+static void print_latency(const char* name,
+                          struct file_writer_latency_s* latency)
+{
+  if (!latency->packets) {
+    return;
+  }
+  printf("muxer_close: %s capture to packet latency over %lld packets "
+         "p50=%lldus p95=%lldus p99=%lldus max=%lldus\n", name,
+         latency->packets, latency->p50_us, latency->p95_us,
+         latency->p99_us, latency->max_us);
+}
+
 int muxer_close(struct muxer_s* pthis) {
   int ret;
   printf("muxer_close\n");
   pthis->interrupted = 1;
+  _wake(pthis);
   ret = uv_thread_join(&pthis->worker_thread);
   if (ret) {
     printf("muxer_close: uv_thread_join failed with %d\n", ret);
@@ -165,22 +345,60 @@ int muxer_close(struct muxer_s* pthis) {
   if (ret) {
     printf("muxer_close: file_writer_close failed with %d\n", ret);
   }
-  ret = pulse_stop(pthis->pulse);
+  struct file_writer_stats_s writer_stats;
+  file_writer_get_stats(pthis->file_writer, &writer_stats);
+  print_latency("video", &writer_stats.video_latency);
+  print_latency("audio", &writer_stats.audio_latency);
+  ret = archive_mixer_stop(pthis->mixer);
   if (ret) {
-    printf("muxer_close: pulse_stop failed with %d\n", ret);
+    printf("muxer_close: archive_mixer_stop failed with %d\n", ret);
     return ret;
   }
-  pulse_free(pthis->pulse);
+  for (int i = 0; i < archive_mixer_get_source_count(pthis->mixer); i++) {
+    struct pulse_stats_s pulse_stats;
+    archive_mixer_get_source_stats(pthis->mixer, i, &pulse_stats);
+    print_pulse_stats(pthis->pulse_devices[i] ?
+                      pthis->pulse_devices[i] : "pulse", &pulse_stats);
+  }
+  struct archive_mixer_stats_s mixer_stats;
+  archive_mixer_get_stats(pthis->mixer, &mixer_stats);
+  if (mixer_stats.frames_mixed) {
+    printf("muxer_close: mixed %lld frames, padded %lld samples, "
+           "dropped %lld\n", mixer_stats.frames_mixed,
+           mixer_stats.samples_padded, mixer_stats.samples_dropped);
+  }
+  archive_mixer_free(pthis->mixer);
 
   ret = x11_stop(pthis->x11grab);
   if (ret) {
     printf("muxer_close: x11_stop failed with %d\n", ret);
     return ret;
   }
+  struct x11_stats_s x11_stats;
+  x11_get_stats(pthis->x11grab, &x11_stats);
+  if (x11_stats.frames_captured) {
+    printf("muxer_close: x11 captured %lld frames (%lld duplicate), "
+           "avg capture=%lldus convert=%lldus\n",
+           x11_stats.frames_captured, x11_stats.frames_duplicate,
+           x11_stats.capture_time_us / x11_stats.frames_captured,
+           x11_stats.convert_time_us / x11_stats.frames_captured);
+  }
+  printf("muxer_close: x11 scheduler late=%lld missed=%lld ticks, "
+         "wake jitter p50=%lldus p95=%lldus p99=%lldus max=%lldus\n",
+         x11_stats.ticks_late, x11_stats.ticks_missed,
+         x11_stats.jitter_p50_us, x11_stats.jitter_p95_us,
+         x11_stats.jitter_p99_us, x11_stats.jitter_max_us);
+  print_queue_stats("x11", &x11_stats.queue);
+  printf("muxer_close: x11 frame pool hits=%lld misses=%lld "
+         "reconfigures=%lld\n",
+         x11_stats.frame_pool.hits, x11_stats.frame_pool.misses,
+         x11_stats.frame_pool.reconfigures);
   x11_free(pthis->x11grab);
 
   file_writer_free(pthis->file_writer);
   
+  uv_cond_destroy(&pthis->wake_cond);
+  uv_mutex_destroy(&pthis->wake_lock);
   free(pthis->outfile_path);
   free(pthis);
   return ret;
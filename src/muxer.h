@@ -1,9 +1,53 @@
 
 struct muxer_s;
 
+#define MUXER_MAX_PULSE_SOURCES 8
+
 struct muxer_config_s {
   const char* outfile_path;
   const char* device_name;
+  // Xvfb -fbdir directory to capture from; NULL captures over MIT-SHM
+  const char* fbdir;
+  // capture one window, by id, or else the first whose title contains
+  // window_name
+  unsigned int window_id;
+  const char* window_name;
+  char use_damage;
+  char hide_cursor;
+  char use_bt709;
+  int convert_threads;
+  // capture rectangle; zero size means the rest of the screen
+  int capture_x;
+  int capture_y;
+  int capture_width;
+  int capture_height;
+  // encoded size; zero means the capture size
+  int output_width;
+  int output_height;
+  // capture rate; zero means the x11 source default
+  int framerate_num;
+  int framerate_den;
+  // When the screen or window changes size, scale into the starting size
+  // (0) or start a new output file at the new size (1).
+  char segment_on_resize;
+  // encode for watching while recording (see FILE_WRITER_PROFILE_LIVE)
+  char live_profile;
+  // H.264 encoder threads (zero means one per CPU), and whether they split
+  // each frame into slices instead of encoding frames in parallel
+  int encoder_threads;
+  char encoder_slice_threads;
+  // skip encoding duplicate frames, but keep one every max_frame_gap seconds
+  char use_vfr;
+  double max_frame_gap;
+  // record through libpulse directly instead of libavdevice
+  char use_native_pulse;
+  // pulse sources to record and mix into the one audio track, and the
+  // gain of each in dB; none records the default source as is
+  const char* pulse_devices[MUXER_MAX_PULSE_SOURCES];
+  double pulse_gains_db[MUXER_MAX_PULSE_SOURCES];
+  int pulse_device_count;
+  // native pulse fragment size in ms; zero keeps the default
+  int pulse_fragment_ms;
 };
 
 // invoke before opening the first muxer.
@@ -11,3 +55,6 @@ void muxer_initialize();
 
 int muxer_open(struct muxer_s** muxer, struct muxer_config_s* config);
 int muxer_close(struct muxer_s* muxer);
+// False once the muxer gave up on its own, e.g. when the output file cannot
+// be opened. Close it all the same.
+char muxer_is_running(struct muxer_s* muxer);
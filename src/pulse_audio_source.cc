@@ -7,18 +7,20 @@
 
 extern "C" {
 #include <assert.h>
+#include <math.h>
+#include <string.h>
 #include <libavformat/avformat.h>
 #include <libavdevice/avdevice.h>
 #include <libavutil/audio_fifo.h>
+#include <pulse/pulseaudio.h>
 #include <uv.h>
 #include "pulse_audio_source.h"
 #include "resampler.h"
-#include "pulse_audio_source.h"
+#include "frame_ring.h"
+#include "media_clock.h"
+#include "frame_pool.h"
 }
 
-#include <queue>
-#include <map>
-
 // Workaround C++ issue with ffmpeg macro
 #ifndef __clang__
 #undef av_err2str
@@ -27,7 +29,16 @@ av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), \
 AV_ERROR_MAX_STRING_SIZE, errnum)
 #endif
 
+// Most out of order frames the avdevice path can put back in order. Pulse
+// only swaps neighbouring packets in practice.
+static const int reorder_capacity = 16;
+
 struct pulse_s {
+  enum pulse_backend backend;
+  const char* device;
+  int fragment_ms;
+
+  /* avdevice backend */
   AVInputFormat* input_format;
   AVFormatContext* format_context;
   AVCodecContext* codec_context;
@@ -35,24 +46,80 @@ struct pulse_s {
   int stream_index;
   AVStream* stream;
   uv_thread_t worker_thread;
-  uv_mutex_t queue_lock;
-  std::queue<AVFrame*> queue;
+  struct frame_ring_s* queue;
+  int queue_capacity;
+  enum frame_ring_overflow overflow_policy;
   char is_interrupted;
   char is_running;
   int64_t initial_timestamp;
   int64_t last_pts_read;
+  // Decoded frames waiting to be released in pts order: a sorted ring of
+  // at most reorder_depth + 1 frames, so a frame that arrives up to
+  // reorder_depth places late still goes out in order.
+  AVFrame* reorder[reorder_capacity];
+  int reorder_head;
+  int reorder_count;
+  int reorder_depth;
+  int64_t last_released_pts;
+  int64_t reorder_events;
+  int64_t reorder_late;
+
+  /* native backend */
+  pa_threaded_mainloop* mainloop;
+  pa_context* context;
+  pa_stream* record_stream;
+
+  /* both: what the device delivers, resampled and rechunked for encoding */
+  enum AVSampleFormat sample_fmt;
+  int sample_rate;
+  int channels;
+  uint64_t channel_layout;
+  enum AVSampleFormat out_sample_fmt;
+  int out_sample_rate;
+  uint64_t out_channel_layout;
+  int out_channels;
+  int out_frame_size;
   struct resampler_s* resampler;
+  // resampled samples waiting to fill an encoder frame
+  AVAudioFifo* sample_fifo;
+  // encoder frames, returned as the writer frees them
+  struct frame_pool_s* frame_pool;
+  // Where device samples land on the timeline, and how the resampler is
+  // being steered to match: output sample n is stamped
+  // out_origin + n / out_sample_rate.
+  struct media_clock_s* clock;
+  int64_t samples_in;
+  int64_t samples_out;
+  int64_t out_origin;
+  int64_t next_steer;
+  int compensation;
+  int64_t clock_resyncs;
 
   void (*on_audio_data)(struct pulse_s* pulse, void* p);
   void* audio_data_cb_p;
-
-  std::map<int64_t, AVFrame*> frame_map;
-  AVAudioFifo* sample_fifo;
-
-  int64_t buffer_pts;
 };
 
 static int min_buffered_frames = 10;
+// what the encoder takes unless the config says otherwise
+static const int default_out_sample_rate = 48000;
+static const int default_out_frame_size = 1024;
+// Output gaps wider than this are jumped, not steered.
+static const int max_steer_error_ms = 50;
+// Start steering once the output is this far off, and stop once it is back
+// within steer_stop_ms. Lip sync tolerates far more than steer_start_ms.
+static const int steer_start_ms = 10;
+static const int steer_stop_ms = 1;
+// Share of the remaining gap closed per second of output.
+static const double steer_gain = 0.1;
+// Compensation never changes the rate by more than 1/this (0.1%, a couple
+// of cents of pitch).
+static const int max_compensation_ratio = 1000;
+// 1024 sample frames: a little over a second at 48kHz
+static const int default_queue_capacity = 64;
+static const int default_fragment_ms = 10;
+// The server buffers up to this many fragments while we are not reading
+// (e.g. the mainloop busy elsewhere) before it starts overwriting.
+static const int native_max_fragments = 32;
 
 static int pulse_worker_read_frame(struct pulse_s* pthis, AVFrame** frame_out) {
   int ret, got_frame = 0;
@@ -88,10 +155,172 @@ static int pulse_worker_read_frame(struct pulse_s* pthis, AVFrame** frame_out) {
   return ret;
 }
 
-static void pulse_worker_main(void* p) {
+// Compares what the resampler has produced with where the samples captured
+// so far sit on the timeline, and steers the output toward it. Once the gap
+// passes steer_start_ms, a compensation is applied each second that cancels
+// the estimated device drift and closes part of the gap, until it is back
+// under steer_stop_ms. In between the resampler runs its plain conversion
+// kernel; compensation needs swresample. A gap too wide to close without an
+// audible pitch change is a discontinuity (lost or repeated capture) and
+// is jumped over instead.
+static void _steer_output(struct pulse_s* pthis) {
+  int64_t captured = media_clock_get_time(pthis->clock, pthis->samples_in);
+  int64_t expected = av_rescale(captured - pthis->out_origin,
+                                pthis->out_sample_rate,
+                                MEDIA_CLOCK_NS_PER_SEC);
+  int64_t produced = pthis->samples_out +
+  av_audio_fifo_size(pthis->sample_fifo) +
+  resampler_get_delay(pthis->resampler);
+  int64_t error = expected - produced;
+  int64_t max_error = pthis->out_sample_rate * max_steer_error_ms / 1000;
+  if (error > max_error) {
+    // timestamps skip the missing stretch
+    pthis->out_origin += av_rescale(error, MEDIA_CLOCK_NS_PER_SEC,
+                                    pthis->out_sample_rate);
+    pthis->clock_resyncs++;
+    printf("pulse_audio_src: %lld samples behind the capture clock, "
+           "skipping ahead\n", error);
+    error = 0;
+  } else if (error < -max_error) {
+    // timestamps never go back; drop what has not been queued yet
+    int drained = FFMIN(-error, av_audio_fifo_size(pthis->sample_fifo));
+    av_audio_fifo_drain(pthis->sample_fifo, drained);
+    pthis->clock_resyncs++;
+    printf("pulse_audio_src: %lld samples ahead of the capture clock, "
+           "dropped %d\n", -error, drained);
+    error += drained;
+  }
+
+  if (pthis->samples_out < pthis->next_steer) {
+    return;
+  }
+  pthis->next_steer = pthis->samples_out + pthis->out_sample_rate;
+  int64_t steer_start = pthis->out_sample_rate * steer_start_ms / 1000;
+  int64_t steer_stop = pthis->out_sample_rate * steer_stop_ms / 1000;
+  if (pthis->compensation ? FFABS(error) <= steer_stop :
+      FFABS(error) <= steer_start)
+  {
+    pthis->compensation = 0;
+    resampler_set_compensation(pthis->resampler, 0, pthis->out_sample_rate);
+    return;
+  }
+  // a device running fast delivers too many samples per second
+  double drift = media_clock_get_drift(pthis->clock);
+  int delta = lrint(-drift * pthis->out_sample_rate + error * steer_gain);
+  int max_delta = pthis->out_sample_rate / max_compensation_ratio;
+  // never zero while steering, which would read as not steering
+  pthis->compensation = av_clip(delta ? delta : (error > 0 ? 1 : -1),
+                                -max_delta, max_delta);
+  resampler_set_compensation(pthis->resampler, pthis->compensation,
+                             pthis->out_sample_rate);
+}
+
+// Resamples captured samples into the fifo and queues them downstream in
+// encoder sized frames. time is the capture time of the first sample on
+// the media clock timeline.
+static void _push_samples(struct pulse_s* pthis, uint8_t** data,
+                          int nb_samples, int64_t time)
+{
   int ret;
   AVFrame* frame;
   AVFrame* resampled_frame;
+  if (media_clock_observe(pthis->clock, pthis->samples_in, time)) {
+    printf("pulse_audio_src: capture clock jumped at sample %lld, "
+           "estimating drift afresh\n", pthis->samples_in);
+  }
+  if (!pthis->samples_in) {
+    pthis->out_origin = media_clock_get_time(pthis->clock, 0);
+  }
+  pthis->samples_in += nb_samples;
+
+  // wrap the device's samples for swresample without copying them
+  frame = av_frame_alloc();
+  frame->nb_samples = nb_samples;
+  frame->format = pthis->sample_fmt;
+  frame->channel_layout = pthis->channel_layout;
+  frame->channels = pthis->channels;
+  frame->sample_rate = pthis->sample_rate;
+  av_samples_fill_arrays(frame->data, frame->linesize, data[0],
+                         pthis->channels, nb_samples, pthis->sample_fmt, 1);
+  if (av_sample_fmt_is_planar(pthis->sample_fmt)) {
+    for (int i = 0; i < pthis->channels; i++) {
+      frame->data[i] = data[i];
+    }
+  }
+  ret = resampler_convert(pthis->resampler, frame, &resampled_frame);
+  av_frame_free(&frame);
+  if (ret) {
+    return;
+  }
+  ret = av_audio_fifo_write(pthis->sample_fifo,
+                            (void**)resampled_frame->data,
+                            resampled_frame->nb_samples);
+  av_frame_free(&resampled_frame);
+  _steer_output(pthis);
+
+  int read_samples = pthis->out_frame_size;
+  while (av_audio_fifo_size(pthis->sample_fifo) >= read_samples) {
+    ret = frame_pool_get_audio(pthis->frame_pool, read_samples,
+                               pthis->out_sample_fmt,
+                               pthis->out_channel_layout, &frame);
+    if (ret) {
+      return;
+    }
+    frame->sample_rate = pthis->out_sample_rate;
+    frame->pts = pthis->out_origin +
+    av_rescale(pthis->samples_out, MEDIA_CLOCK_NS_PER_SEC,
+               pthis->out_sample_rate);
+    pthis->samples_out += read_samples;
+    ret = av_audio_fifo_read(pthis->sample_fifo,
+                             (void**)frame->data,
+                             read_samples);
+
+    ret = frame_ring_push(pthis->queue, frame);
+    if (!ret && pthis->on_audio_data) {
+      pthis->on_audio_data(pthis, pthis->audio_data_cb_p);
+    }
+  }
+}
+
+// Inserts frame into the reorder ring, keeping it sorted by pts.
+static void _reorder_insert(struct pulse_s* pthis, AVFrame* frame) {
+  int i = pthis->reorder_count;
+  while (i > 0) {
+    AVFrame* prev =
+    pthis->reorder[(pthis->reorder_head + i - 1) % reorder_capacity];
+    if (prev->pts <= frame->pts) {
+      break;
+    }
+    pthis->reorder[(pthis->reorder_head + i) % reorder_capacity] = prev;
+    i--;
+  }
+  if (i < pthis->reorder_count) {
+    pthis->reorder_events++;
+  }
+  pthis->reorder[(pthis->reorder_head + i) % reorder_capacity] = frame;
+  pthis->reorder_count++;
+}
+
+static AVFrame* _reorder_pop(struct pulse_s* pthis) {
+  AVFrame* frame = pthis->reorder[pthis->reorder_head];
+  pthis->reorder_head = (pthis->reorder_head + 1) % reorder_capacity;
+  pthis->reorder_count--;
+  pthis->last_released_pts = frame->pts;
+  return frame;
+}
+
+// libavdevice stamps packets with the wall clock time of their first
+// sample, in stream time_base units.
+static void _push_frame(struct pulse_s* pthis, AVFrame* frame) {
+  int64_t wall_us = av_rescale_q(frame->pts, pthis->stream->time_base,
+                                 AV_TIME_BASE_Q);
+  _push_samples(pthis, frame->data, frame->nb_samples,
+                media_clock_from_wall_us(wall_us));
+}
+
+static void pulse_worker_main(void* p) {
+  int ret;
+  AVFrame* frame;
   struct pulse_s* pthis = (struct pulse_s*)p;
   pthis->is_running = 1;
   while (!pthis->is_interrupted) {
@@ -99,101 +328,91 @@ static void pulse_worker_main(void* p) {
     if (ret || !frame) {
       continue;
     }
-    // pulse frames are not always linear; push to a heap and pop once enough
-    // buffers have passed that we are confident we won't see another out of
-    // order insertion later on.
-    pthis->frame_map[frame->pts] = frame;
-
-    if (pthis->frame_map.size() < min_buffered_frames) {
+    // pulse frames are not always linear. The window starts closed, so an
+    // in order stream pays no latency, and widens each time a frame shows
+    // up behind one already released. That frame is too late to sort, and
+    // appending it would put its samples out of time order, so it is
+    // dropped; the capture clock sees the hole and steers over it like any
+    // other gap.
+    if (frame->pts < pthis->last_released_pts) {
+      pthis->reorder_events++;
+      pthis->reorder_late++;
+      if (pthis->reorder_depth < reorder_capacity - 1) {
+        pthis->reorder_depth++;
+        printf("pulse_audio_src: frame %lld arrived after %lld, reorder "
+               "depth now %d\n", frame->pts, pthis->last_released_pts,
+               pthis->reorder_depth);
+      }
+      av_frame_free(&frame);
       continue;
     }
-    frame = pthis->frame_map.begin()->second;
-    pthis->frame_map.erase(frame->pts);
-
-    // Clock will drift if we're relying on pulseaudio to produce the correct
-    // number of samples at the correct timestamps.
-    if (frame->pts > pthis->buffer_pts) {
-      // error adjustement
-      size_t samples_buffered = av_audio_fifo_size(pthis->sample_fifo);
-      AVRational time_base = pthis->stream->time_base;
-      int64_t error = samples_buffered * time_base.den;
-      error /= pthis->codec_context->sample_rate;
-      error *= time_base.num;
-      pthis->buffer_pts = frame->pts - error;
-      // disallow negative pts values.
-      pthis->buffer_pts = MAX(0, pthis->buffer_pts);
-    }
-
-    ret = av_audio_fifo_write(pthis->sample_fifo,
-                        (void**)frame->data,
-                        frame->nb_samples);
-    av_frame_free(&frame);
-
-    int read_samples = 1024; // todo: import from downstream encoder frame_size
-    while (av_audio_fifo_size(pthis->sample_fifo) > read_samples) {
-      frame = av_frame_alloc();
-      frame->nb_samples = read_samples;
-      frame->format = pthis->codec_context->sample_fmt;
-      frame->channel_layout = pthis->codec_context->channel_layout;
-      frame->sample_rate = pthis->codec_context->sample_rate;
-      frame->pts = pthis->buffer_pts;
-      AVRational time_base = pthis->stream->time_base;
-      int64_t frame_length = time_base.den;
-      frame_length *= read_samples;
-      frame_length /= pthis->codec_context->sample_rate;
-      frame_length /= time_base.num;
-      pthis->buffer_pts += frame_length;
-      ret = av_frame_get_buffer(frame, 0);
-      assert(ret == 0);
-      ret = av_audio_fifo_read(pthis->sample_fifo,
-                               (void**)frame->data,
-                               read_samples);
-
-      ret = resampler_convert(pthis->resampler, frame, &resampled_frame);
+    _reorder_insert(pthis, frame);
+    while (pthis->reorder_count > pthis->reorder_depth) {
+      frame = _reorder_pop(pthis);
+      _push_frame(pthis, frame);
       av_frame_free(&frame);
-      if (!ret) {
-        uv_mutex_lock(&pthis->queue_lock);
-        pthis->queue.push(resampled_frame);
-        uv_mutex_unlock(&pthis->queue_lock);
-        if (pthis->on_audio_data) {
-          pthis->on_audio_data(pthis, pthis->audio_data_cb_p);
-        }
-      }
-
     }
-
   }
 }
 
 void pulse_alloc(struct pulse_s** pulse_out) {
   struct pulse_s* pthis = (struct pulse_s*) calloc(1, sizeof(struct pulse_s));
-  uv_mutex_init(&pthis->queue_lock);
-  pthis->queue = std::queue<AVFrame*>();
-  pthis->frame_map = std::map<int64_t, AVFrame*>();
+  pthis->queue_capacity = default_queue_capacity;
+  pthis->overflow_policy = FRAME_RING_BLOCK;
+  pthis->last_released_pts = INT64_MIN;
   pthis->is_interrupted = 0;
+  pthis->device = "default";
+  pthis->fragment_ms = default_fragment_ms;
+  pthis->out_sample_fmt = AV_SAMPLE_FMT_FLTP;
+  pthis->out_sample_rate = default_out_sample_rate;
+  pthis->out_channel_layout = AV_CH_LAYOUT_STEREO;
+  pthis->out_frame_size = default_out_frame_size;
   resampler_alloc(&pthis->resampler);
+  frame_pool_alloc(&pthis->frame_pool);
   *pulse_out = pthis;
 }
 
 void pulse_free(struct pulse_s* pthis) {
-  while (!pthis->queue.empty()) {
-    AVFrame* frame = pthis->queue.front();
-    pthis->queue.pop();
+  frame_ring_free(pthis->queue);
+  while (pthis->reorder_count) {
+    AVFrame* frame = _reorder_pop(pthis);
     av_frame_free(&frame);
   }
-  uv_mutex_destroy(&pthis->queue_lock);
   avcodec_free_context(&pthis->codec_context);
   avformat_close_input(&pthis->format_context);
+  av_audio_fifo_free(pthis->sample_fifo);
+  media_clock_free(pthis->clock);
   resampler_free(pthis->resampler);
+  frame_pool_free(pthis->frame_pool);
   free(pthis);
 }
 
 void pulse_load_config(struct pulse_s* pthis, struct pulse_config_s* config) {
   pthis->on_audio_data = config->on_audio_data;
   pthis->audio_data_cb_p = config->audio_data_cb_p;
+  if (config->queue_capacity) {
+    pthis->queue_capacity = config->queue_capacity;
+    pthis->overflow_policy = config->overflow_policy;
+  }
+  pthis->backend = config->backend;
+  if (config->device) {
+    pthis->device = config->device;
+  }
+  if (config->fragment_ms > 0) {
+    pthis->fragment_ms = config->fragment_ms;
+  }
+  if (config->out_sample_rate > 0) {
+    pthis->out_sample_fmt = config->out_sample_fmt;
+    pthis->out_sample_rate = config->out_sample_rate;
+    pthis->out_channel_layout = config->out_channel_layout;
+    pthis->out_frame_size = config->out_frame_size > 0 ?
+    config->out_frame_size : default_out_frame_size;
+  }
+  pthis->out_channels =
+  av_get_channel_layout_nb_channels(pthis->out_channel_layout);
 }
 
-int pulse_start(struct pulse_s* pthis) {
+static int _avdevice_open(struct pulse_s* pthis) {
   int ret;
   pthis->input_format = av_find_input_format("pulse");
   if (!pthis->input_format) {
@@ -201,14 +420,16 @@ int pulse_start(struct pulse_s* pthis) {
     return -1;
   }
   // if developing on OSX: you'll need to find the right interface to capture
-  // meaningful audio. use `pactl list sources` and put the interface number
-  // in that corresponds to your mic or loopback device. just please don't
-  // commit that change :-)
-  // const char* input_device = "6";
-  const char* input_device = "default";
-
-  ret = avformat_open_input(&pthis->format_context, input_device,
-                            pthis->input_format, NULL);
+  // meaningful audio. use `pactl list sources` and pass the interface number
+  // that corresponds to your mic or loopback device as the device.
+  // ask the server for the encoder's rate and channels up front, so the
+  // resampler only has to change the sample format
+  AVDictionary* options = NULL;
+  av_dict_set_int(&options, "sample_rate", pthis->out_sample_rate, 0);
+  av_dict_set_int(&options, "channels", pthis->out_channels, 0);
+  ret = avformat_open_input(&pthis->format_context, pthis->device,
+                            pthis->input_format, &options);
+  av_dict_free(&options);
   if (ret) {
     printf("failed to open input %s\n", pthis->input_format->name);
     return ret;
@@ -251,10 +472,9 @@ int pulse_start(struct pulse_s* pthis) {
 
   assert(pthis->codec->sample_fmts[0] == AV_SAMPLE_FMT_S16);
   pthis->codec_context->request_sample_fmt = pthis->codec->sample_fmts[0];
-  // TODO: There's no reason we shouldn't support stereo audio here
-  pthis->codec_context->channels = 2;
-  pthis->codec_context->request_channel_layout = AV_CH_LAYOUT_STEREO;
-  pthis->codec_context->channel_layout = AV_CH_LAYOUT_STEREO;
+  pthis->codec_context->channels = pthis->out_channels;
+  pthis->codec_context->request_channel_layout = pthis->out_channel_layout;
+  pthis->codec_context->channel_layout = pthis->out_channel_layout;
 
   /* init the decoder */
   ret = avcodec_open2(pthis->codec_context, pthis->codec, NULL);
@@ -262,33 +482,269 @@ int pulse_start(struct pulse_s* pthis) {
     av_log(NULL, AV_LOG_ERROR, "Cannot open audio decoder\n");
   }
 
-  // reorder samples in a fifo by holding on to nonlinear frames as they are
-  // read from the device.
+  pthis->sample_fmt = pthis->codec_context->sample_fmt;
+  pthis->sample_rate = pthis->codec_context->sample_rate;
+  pthis->channels = pthis->codec_context->channels;
+  pthis->channel_layout = pthis->codec_context->channel_layout;
+  return 0;
+}
+
+// Wakes pulse_start waiting for the context or stream to settle.
+static void _native_state_cb(void* p) {
+  struct pulse_s* pthis = (struct pulse_s*)p;
+  pa_threaded_mainloop_signal(pthis->mainloop, 0);
+}
+
+static void _native_context_state_cb(pa_context* context, void* p) {
+  _native_state_cb(p);
+}
+
+static void _native_stream_state_cb(pa_stream* stream, void* p) {
+  _native_state_cb(p);
+}
+
+// Capture time of the data about to be read, on the media clock timeline:
+// now, less the record latency, which is how long ago the source captured
+// the sample at the read position. Each read is stamped afresh rather than
+// counted forward from the stream clock, which runs at the nominal rate
+// and so would hide the device's drift. The media clock smooths out the
+// scheduling noise.
+static int64_t _native_read_pts(struct pulse_s* pthis) {
+  int64_t now = media_clock_now();
+  pa_usec_t latency;
+  int negative = 0;
+  if (pa_stream_get_latency(pthis->record_stream, &latency, &negative) < 0) {
+    // no timing info yet; the data has only just arrived
+    return now;
+  }
+  return now - (negative ? -(int64_t)latency : (int64_t)latency) * 1000;
+}
+
+// Runs on the mainloop thread whenever at least a fragment is ready. It must
+// never wait: every other callback, stop included, queues up behind it.
+// That is why pulse_start gives the native queue a dropping policy.
+static void _native_read_cb(pa_stream* stream, size_t nbytes, void* p) {
+  struct pulse_s* pthis = (struct pulse_s*)p;
+  int frame_size = pthis->channels * av_get_bytes_per_sample(pthis->sample_fmt);
+  while (!pthis->is_interrupted && pa_stream_readable_size(stream) > 0) {
+    const void* data = NULL;
+    size_t length = 0;
+    if (pa_stream_peek(stream, &data, &length) < 0) {
+      printf("pulse_audio_src: pa_stream_peek failed: %s\n",
+             pa_strerror(pa_context_errno(pthis->context)));
+      return;
+    }
+    if (!length) {
+      break;
+    }
+    // a hole (data == NULL) is skipped; the next chunk's pts re-anchors
+    if (data) {
+      int64_t pts = _native_read_pts(pthis);
+      uint8_t* planes[1] = { (uint8_t*)data };
+      _push_samples(pthis, planes, length / frame_size, pts);
+    }
+    pa_stream_drop(stream);
+  }
+}
+
+// Waits, with the mainloop locked, for the context and stream to leave
+// their connecting states.
+static int _native_wait_ready(struct pulse_s* pthis) {
+  while (1) {
+    pa_context_state_t context_state = pa_context_get_state(pthis->context);
+    if (!PA_CONTEXT_IS_GOOD(context_state)) {
+      return AVERROR(EIO);
+    }
+    if (context_state == PA_CONTEXT_READY) {
+      if (!pthis->record_stream) {
+        return 0;
+      }
+      pa_stream_state_t stream_state =
+      pa_stream_get_state(pthis->record_stream);
+      if (!PA_STREAM_IS_GOOD(stream_state)) {
+        return AVERROR(EIO);
+      }
+      if (stream_state == PA_STREAM_READY) {
+        return 0;
+      }
+    }
+    pa_threaded_mainloop_wait(pthis->mainloop);
+  }
+}
+
+static void _native_stop(struct pulse_s* pthis);
+
+// Undoes a _native_start that failed with the mainloop locked.
+static int _native_start_failed(struct pulse_s* pthis, int ret) {
+  // _native_stop takes the lock itself
+  pa_threaded_mainloop_unlock(pthis->mainloop);
+  _native_stop(pthis);
+  return ret;
+}
+
+static int _native_start(struct pulse_s* pthis) {
+  int ret;
+  pthis->mainloop = pa_threaded_mainloop_new();
+  if (!pthis->mainloop) {
+    return AVERROR(ENOMEM);
+  }
+  pthis->context =
+  pa_context_new(pa_threaded_mainloop_get_api(pthis->mainloop),
+                 "x11pulsemux");
+  if (!pthis->context) {
+    _native_stop(pthis);
+    return AVERROR(ENOMEM);
+  }
+  pa_context_set_state_callback(pthis->context, _native_context_state_cb,
+                                pthis);
+  pa_threaded_mainloop_lock(pthis->mainloop);
+  if (pa_context_connect(pthis->context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0 ||
+      pa_threaded_mainloop_start(pthis->mainloop) < 0 ||
+      _native_wait_ready(pthis))
+  {
+    printf("pulse_start: cannot connect to the server: %s\n",
+           pa_strerror(pa_context_errno(pthis->context)));
+    return _native_start_failed(pthis, AVERROR(EIO));
+  }
+
+  pa_sample_spec spec;
+  spec.format = PA_SAMPLE_S16LE;
+  spec.rate = pthis->sample_rate;
+  spec.channels = pthis->channels;
+  pthis->record_stream = pa_stream_new(pthis->context, "capture", &spec,
+                                       NULL);
+  if (!pthis->record_stream) {
+    return _native_start_failed(pthis, AVERROR(ENOMEM));
+  }
+  pa_stream_set_state_callback(pthis->record_stream, _native_stream_state_cb,
+                               pthis);
+  pa_stream_set_read_callback(pthis->record_stream, _native_read_cb, pthis);
+
+  // The server hands over each fragment as soon as it fills, and with
+  // ADJUST_LATENCY sizes the source's own buffering to match, so a
+  // fragment is roughly our whole capture latency.
+  pa_buffer_attr attr;
+  attr.fragsize = pa_usec_to_bytes(pthis->fragment_ms * PA_USEC_PER_MSEC,
+                                   &spec);
+  attr.maxlength = attr.fragsize * native_max_fragments;
+  attr.tlength = (uint32_t)-1;
+  attr.prebuf = (uint32_t)-1;
+  attr.minreq = (uint32_t)-1;
+  const char* device = strcmp(pthis->device, "default") ? pthis->device : NULL;
+  ret = pa_stream_connect_record(pthis->record_stream, device, &attr,
+                                 (pa_stream_flags_t)
+                                 (PA_STREAM_ADJUST_LATENCY |
+                                  PA_STREAM_INTERPOLATE_TIMING |
+                                  PA_STREAM_AUTO_TIMING_UPDATE));
+  if (ret < 0 || _native_wait_ready(pthis)) {
+    printf("pulse_start: cannot record from %s: %s\n", pthis->device,
+           pa_strerror(pa_context_errno(pthis->context)));
+    return _native_start_failed(pthis, AVERROR(EIO));
+  }
+  const pa_buffer_attr* actual =
+  pa_stream_get_buffer_attr(pthis->record_stream);
+  printf("pulse_start: recording %s natively, fragsize=%u maxlength=%u "
+         "(%lluus per fragment)\n", pthis->device, actual->fragsize,
+         actual->maxlength,
+         (unsigned long long)pa_bytes_to_usec(actual->fragsize, &spec));
+  pthis->is_running = 1;
+  pa_threaded_mainloop_unlock(pthis->mainloop);
+  return 0;
+}
+
+static void _native_stop(struct pulse_s* pthis) {
+  if (!pthis->mainloop) {
+    return;
+  }
+  // Callbacks run under the lock, so once we hold it none is in flight.
+  pa_threaded_mainloop_lock(pthis->mainloop);
+  if (pthis->record_stream) {
+    pa_stream_disconnect(pthis->record_stream);
+    pa_stream_unref(pthis->record_stream);
+    pthis->record_stream = NULL;
+  }
+  if (pthis->context) {
+    pa_context_disconnect(pthis->context);
+    pa_context_unref(pthis->context);
+    pthis->context = NULL;
+  }
+  pa_threaded_mainloop_unlock(pthis->mainloop);
+  pa_threaded_mainloop_stop(pthis->mainloop);
+  pa_threaded_mainloop_free(pthis->mainloop);
+  pthis->mainloop = NULL;
+}
+
+int pulse_start(struct pulse_s* pthis) {
+  int ret;
+  if (pthis->backend == PULSE_BACKEND_NATIVE) {
+    pthis->sample_fmt = AV_SAMPLE_FMT_S16;
+    // the server converts rate and channels for free on its side
+    pthis->sample_rate = pthis->out_sample_rate;
+    pthis->channels = pthis->out_channels;
+    pthis->channel_layout = pthis->out_channel_layout;
+  } else {
+    ret = _avdevice_open(pthis);
+    if (ret) {
+      return ret;
+    }
+  }
+
   pthis->sample_fifo =
-  av_audio_fifo_alloc(pthis->codec_context->sample_fmt,
-                      pthis->codec_context->channels,
-                      pthis->codec_context->sample_rate * min_buffered_frames);
+  av_audio_fifo_alloc(pthis->out_sample_fmt, pthis->out_channels,
+                      pthis->out_sample_rate * min_buffered_frames);
+  ret = media_clock_alloc(&pthis->clock, pthis->sample_rate);
+  if (ret) {
+    return AVERROR(ret);
+  }
 
   struct resampler_config_s config;
-  config.channel_layout_in = pthis->codec_context->channel_layout;
-  config.channel_layout_in = AV_CH_LAYOUT_STEREO;
-  config.channel_layout_out = AV_CH_LAYOUT_STEREO;
-  config.format_in = pthis->codec_context->sample_fmt;
-  config.format_out = AV_SAMPLE_FMT_FLTP;
-  config.sample_rate_in = pthis->codec_context->sample_rate;
-  config.sample_rate_out = 48000;
-  config.nb_channels_in = pthis->codec_context->channels;
-  config.nb_channels_out = 2;
+  config.channel_layout_in = pthis->channel_layout;
+  config.channel_layout_out = pthis->out_channel_layout;
+  config.format_in = pthis->sample_fmt;
+  config.format_out = pthis->out_sample_fmt;
+  config.sample_rate_in = pthis->sample_rate;
+  config.sample_rate_out = pthis->out_sample_rate;
+  config.nb_channels_in = pthis->channels;
+  config.nb_channels_out = pthis->out_channels;
+  config.compensate = 1;
   resampler_load_config(pthis->resampler, &config);
 
+  enum frame_ring_overflow policy = pthis->overflow_policy;
+  if (pthis->backend == PULSE_BACKEND_NATIVE &&
+      policy == FRAME_RING_BLOCK)
+  {
+    // the read callback cannot wait on the mainloop thread; a full queue
+    // drops the frame instead, counted in the queue stats
+    printf("pulse_start: native capture cannot block, dropping the newest "
+           "frame when the queue is full\n");
+    policy = FRAME_RING_DROP_NEWEST;
+  }
+  ret = frame_ring_alloc(&pthis->queue, pthis->queue_capacity, policy);
+  if (ret) {
+    return AVERROR(ret);
+  }
+
+  if (pthis->backend == PULSE_BACKEND_NATIVE) {
+    return _native_start(pthis);
+  }
   uv_thread_create(&pthis->worker_thread, pulse_worker_main, pthis);
 
   return ret;
 }
 
 int pulse_stop(struct pulse_s* pthis) {
+  int ret = 0;
+  if (!pthis->queue) {
+    // never started
+    return 0;
+  }
   pthis->is_interrupted = 1;
-  int ret = uv_thread_join(&pthis->worker_thread);
+  frame_ring_abort(pthis->queue);
+  if (pthis->backend == PULSE_BACKEND_NATIVE) {
+    _native_stop(pthis);
+  } else {
+    ret = uv_thread_join(&pthis->worker_thread);
+  }
   pthis->is_running = 0;
   return ret;
 }
@@ -298,46 +754,41 @@ char pulse_is_running(struct pulse_s* pthis) {
 }
 
 char pulse_has_next(struct pulse_s* pthis) {
-  char ret = 0;
-  uv_mutex_lock(&pthis->queue_lock);
-  ret = pthis->queue.size() > 0;
-  uv_mutex_unlock(&pthis->queue_lock);
-  return ret;
+  return pthis->queue && frame_ring_has_next(pthis->queue);
 }
 
 int pulse_get_next(struct pulse_s* pthis, AVFrame** frame_out) {
-  AVFrame* frame = NULL;
-  int ret;
-  uv_mutex_lock(&pthis->queue_lock);
-  if (pthis->queue.empty()) {
-    ret = EAGAIN;
-  } else {
-    frame = pthis->queue.front();
-    pthis->queue.pop();
-    ret = 0;
+  int ret = frame_ring_pop(pthis->queue, frame_out);
+  if (!ret) {
+    printf("pulse_audio_src: pop frame pts=%lld\n", (*frame_out)->pts);
   }
-  uv_mutex_unlock(&pthis->queue_lock);
-  *frame_out = frame;
-  printf("pulse_audio_src: pop frame pts=%lld\n", frame->pts);
   return ret;
 }
 
 int64_t pulse_get_head_ts(struct pulse_s* pthis) {
   int64_t ret;
-  uv_mutex_lock(&pthis->queue_lock);
-  if (pthis->queue.empty()) {
+  if (!pthis->queue || frame_ring_peek_pts(pthis->queue, &ret)) {
     ret = EAGAIN;
-  } else {
-    AVFrame* frame = pthis->queue.front();
-    ret = frame->pts;
   }
-  uv_mutex_unlock(&pthis->queue_lock);
   return ret;
 }
 
+void pulse_get_stats(struct pulse_s* pthis, struct pulse_stats_s* stats_out) {
+  memset(stats_out, 0, sizeof(struct pulse_stats_s));
+  if (pthis->queue) {
+    frame_ring_get_stats(pthis->queue, &stats_out->queue);
+  }
+  stats_out->reorder_events = pthis->reorder_events;
+  stats_out->reorder_late = pthis->reorder_late;
+  stats_out->reorder_depth = pthis->reorder_depth;
+  if (pthis->clock) {
+    stats_out->drift_ppm = media_clock_get_drift(pthis->clock) * 1e6;
+    stats_out->clock_resets = media_clock_get_resets(pthis->clock);
+  }
+  stats_out->compensation = pthis->compensation;
+  stats_out->clock_resyncs = pthis->clock_resyncs;
+}
+
 double pulse_convert_frame_pts(struct pulse_s* pthis, int64_t from_pts) {
-  AVRational time_base = pthis->stream->time_base;
-  double pts = from_pts * time_base.num;
-  pts /= (double)time_base.den;
-  return pts;
+  return media_clock_to_seconds(from_pts);
 }
@@ -9,29 +9,77 @@
 #define pulse_audio_source_h
 
 #include <libavutil/frame.h>
+#include "frame_ring.h"
 
 /**
  * An audio stream source from pulse audio.
  */
 struct pulse_s;
 
+enum pulse_backend {
+  // libavdevice's pulse input, read on a worker thread
+  PULSE_BACKEND_AVDEVICE,
+  // libpulse's threaded mainloop; samples are pushed from its read callback
+  // as each fragment fills
+  PULSE_BACKEND_NATIVE,
+};
+
 struct pulse_config_s {
-  // notify when new data hits the queue
+  // notify when new data hits the queue; called on the capture thread (or
+  // libpulse's mainloop thread)
   void (*on_audio_data)(struct pulse_s* pulse, void* p);
   void* audio_data_cb_p;
+  // Frames waiting for the muxer. 0 keeps the default capacity and policy.
+  int queue_capacity;
+  enum frame_ring_overflow overflow_policy;
+  enum pulse_backend backend;
+  // source name; NULL records the server's default source
+  const char* device;
+  // native backend: how much audio the server collects before handing it
+  // over. 0 keeps the default (10ms).
+  int fragment_ms;
+  // What the encoder takes: frames of out_frame_size samples in this
+  // format. Capture is requested at this rate and layout where the
+  // backend allows. A zero out_sample_rate keeps the default (FLTP, 48kHz,
+  // stereo, 1024 samples).
+  enum AVSampleFormat out_sample_fmt;
+  int out_sample_rate;
+  uint64_t out_channel_layout;
+  int out_frame_size;
+};
+
+struct pulse_stats_s {
+  struct frame_ring_stats_s queue;
+  // avdevice backend: frames that arrived out of pts order, how many of
+  // those came too late to be put back in order and were dropped, and the
+  // reorder window depth they have grown it to
+  int64_t reorder_events;
+  int64_t reorder_late;
+  int reorder_depth;
+  // estimated device clock error against the timeline, the last
+  // compensation applied (output samples per second, 0 while not
+  // steering), how often the estimate started over and how often the
+  // output jumped a gap
+  double drift_ppm;
+  int compensation;
+  int64_t clock_resets;
+  int64_t clock_resyncs;
 };
 
 void pulse_alloc(struct pulse_s** pulse_out);
 void pulse_free(struct pulse_s* pulse);
 void pulse_load_config(struct pulse_s* pulse, struct pulse_config_s* config);
 
+// Call pulse_load_config first; the output format is fixed from then on.
 int pulse_start(struct pulse_s* pulse);
 int pulse_stop(struct pulse_s* pulse);
 char pulse_is_running(struct pulse_s* pulse);
 
 char pulse_has_next(struct pulse_s* pulse);
 int pulse_get_next(struct pulse_s* pulse, AVFrame** frame_out);
+// Frame pts are on the media clock timeline (ns).
 int64_t pulse_get_head_ts(struct pulse_s* pthis);
 double pulse_convert_pts(struct pulse_s* pulse, int64_t from_pts);
+void pulse_get_stats(struct pulse_s* pulse, struct pulse_stats_s* stats_out);
 
 #endif /* pulse_audio_source_h */
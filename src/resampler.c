@@ -8,6 +8,13 @@
 #include "resampler.h"
 #include <libswresample/swresample.h>
 #include <libavutil/opt.h>
+#include "cpu_features.h"
+#include "frame_pool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RESAMPLER_X86 1
+#include <immintrin.h>
+#endif
 
 // Workaround C++ issue with ffmpeg macro
 #ifndef __clang__
@@ -20,17 +27,107 @@ AV_ERROR_MAX_STRING_SIZE, errnum)
 struct resampler_s {
   struct SwrContext* swr_ctx;
   struct resampler_config_s config;
+  struct frame_pool_s* pool;
+  // samples went through swresample since it was last (re)initialized
+  char swr_active;
+  char compensating;
+};
+
+/*
+ * Capture hands us interleaved S16 stereo and AAC wants planar float at the
+ * same rate, so most of the time conversion is just a deinterleave and a
+ * scale by 1/32768. That is exact in float, so every kernel matches
+ * swresample bit for bit; bench/resampler_bench.c checks that and times
+ * them against it.
+ */
+static resampler_s16_to_fltp_fn s16_to_fltp;
+
+static void _s16_to_fltp_c(const int16_t* in, float* left, float* right,
+                           int nb_samples)
+{
+  for (int i = 0; i < nb_samples; i++) {
+    left[i] = in[i * 2] * (1.0f / 32768);
+    right[i] = in[i * 2 + 1] * (1.0f / 32768);
+  }
+}
+
+#ifdef RESAMPLER_X86
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+// Each 32 bit lane holds one L/R pair: shifting left then arithmetic right
+// by 16 sign extends L, arithmetic right alone sign extends R.
+static SSE2 void _s16_to_fltp_sse2(const int16_t* in, float* left,
+                                   float* right, int nb_samples)
+{
+  const __m128 scale = _mm_set1_ps(1.0f / 32768);
+  int i = 0;
+  for (; i + 4 <= nb_samples; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + i * 2));
+    __m128i l = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+    __m128i r = _mm_srai_epi32(v, 16);
+    _mm_storeu_ps(left + i, _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+    _mm_storeu_ps(right + i, _mm_mul_ps(_mm_cvtepi32_ps(r), scale));
+  }
+  _s16_to_fltp_c(in + i * 2, left + i, right + i, nb_samples - i);
+}
+
+static AVX2 void _s16_to_fltp_avx2(const int16_t* in, float* left,
+                                   float* right, int nb_samples)
+{
+  const __m256 scale = _mm256_set1_ps(1.0f / 32768);
+  int i = 0;
+  for (; i + 16 <= nb_samples; i += 16) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)(in + i * 2));
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(in + i * 2 + 16));
+    __m256i l0 = _mm256_srai_epi32(_mm256_slli_epi32(v0, 16), 16);
+    __m256i l1 = _mm256_srai_epi32(_mm256_slli_epi32(v1, 16), 16);
+    __m256i r0 = _mm256_srai_epi32(v0, 16);
+    __m256i r1 = _mm256_srai_epi32(v1, 16);
+    _mm256_storeu_ps(left + i, _mm256_mul_ps(_mm256_cvtepi32_ps(l0), scale));
+    _mm256_storeu_ps(left + i + 8,
+                     _mm256_mul_ps(_mm256_cvtepi32_ps(l1), scale));
+    _mm256_storeu_ps(right + i, _mm256_mul_ps(_mm256_cvtepi32_ps(r0), scale));
+    _mm256_storeu_ps(right + i + 8,
+                     _mm256_mul_ps(_mm256_cvtepi32_ps(r1), scale));
+  }
+  _s16_to_fltp_sse2(in + i * 2, left + i, right + i, nb_samples - i);
+}
+#endif
+
+static const struct resampler_kernel_s kernels[] = {
+#ifdef RESAMPLER_X86
+  { "avx2", CPU_FEATURE_AVX2, _s16_to_fltp_avx2 },
+  { "sse2", CPU_FEATURE_SSE2, _s16_to_fltp_sse2 },
+#endif
+  { "c", 0, _s16_to_fltp_c },
 };
 
+const struct resampler_kernel_s* resampler_get_kernels(int* count_out) {
+  *count_out = sizeof(kernels) / sizeof(kernels[0]);
+  return kernels;
+}
+
+void resampler_init(void) {
+  int i = 0;
+  while (!cpu_features_has(kernels[i].cpu_features)) {
+    i++;
+  }
+  s16_to_fltp = kernels[i].fn;
+  printf("resampler: using %s s16 -> fltp kernel\n", kernels[i].name);
+}
+
 void resampler_alloc(struct resampler_s** resampler_out) {
   struct resampler_s* pthis = (struct resampler_s*)
   calloc(1, sizeof(struct resampler_s));
   pthis->swr_ctx = swr_alloc();
+  frame_pool_alloc(&pthis->pool);
   *resampler_out = pthis;
 }
 
 void resampler_free(struct resampler_s* pthis) {
   swr_free(&pthis->swr_ctx);
+  frame_pool_free(pthis->pool);
   free(pthis);
 }
 
@@ -70,6 +167,12 @@ int resampler_load_config(struct resampler_s* pthis,
   if (ret) {
     printf("osf: %s\n", av_err2str(ret));
   }
+  if (config->compensate) {
+    ret = av_opt_set_int(pthis->swr_ctx, "flags", SWR_FLAG_RESAMPLE, 0);
+    if (ret) {
+      printf("flags: %s\n", av_err2str(ret));
+    }
+  }
 
   /* initialize the resampling context */
   ret = swr_init(pthis->swr_ctx);
@@ -81,31 +184,87 @@ int resampler_load_config(struct resampler_s* pthis,
   return ret;
 }
 
+// Equal rates and layouts, S16 stereo in, FLTP out, and no compensation
+// asking swresample to stretch the stream.
+static char _can_convert_direct(struct resampler_s* pthis, AVFrame* frame_in)
+{
+  struct resampler_config_s* config = &pthis->config;
+  return s16_to_fltp && !pthis->compensating &&
+  frame_in->format == AV_SAMPLE_FMT_S16 &&
+  config->format_in == AV_SAMPLE_FMT_S16 &&
+  config->format_out == AV_SAMPLE_FMT_FLTP &&
+  config->sample_rate_in == config->sample_rate_out &&
+  config->nb_channels_in == 2 && config->nb_channels_out == 2;
+}
+
 int resampler_convert(struct resampler_s* pthis, AVFrame* frame_in,
                       AVFrame** frame_out)
 {
-  AVFrame* output = av_frame_alloc();
-  output->format = pthis->config.format_out;
-  output->channel_layout = pthis->config.channel_layout_out;
-  output->channels = pthis->config.nb_channels_out;
-  output->nb_samples = frame_in->nb_samples;
-  output->sample_rate = pthis->config.sample_rate_out;
-  output->pts = swr_next_pts(pthis->swr_ctx, frame_in->pts);
-  int ret = av_frame_get_buffer(output, 0);
+  int ret;
+  AVFrame* output = NULL;
+  char direct = _can_convert_direct(pthis, frame_in);
+  // room for a rate change and any compensation, or for what swresample
+  // still holds plus the direct conversion
+  int capacity = direct ?
+  swr_get_out_samples(pthis->swr_ctx, 0) + frame_in->nb_samples :
+  swr_get_out_samples(pthis->swr_ctx, frame_in->nb_samples);
+  *frame_out = NULL;
+  ret = frame_pool_get_audio(pthis->pool, FFMAX(capacity, 1),
+                             pthis->config.format_out,
+                             pthis->config.channel_layout_out, &output);
   if (ret) {
     printf("resmpler: Cannot get output buffer\n");
+    return ret;
+  }
+  output->sample_rate = pthis->config.sample_rate_out;
+
+  if (direct) {
+    int flushed = 0;
+    if (pthis->swr_active) {
+      // Handing over from swresample (compensation just ended): drain what
+      // its filter still holds so no samples are lost, then start it afresh
+      // for the next time it is needed.
+      flushed = swr_convert(pthis->swr_ctx, output->extended_data, capacity,
+                            NULL, 0);
+      flushed = FFMAX(flushed, 0);
+      swr_init(pthis->swr_ctx);
+      pthis->swr_active = 0;
+    }
+    output->pts = frame_in->pts;
+    s16_to_fltp((const int16_t*)frame_in->data[0],
+                (float*)output->data[0] + flushed,
+                (float*)output->data[1] + flushed, frame_in->nb_samples);
+    output->nb_samples = flushed + frame_in->nb_samples;
+    *frame_out = output;
+    return 0;
   }
-  ret = swr_config_frame(pthis->swr_ctx, output, frame_in);
-//  if (ret) {
-//    printf("resampler: reconfig %s\n", av_err2str(ret));
-//  }
+
+  output->pts = swr_next_pts(pthis->swr_ctx, frame_in->pts);
+  pthis->swr_active = 1;
   ret = swr_convert_frame(pthis->swr_ctx, output, frame_in);
   if (!ret) {
     *frame_out = output;
   } else {
     printf("resampler: %s\n", av_err2str(ret));
-    *frame_out = NULL;
     av_frame_free(&output);
   }
   return ret;
 }
+
+int resampler_set_compensation(struct resampler_s* pthis,
+                               int sample_delta, int distance)
+{
+  if (!sample_delta && !pthis->compensating) {
+    return 0;
+  }
+  pthis->compensating = sample_delta != 0;
+  int ret = swr_set_compensation(pthis->swr_ctx, sample_delta, distance);
+  if (ret) {
+    printf("resampler: compensation %s\n", av_err2str(ret));
+  }
+  return ret;
+}
+
+int64_t resampler_get_delay(struct resampler_s* pthis) {
+  return swr_get_delay(pthis->swr_ctx, pthis->config.sample_rate_out);
+}
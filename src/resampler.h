@@ -10,6 +10,11 @@
 
 #include <libavformat/avformat.h>
 
+/**
+ * Converts captured audio to the encoder's format. Same rate S16 stereo to
+ * FLTP, the usual case, runs a SIMD kernel; anything else, and any stretch
+ * of compensation, goes through swresample. Output frames come from a pool.
+ */
 struct resampler_s;
 struct resampler_config_s {
   enum AVSampleFormat format_in;
@@ -20,13 +25,37 @@ struct resampler_config_s {
   int nb_channels_out;
   uint64_t channel_layout_in;
   uint64_t channel_layout_out;
+  // keep swresample's resampler in the path even at equal rates, so
+  // resampler_set_compensation can stretch the output
+  char compensate;
 };
 
+typedef void (*resampler_s16_to_fltp_fn)(const int16_t* in, float* left,
+                                         float* right, int nb_samples);
+struct resampler_kernel_s {
+  const char* name;
+  // enum cpu_feature mask the kernel needs
+  int cpu_features;
+  resampler_s16_to_fltp_fn fn;
+};
+
+// Picks the widest S16 -> FLTP kernel this CPU supports and logs it. Call
+// once before converting.
+void resampler_init(void);
+// Every kernel in this build, widest first, ending with the portable C one.
+const struct resampler_kernel_s* resampler_get_kernels(int* count_out);
+
 void resampler_alloc(struct resampler_s** resampler_out);
 void resampler_free(struct resampler_s* resmapler);
 int resampler_load_config(struct resampler_s* resampler,
                           struct resampler_config_s* config);
 int resampler_convert(struct resampler_s* resampler, AVFrame* frame_in,
                       AVFrame** frame_out);
+// Spreads sample_delta extra (or, negative, fewer) output samples evenly
+// over the next distance output samples.
+int resampler_set_compensation(struct resampler_s* resampler,
+                               int sample_delta, int distance);
+// Output samples' worth of input held inside swresample.
+int64_t resampler_get_delay(struct resampler_s* resampler);
 
 #endif /* resampler_h */
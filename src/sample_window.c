@@ -0,0 +1,80 @@
+//
+//  sample_window.c
+//  x11pulsemux
+//
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sample_window.h"
+
+struct sample_window_s {
+  int64_t* samples;
+  int64_t* scratch;
+  int capacity;
+  int count;
+  int next;
+};
+
+int sample_window_alloc(struct sample_window_s** window_out, int capacity) {
+  if (capacity < 1) {
+    return EINVAL;
+  }
+  struct sample_window_s* pthis = (struct sample_window_s*)
+  calloc(1, sizeof(struct sample_window_s));
+  pthis->samples = (int64_t*)calloc(capacity, sizeof(int64_t));
+  pthis->scratch = (int64_t*)calloc(capacity, sizeof(int64_t));
+  pthis->capacity = capacity;
+  *window_out = pthis;
+  return 0;
+}
+
+void sample_window_free(struct sample_window_s* pthis) {
+  if (!pthis) {
+    return;
+  }
+  free(pthis->samples);
+  free(pthis->scratch);
+  free(pthis);
+}
+
+void sample_window_add(struct sample_window_s* pthis, int64_t sample) {
+  pthis->samples[pthis->next] = sample;
+  pthis->next = (pthis->next + 1) % pthis->capacity;
+  if (pthis->count < pthis->capacity) {
+    pthis->count++;
+  }
+}
+
+void sample_window_reset(struct sample_window_s* pthis) {
+  pthis->count = 0;
+  pthis->next = 0;
+}
+
+int sample_window_get_count(struct sample_window_s* pthis) {
+  return pthis->count;
+}
+
+static int _compare(const void* a, const void* b) {
+  int64_t x = *(const int64_t*)a;
+  int64_t y = *(const int64_t*)b;
+  return (x > y) - (x < y);
+}
+
+int64_t sample_window_get_percentile(struct sample_window_s* pthis,
+                                     double p)
+{
+  if (!pthis->count) {
+    return 0;
+  }
+  memcpy(pthis->scratch, pthis->samples, pthis->count * sizeof(int64_t));
+  qsort(pthis->scratch, pthis->count, sizeof(int64_t), _compare);
+  int rank = (int)(p / 100.0 * pthis->count + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  if (rank > pthis->count) {
+    rank = pthis->count;
+  }
+  return pthis->scratch[rank - 1];
+}
@@ -0,0 +1,30 @@
+//
+//  sample_window.h
+//  x11pulsemux
+//
+
+#ifndef sample_window_h
+#define sample_window_h
+
+#include <stdint.h>
+
+/**
+ * Keeps the most recent N samples of some measurement (a latency, a timing
+ * error) and answers percentile queries over them. Not synchronized; guard
+ * it with whatever lock protects the rest of the caller's stats.
+ */
+struct sample_window_s;
+
+int sample_window_alloc(struct sample_window_s** window_out, int capacity);
+void sample_window_free(struct sample_window_s* window);
+
+void sample_window_add(struct sample_window_s* window, int64_t sample);
+void sample_window_reset(struct sample_window_s* window);
+int sample_window_get_count(struct sample_window_s* window);
+
+// Nearest rank percentile, p in [0, 100]. Returns 0 for an empty window.
+// Sorts a copy of the window, so keep it off hot paths.
+int64_t sample_window_get_percentile(struct sample_window_s* window,
+                                     double p);
+
+#endif /* sample_window_h */
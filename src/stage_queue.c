@@ -0,0 +1,163 @@
+//
+//  stage_queue.c
+//  x11pulsemux
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include "stage_queue.h"
+
+struct stage_queue_s {
+  uint8_t* items;
+  int item_size;
+  int capacity;
+  int head;
+  int count;
+  // the consumer holds an item it popped
+  char busy;
+  char closed;
+  uv_mutex_t lock;
+  uv_cond_t not_full;
+  uv_cond_t not_empty;
+  uv_cond_t idle;
+  struct stage_queue_stats_s stats;
+};
+
+int stage_queue_alloc(struct stage_queue_s** queue_out, int capacity,
+                      int item_size)
+{
+  if (capacity < 1 || item_size < 1) {
+    return EINVAL;
+  }
+  struct stage_queue_s* pthis = (struct stage_queue_s*)
+  calloc(1, sizeof(struct stage_queue_s));
+  pthis->items = (uint8_t*)calloc(capacity, item_size);
+  pthis->item_size = item_size;
+  pthis->capacity = capacity;
+  pthis->stats.capacity = capacity;
+  uv_mutex_init(&pthis->lock);
+  uv_cond_init(&pthis->not_full);
+  uv_cond_init(&pthis->not_empty);
+  uv_cond_init(&pthis->idle);
+  *queue_out = pthis;
+  return 0;
+}
+
+void stage_queue_free(struct stage_queue_s* pthis) {
+  if (!pthis) {
+    return;
+  }
+  uv_cond_destroy(&pthis->idle);
+  uv_cond_destroy(&pthis->not_empty);
+  uv_cond_destroy(&pthis->not_full);
+  uv_mutex_destroy(&pthis->lock);
+  free(pthis->items);
+  free(pthis);
+}
+
+int stage_queue_push(struct stage_queue_s* pthis, const void* item) {
+  uv_mutex_lock(&pthis->lock);
+  if (pthis->count == pthis->capacity && !pthis->closed) {
+    pthis->stats.producer_waits++;
+    while (pthis->count == pthis->capacity && !pthis->closed) {
+      uv_cond_wait(&pthis->not_full, &pthis->lock);
+    }
+  }
+  if (pthis->closed) {
+    uv_mutex_unlock(&pthis->lock);
+    return ECANCELED;
+  }
+  int tail = (pthis->head + pthis->count) % pthis->capacity;
+  memcpy(pthis->items + (size_t)tail * pthis->item_size, item,
+         pthis->item_size);
+  pthis->count++;
+  pthis->stats.items_pushed++;
+  if (pthis->count > pthis->stats.high_water_mark) {
+    pthis->stats.high_water_mark = pthis->count;
+  }
+  uv_cond_signal(&pthis->not_empty);
+  uv_mutex_unlock(&pthis->lock);
+  return 0;
+}
+
+int stage_queue_push_evict(struct stage_queue_s* pthis, const void* item,
+                           void* evicted_out)
+{
+  int ret = 0;
+  uv_mutex_lock(&pthis->lock);
+  if (pthis->closed) {
+    uv_mutex_unlock(&pthis->lock);
+    return ECANCELED;
+  }
+  if (pthis->count == pthis->capacity) {
+    memcpy(evicted_out, pthis->items + (size_t)pthis->head * pthis->item_size,
+           pthis->item_size);
+    pthis->head = (pthis->head + 1) % pthis->capacity;
+    pthis->count--;
+    pthis->stats.items_evicted++;
+    ret = ENOBUFS;
+  }
+  int tail = (pthis->head + pthis->count) % pthis->capacity;
+  memcpy(pthis->items + (size_t)tail * pthis->item_size, item,
+         pthis->item_size);
+  pthis->count++;
+  pthis->stats.items_pushed++;
+  if (pthis->count > pthis->stats.high_water_mark) {
+    pthis->stats.high_water_mark = pthis->count;
+  }
+  uv_cond_signal(&pthis->not_empty);
+  uv_mutex_unlock(&pthis->lock);
+  return ret;
+}
+
+int stage_queue_pop(struct stage_queue_s* pthis, void* item_out) {
+  uv_mutex_lock(&pthis->lock);
+  // whatever was popped last is finished with
+  pthis->busy = 0;
+  if (!pthis->count) {
+    uv_cond_broadcast(&pthis->idle);
+  }
+  while (!pthis->count && !pthis->closed) {
+    uv_cond_wait(&pthis->not_empty, &pthis->lock);
+  }
+  if (!pthis->count) {
+    uv_mutex_unlock(&pthis->lock);
+    return EOF;
+  }
+  memcpy(item_out, pthis->items + (size_t)pthis->head * pthis->item_size,
+         pthis->item_size);
+  pthis->head = (pthis->head + 1) % pthis->capacity;
+  pthis->count--;
+  pthis->busy = 1;
+  uv_cond_signal(&pthis->not_full);
+  uv_mutex_unlock(&pthis->lock);
+  return 0;
+}
+
+void stage_queue_drain(struct stage_queue_s* pthis) {
+  uv_mutex_lock(&pthis->lock);
+  while ((pthis->count || pthis->busy) && !pthis->closed) {
+    uv_cond_wait(&pthis->idle, &pthis->lock);
+  }
+  uv_mutex_unlock(&pthis->lock);
+}
+
+void stage_queue_close(struct stage_queue_s* pthis) {
+  uv_mutex_lock(&pthis->lock);
+  pthis->closed = 1;
+  uv_cond_broadcast(&pthis->not_full);
+  uv_cond_broadcast(&pthis->not_empty);
+  uv_cond_broadcast(&pthis->idle);
+  uv_mutex_unlock(&pthis->lock);
+}
+
+void stage_queue_get_stats(struct stage_queue_s* pthis,
+                           struct stage_queue_stats_s* stats_out)
+{
+  uv_mutex_lock(&pthis->lock);
+  memcpy(stats_out, &pthis->stats, sizeof(struct stage_queue_stats_s));
+  uv_mutex_unlock(&pthis->lock);
+}
@@ -0,0 +1,55 @@
+//
+//  stage_queue.h
+//  x11pulsemux
+//
+
+#ifndef stage_queue_h
+#define stage_queue_h
+
+#include <stdint.h>
+
+/**
+ * Bounded blocking queue between two pipeline threads. Items are fixed size
+ * and copied in and out, so a job struct travels by value without an
+ * allocation per item. A full queue blocks the producers (backpressure),
+ * or, with stage_queue_push_evict, gives up its oldest item, and an empty
+ * one blocks the consumer, until stage_queue_close: after that pushes fail
+ * and pops drain what is left, then fail. One consumer per queue; it is
+ * done with an item when it asks for the next.
+ */
+struct stage_queue_s;
+
+struct stage_queue_stats_s {
+  int64_t items_pushed;
+  // pushes that found the queue full and had to wait
+  int64_t producer_waits;
+  // items stage_queue_push_evict pushed out to make room
+  int64_t items_evicted;
+  int high_water_mark;
+  int capacity;
+};
+
+int stage_queue_alloc(struct stage_queue_s** queue_out, int capacity,
+                      int item_size);
+// Items still queued are dropped without a look; drain first if they own
+// anything.
+void stage_queue_free(struct stage_queue_s* queue);
+
+// Blocks while full. Returns ECANCELED once the queue is closed.
+int stage_queue_push(struct stage_queue_s* queue, const void* item);
+// Never blocks: when full, the oldest item is moved to evicted_out to make
+// room and ENOBUFS returned, with item queued all the same. Returns
+// ECANCELED once the queue is closed.
+int stage_queue_push_evict(struct stage_queue_s* queue, const void* item,
+                           void* evicted_out);
+// Blocks while empty. Returns EOF once the queue is closed and empty.
+int stage_queue_pop(struct stage_queue_s* queue, void* item_out);
+// Blocks until the consumer has finished every item pushed so far. The
+// caller keeps new items out for as long as it relies on that.
+void stage_queue_drain(struct stage_queue_s* queue);
+void stage_queue_close(struct stage_queue_s* queue);
+
+void stage_queue_get_stats(struct stage_queue_s* queue,
+                           struct stage_queue_stats_s* stats_out);
+
+#endif /* stage_queue_h */
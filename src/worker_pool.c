@@ -0,0 +1,117 @@
+//
+//  worker_pool.c
+//  x11pulsemux
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <uv.h>
+#include "worker_pool.h"
+
+struct worker_pool_s {
+  uv_thread_t* threads;
+  int nb_threads;
+  uv_mutex_t lock;
+  uv_cond_t work_cond;
+  uv_cond_t done_cond;
+  worker_pool_job_fn fn;
+  void* arg;
+  int nb_jobs;
+  int next_job;
+  int jobs_done;
+  char shutdown;
+};
+
+// Claims jobs until none are left. Called and returns with the lock held.
+static void _run_jobs(struct worker_pool_s* pthis) {
+  while (pthis->next_job < pthis->nb_jobs) {
+    int job = pthis->next_job++;
+    int nb_jobs = pthis->nb_jobs;
+    worker_pool_job_fn fn = pthis->fn;
+    void* arg = pthis->arg;
+    uv_mutex_unlock(&pthis->lock);
+    fn(arg, job, nb_jobs);
+    uv_mutex_lock(&pthis->lock);
+    if (++pthis->jobs_done == pthis->nb_jobs) {
+      uv_cond_signal(&pthis->done_cond);
+    }
+  }
+}
+
+static void _worker_main(void* p) {
+  struct worker_pool_s* pthis = (struct worker_pool_s*)p;
+  uv_mutex_lock(&pthis->lock);
+  while (!pthis->shutdown) {
+    if (pthis->next_job < pthis->nb_jobs) {
+      _run_jobs(pthis);
+    } else {
+      uv_cond_wait(&pthis->work_cond, &pthis->lock);
+    }
+  }
+  uv_mutex_unlock(&pthis->lock);
+}
+
+int worker_pool_alloc(struct worker_pool_s** pool_out, int nb_threads) {
+  int ret = 0;
+  struct worker_pool_s* pthis = (struct worker_pool_s*)
+  calloc(1, sizeof(struct worker_pool_s));
+  uv_mutex_init(&pthis->lock);
+  uv_cond_init(&pthis->work_cond);
+  uv_cond_init(&pthis->done_cond);
+  pthis->nb_threads = nb_threads < 1 ? 1 : nb_threads;
+  pthis->threads = (uv_thread_t*)
+  calloc(pthis->nb_threads, sizeof(uv_thread_t));
+  // slot 0 is the caller of worker_pool_run
+  for (int i = 1; i < pthis->nb_threads; i++) {
+    ret = uv_thread_create(&pthis->threads[i], _worker_main, pthis);
+    if (ret) {
+      printf("worker_pool_alloc: uv_thread_create failed with %d\n", ret);
+      pthis->nb_threads = i;
+      break;
+    }
+  }
+  *pool_out = pthis;
+  return ret;
+}
+
+void worker_pool_free(struct worker_pool_s* pthis) {
+  if (!pthis) {
+    return;
+  }
+  uv_mutex_lock(&pthis->lock);
+  pthis->shutdown = 1;
+  uv_cond_broadcast(&pthis->work_cond);
+  uv_mutex_unlock(&pthis->lock);
+  for (int i = 1; i < pthis->nb_threads; i++) {
+    uv_thread_join(&pthis->threads[i]);
+  }
+  uv_cond_destroy(&pthis->work_cond);
+  uv_cond_destroy(&pthis->done_cond);
+  uv_mutex_destroy(&pthis->lock);
+  free(pthis->threads);
+  free(pthis);
+}
+
+int worker_pool_get_size(struct worker_pool_s* pthis) {
+  return pthis->nb_threads;
+}
+
+void worker_pool_run(struct worker_pool_s* pthis, worker_pool_job_fn fn,
+                     void* arg, int nb_jobs)
+{
+  uv_mutex_lock(&pthis->lock);
+  pthis->fn = fn;
+  pthis->arg = arg;
+  pthis->nb_jobs = nb_jobs;
+  pthis->next_job = 0;
+  pthis->jobs_done = 0;
+  if (pthis->nb_threads > 1 && nb_jobs > 1) {
+    uv_cond_broadcast(&pthis->work_cond);
+  }
+  _run_jobs(pthis);
+  // join barrier: bands claimed by workers may still be in flight
+  while (pthis->jobs_done < pthis->nb_jobs) {
+    uv_cond_wait(&pthis->done_cond, &pthis->lock);
+  }
+  uv_mutex_unlock(&pthis->lock);
+}
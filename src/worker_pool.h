@@ -0,0 +1,27 @@
+//
+//  worker_pool.h
+//  x11pulsemux
+//
+
+#ifndef worker_pool_h
+#define worker_pool_h
+
+/**
+ * Fixed set of threads for fork/join style data parallel work, such as
+ * converting one frame in horizontal bands. The calling thread takes part in
+ * every run, so a pool of N threads spawns N - 1 workers.
+ */
+struct worker_pool_s;
+
+typedef void (*worker_pool_job_fn)(void* arg, int job_index, int nb_jobs);
+
+int worker_pool_alloc(struct worker_pool_s** pool_out, int nb_threads);
+void worker_pool_free(struct worker_pool_s* pool);
+int worker_pool_get_size(struct worker_pool_s* pool);
+
+// Runs fn once for every job index in [0, nb_jobs) and returns after the
+// last one finishes. Not reentrant: one run at a time per pool.
+void worker_pool_run(struct worker_pool_s* pool, worker_pool_job_fn fn,
+                     void* arg, int nb_jobs);
+
+#endif /* worker_pool_h */
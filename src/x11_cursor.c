@@ -0,0 +1,258 @@
+//
+//  x11_cursor.c
+//  x11pulsemux
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/xfixes.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include "x11_cursor.h"
+
+struct x11_cursor_s {
+  struct x11_cursor_config_s config;
+  uint8_t first_event;
+  char shape_dirty;
+  // cached shape at output scale, four bytes per pixel: Y, U, V, alpha
+  uint8_t* yuva;
+  unsigned int yuva_size;
+  uint32_t serial;
+  int width;
+  int height;
+  int xhot;
+  int yhot;
+  // top left corner in output coordinates for the coming frame
+  int x;
+  int y;
+  // what the last blended frame showed
+  char drawn_valid;
+  uint32_t drawn_serial;
+  struct x11_rect_s drawn;
+  struct x11_rect_s previous;
+};
+
+void x11_cursor_alloc(struct x11_cursor_s** cursor_out) {
+  struct x11_cursor_s* pthis = (struct x11_cursor_s*)
+  calloc(1, sizeof(struct x11_cursor_s));
+  *cursor_out = pthis;
+}
+
+void x11_cursor_free(struct x11_cursor_s* pthis) {
+  if (!pthis) {
+    return;
+  }
+  av_free(pthis->yuva);
+  free(pthis);
+}
+
+int x11_cursor_start(struct x11_cursor_s* pthis,
+                     struct x11_cursor_config_s* config)
+{
+  memcpy(&pthis->config, config, sizeof(struct x11_cursor_config_s));
+  const xcb_query_extension_reply_t* xfixes_ext =
+  xcb_get_extension_data(config->connection, &xcb_xfixes_id);
+  if (!xfixes_ext || !xfixes_ext->present) {
+    printf("x11_cursor_start: display does not support XFixes\n");
+    return AVERROR(ENOSYS);
+  }
+  pthis->first_event = xfixes_ext->first_event;
+  xcb_xfixes_select_cursor_input(config->connection, config->root,
+                                 XCB_XFIXES_CURSOR_NOTIFY_MASK_DISPLAY_CURSOR);
+  pthis->shape_dirty = 1;
+  return 0;
+}
+
+char x11_cursor_handle_event(struct x11_cursor_s* pthis,
+                             xcb_generic_event_t* event)
+{
+  if ((event->response_type & 0x7f) !=
+      pthis->first_event + XCB_XFIXES_CURSOR_NOTIFY)
+  {
+    return 0;
+  }
+  pthis->shape_dirty = 1;
+  return 1;
+}
+
+// Converts the server's premultiplied ARGB image to straight YUVA at output
+// scale. Each output pixel averages the source pixels it covers, which for
+// the usual 1:1 case is just the pixel itself.
+static void _convert_shape(struct x11_cursor_s* pthis, const uint32_t* argb,
+                           int src_width, int src_height)
+{
+  struct x11_cursor_config_s* config = &pthis->config;
+  for (int j = 0; j < pthis->height; j++) {
+    int sy0 = j * src_height / pthis->height;
+    int sy1 = FFMAX((j + 1) * src_height / pthis->height, sy0 + 1);
+    for (int i = 0; i < pthis->width; i++) {
+      int sx0 = i * src_width / pthis->width;
+      int sx1 = FFMAX((i + 1) * src_width / pthis->width, sx0 + 1);
+      int a = 0, r = 0, g = 0, b = 0, n = 0;
+      for (int sy = sy0; sy < sy1; sy++) {
+        for (int sx = sx0; sx < sx1; sx++) {
+          uint32_t px = argb[sy * src_width + sx];
+          a += px >> 24;
+          r += (px >> 16) & 0xff;
+          g += (px >> 8) & 0xff;
+          b += px & 0xff;
+          n++;
+        }
+      }
+      uint8_t* out = pthis->yuva + (j * pthis->width + i) * 4;
+      out[3] = a / n;
+      if (!a) {
+        out[0] = 16;
+        out[1] = out[2] = 128;
+        continue;
+      }
+      // undo the premultiplication; blending applies alpha again
+      color_convert_pixel(FFMIN(b * 255 / a, 255), FFMIN(g * 255 / a, 255),
+                          FFMIN(r * 255 / a, 255), config->matrix,
+                          &out[0], &out[1], &out[2]);
+    }
+  }
+}
+
+static int _fetch_shape(struct x11_cursor_s* pthis) {
+  struct x11_cursor_config_s* config = &pthis->config;
+  xcb_generic_error_t* error = NULL;
+  xcb_xfixes_get_cursor_image_reply_t* reply =
+  xcb_xfixes_get_cursor_image_reply(config->connection,
+                                    xcb_xfixes_get_cursor_image
+                                    (config->connection), &error);
+  if (error) {
+    printf("x11_cursor: xcb_xfixes_get_cursor_image failed (error %d)\n",
+           error->error_code);
+    free(error);
+    free(reply);
+    return AVERROR(EIO);
+  }
+  pthis->shape_dirty = 0;
+  pthis->serial = reply->cursor_serial;
+  pthis->width = FFMAX(reply->width * config->out_width / config->width, 1);
+  pthis->height = FFMAX(reply->height * config->out_height / config->height,
+                        1);
+  pthis->xhot = reply->xhot * config->out_width / config->width;
+  pthis->yhot = reply->yhot * config->out_height / config->height;
+  av_fast_malloc(&pthis->yuva, &pthis->yuva_size,
+                 (size_t)pthis->width * pthis->height * 4);
+  if (!pthis->yuva) {
+    free(reply);
+    return AVERROR(ENOMEM);
+  }
+  if (!reply->width || !reply->height) {
+    memset(pthis->yuva, 0, pthis->yuva_size);
+  } else {
+    _convert_shape(pthis, xcb_xfixes_get_cursor_image_cursor_image(reply),
+                   reply->width, reply->height);
+  }
+  free(reply);
+  return 0;
+}
+
+void x11_cursor_set_capture(struct x11_cursor_s* pthis, int x, int y,
+                            int width, int height,
+                            int out_width, int out_height)
+{
+  pthis->config.x = x;
+  pthis->config.y = y;
+  pthis->config.width = width;
+  pthis->config.height = height;
+  pthis->config.out_width = out_width;
+  pthis->config.out_height = out_height;
+  pthis->shape_dirty = 1;
+  // the old spot is in the old frame's coordinates
+  pthis->drawn.width = 0;
+  pthis->drawn_valid = 0;
+}
+
+char x11_cursor_update(struct x11_cursor_s* pthis) {
+  struct x11_cursor_config_s* config = &pthis->config;
+  if (pthis->shape_dirty && _fetch_shape(pthis)) {
+    return 0;
+  }
+  xcb_query_pointer_reply_t* reply =
+  xcb_query_pointer_reply(config->connection,
+                          xcb_query_pointer(config->connection,
+                                            config->window),
+                          NULL);
+  if (!reply) {
+    return 0;
+  }
+  pthis->x = (reply->win_x - config->x) * config->out_width / config->width -
+  pthis->xhot;
+  pthis->y = (reply->win_y - config->y) * config->out_height /
+  config->height - pthis->yhot;
+  free(reply);
+  return !pthis->drawn_valid || pthis->drawn_serial != pthis->serial ||
+  pthis->drawn.x != pthis->x || pthis->drawn.y != pthis->y;
+}
+
+void x11_cursor_blend(struct x11_cursor_s* pthis, AVFrame* frame) {
+  pthis->previous = pthis->drawn;
+  pthis->drawn.x = pthis->x;
+  pthis->drawn.y = pthis->y;
+  pthis->drawn.width = pthis->width;
+  pthis->drawn.height = pthis->height;
+  pthis->drawn_serial = pthis->serial;
+  pthis->drawn_valid = 1;
+  if (!pthis->yuva) {
+    return;
+  }
+
+  // overlap of the cursor with the frame, in frame coordinates
+  int x0 = FFMAX(pthis->x, 0);
+  int y0 = FFMAX(pthis->y, 0);
+  int x1 = FFMIN(pthis->x + pthis->width, frame->width);
+  int y1 = FFMIN(pthis->y + pthis->height, frame->height);
+  if (x1 <= x0 || y1 <= y0) {
+    return;
+  }
+
+  for (int y = y0; y < y1; y++) {
+    const uint8_t* src = pthis->yuva +
+    ((y - pthis->y) * pthis->width + (x0 - pthis->x)) * 4;
+    uint8_t* dst = frame->data[0] + y * frame->linesize[0];
+    for (int x = x0; x < x1; x++, src += 4) {
+      dst[x] = (src[0] * src[3] + dst[x] * (255 - src[3]) + 127) / 255;
+    }
+  }
+
+  // Each chroma sample blends the alpha weighted colour of the (up to) four
+  // cursor pixels on top of it; pixels off the cursor count as transparent.
+  for (int cy = y0 / 2; cy < (y1 + 1) / 2; cy++) {
+    uint8_t* dst_u = frame->data[1] + cy * frame->linesize[1];
+    uint8_t* dst_v = frame->data[2] + cy * frame->linesize[2];
+    for (int cx = x0 / 2; cx < (x1 + 1) / 2; cx++) {
+      int sum_a = 0, sum_u = 0, sum_v = 0;
+      for (int k = 0; k < 4; k++) {
+        int px = cx * 2 + (k & 1) - pthis->x;
+        int py = cy * 2 + (k >> 1) - pthis->y;
+        if (px < 0 || py < 0 || px >= pthis->width || py >= pthis->height) {
+          continue;
+        }
+        const uint8_t* src = pthis->yuva + (py * pthis->width + px) * 4;
+        sum_a += src[3];
+        sum_u += src[1] * src[3];
+        sum_v += src[2] * src[3];
+      }
+      dst_u[cx] = (sum_u + dst_u[cx] * (1020 - sum_a) + 510) / 1020;
+      dst_v[cx] = (sum_v + dst_v[cx] * (1020 - sum_a) + 510) / 1020;
+    }
+  }
+}
+
+int x11_cursor_get_rects(struct x11_cursor_s* pthis,
+                         struct x11_rect_s rects[2])
+{
+  int nb_rects = 0;
+  if (pthis->previous.width) {
+    rects[nb_rects++] = pthis->previous;
+  }
+  if (pthis->drawn.width) {
+    rects[nb_rects++] = pthis->drawn;
+  }
+  return nb_rects;
+}
@@ -0,0 +1,70 @@
+//
+//  x11_cursor.h
+//  x11pulsemux
+//
+
+#ifndef x11_cursor_h
+#define x11_cursor_h
+
+#include <xcb/xcb.h>
+#include <libavutil/frame.h>
+#include "color_convert.h"
+#include "x11_video_source.h"
+
+/**
+ * Draws the pointer into converted I420 frames. The server never includes
+ * the cursor in GetImage, so we read it through XFixes: the image only when
+ * XFixes reports a new shape, converted once to YUV plus alpha at output
+ * scale and cached; the position on every frame. Blending touches only the
+ * cursor's own rectangle, so the cost follows cursor size, not screen size.
+ */
+struct x11_cursor_s;
+
+struct x11_cursor_config_s {
+  xcb_connection_t* connection;
+  xcb_window_t root;
+  // window the capture rectangle is relative to: the root, or the window
+  // being captured
+  xcb_window_t window;
+  // capture rectangle in window coordinates and the size it is scaled to
+  int x;
+  int y;
+  int width;
+  int height;
+  int out_width;
+  int out_height;
+  enum color_convert_matrix matrix;
+};
+
+void x11_cursor_alloc(struct x11_cursor_s** cursor_out);
+void x11_cursor_free(struct x11_cursor_s* cursor);
+
+// Needs XFixes; the caller has already negotiated its version.
+int x11_cursor_start(struct x11_cursor_s* cursor,
+                     struct x11_cursor_config_s* config);
+
+// Offers an event read off the shared connection. Returns nonzero if it was
+// ours.
+char x11_cursor_handle_event(struct x11_cursor_s* cursor,
+                             xcb_generic_event_t* event);
+
+// The capture rectangle or the output size changed. The shape is rescaled
+// on the next update.
+void x11_cursor_set_capture(struct x11_cursor_s* cursor, int x, int y,
+                            int width, int height,
+                            int out_width, int out_height);
+
+// Samples shape and position for the coming frame. Returns nonzero when the
+// cursor looks different from the last frame it was drawn into.
+char x11_cursor_update(struct x11_cursor_s* cursor);
+
+// Blends the cursor into frame and remembers it as drawn.
+void x11_cursor_blend(struct x11_cursor_s* cursor, AVFrame* frame);
+
+// After x11_cursor_blend: where the cursor was in the previous frame it was
+// drawn into and where it is in this one, in output coordinates, for damage
+// reporting. Returns how many rectangles it filled in (0 to 2).
+int x11_cursor_get_rects(struct x11_cursor_s* cursor,
+                         struct x11_rect_s rects[2]);
+
+#endif /* x11_cursor_h */
@@ -8,23 +8,39 @@
 extern "C" {
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <time.h>
+#include <unistd.h>
 #include <uv.h>
-#include <libavcodec/avcodec.h>
-#include <libavdevice/avdevice.h>
-#include <libavformat/avformat.h>
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+#include <xcb/composite.h>
+#include <xcb/randr.h>
+#include <xcb/damage.h>
+#include <xcb/xfixes.h>
+#include <libavutil/avstring.h>
 #include <libavutil/frame.h>
+#include <libavutil/time.h>
 #include <libswscale/swscale.h>
-#include <libswresample/swresample.h>
 #include <libavutil/pixfmt.h>
 #include <libavutil/imgutils.h>
 #include <signal.h>
 #include "x11_video_source.h"
+#include "color_convert.h"
+#include "worker_pool.h"
+#include "frame_ring.h"
+#include "frame_pool.h"
+#include "x11_cursor.h"
+#include "sample_window.h"
+#include "media_clock.h"
+#include "xvfb_framebuffer.h"
 
 }
 
-#include <queue>
-
 // Workaround C++ issue with ffmpeg macro
 #ifndef __clang__
 #undef av_err2str
@@ -33,240 +49,1510 @@ av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), \
 AV_ERROR_MAX_STRING_SIZE, errnum)
 #endif
 
+// Captures land in a small rotation of shared memory segments. The X server
+// writes straight into these and the converter reads straight out of them, so
+// a raw frame is never copied on its way to the color conversion stage.
+#define X11_SHM_SEGMENT_COUNT 3
+
+#define X11_MAX_CONVERT_BANDS 64
+
+// About a quarter second of video at ntsc rate
+static const int default_queue_capacity = 8;
+
+// Same rate x11grab used with framerate=ntsc
+static const AVRational default_framerate = { 30000, 1001 };
+
+// Wakeup jitter is summarized over this many recent ticks.
+static const int jitter_window_size = 1024;
+
+enum x11_scale_mode {
+  // capture size is the output size
+  X11_SCALE_NONE,
+  // exact 2:1 shrink, fused into the native converter
+  X11_SCALE_HALF,
+  // anything else: one swscale call does crop, scale and convert
+  X11_SCALE_SWS,
+};
+
+struct x11_shm_segment_s {
+  xcb_shm_seg_t seg;
+  int shmid;
+  uint8_t* data;
+  size_t size;
+};
+
 struct x11_s {
-  std::queue<AVFrame*> queue;
+  struct frame_ring_s* queue;
+  void (*on_video_data)(struct x11_s* x11, void* p);
+  void* video_data_cb_p;
   uv_thread_t worker_thread;
-  uv_mutex_t queue_lock;
   volatile sig_atomic_t interrupted;
-  AVInputFormat* input_format;
-  AVFormatContext* format_context;
-  AVCodecContext* codec_context;
-  AVCodec* codec;
-  struct SwsContext* sws_ctx;
-  int stream_index;
-  AVStream* stream;
+  xcb_connection_t* connection;
+  xcb_screen_t* screen;
+  struct x11_shm_segment_s segments[X11_SHM_SEGMENT_COUNT];
+  // what GetImage reads: the root, or the captured window's pixmap
+  xcb_drawable_t drawable;
+  // window capture: the redirected window, the pixmap XComposite renders it
+  // into and the size it last reported
+  xcb_window_t window;
+  xcb_pixmap_t window_pixmap;
+  uint8_t window_depth;
+  int window_width;
+  int window_height;
+  // resized or remapped; the pixmap needs naming again
+  char window_changed;
+  // screen capture: XRandR reported a new screen size
+  uint8_t randr_first_event;
+  char screen_changed;
+  // the screen shrank past the capture offset; no grabs until it grows
+  // back, and the last picture is repeated meanwhile
+  char screen_paused;
+  // capture size asked for; zero extends to the screen edge
+  int requested_width;
+  int requested_height;
+  // geometry at start, which follow_resize scales the output by
+  char follow_resize;
+  int start_width;
+  int start_height;
+  int start_out_width;
+  int start_out_height;
+  // Xvfb's mapped screen, replacing the SHM segments when set
+  struct xvfb_framebuffer_s* framebuffer;
+  // top left pixel of the capture area inside the mapping
+  const uint8_t* fb_pixels;
+  int next_segment;
+  // previous full grab, for spotting a static screen
+  struct x11_shm_segment_s* last_segment;
+  // last published frame; duplicates share its buffers
+  AVFrame* last_frame;
+  int x;
+  int y;
+  int width;
+  int height;
+  int linesize;
+  int out_width;
+  int out_height;
+  enum x11_scale_mode scale_mode;
+  enum AVPixelFormat pix_fmt;
+  AVRational time_base;
+  // capture schedule: tick n is due at tick_origin_ns + n / framerate on
+  // the media clock, and frames are stamped with the tick they serve
+  AVRational framerate;
+  int64_t tick_origin_ns;
+  int64_t tick_index;
+  // wakeup error per tick in us, guarded by stats_lock
+  struct sample_window_s* jitter;
+  struct worker_pool_s* convert_pool;
+  int nb_bands;
+  struct SwsContext* band_sws[X11_MAX_CONVERT_BANDS];
   int64_t last_pts_read;
+  enum AVColorSpace colorspace;
+  enum color_convert_matrix matrix;
+  char use_damage;
+  xcb_damage_damage_t damage;
+  xcb_xfixes_region_t damage_region;
+  // persistent I420 copy of the screen, patched with damaged regions
+  AVFrame* canvas;
+  char canvas_valid;
+  // recycles the pixel buffers of published frames
+  struct frame_pool_s* frame_pool;
+  char xfixes_ready;
+  struct x11_cursor_s* cursor;
+  // the pointer moved or changed shape since the last published frame
+  char cursor_changed;
+  uv_mutex_t stats_lock;
+  struct x11_stats_s stats;
 };
 
 void x11_alloc(struct x11_s** x11_out) {
   struct x11_s* pthis = (struct x11_s*)calloc(1, sizeof(struct x11_s));
-  uv_mutex_init(&pthis->queue_lock);
-  pthis->queue = std::queue<AVFrame*>();
+  uv_mutex_init(&pthis->stats_lock);
+  frame_pool_alloc(&pthis->frame_pool);
+  pthis->last_frame = av_frame_alloc();
   *x11_out = pthis;
 }
 
-void x11_free(struct x11_s* x11) {
-  free(x11);
+static void _shm_segment_release(struct x11_s* pthis,
+                                 struct x11_shm_segment_s* segment)
+{
+  if (!segment->data) {
+    return;
+  }
+  xcb_shm_detach(pthis->connection, segment->seg);
+  shmdt(segment->data);
+  segment->data = NULL;
+  segment->size = 0;
 }
 
-static int _read_frame(struct x11_s* pthis, AVFrame** frame_out) {
-  int ret, have_frame = 0;
-  AVPacket packet = { 0 };
-  *frame_out = NULL;
-  
-  while (!have_frame) {
-    ret = av_read_frame(pthis->format_context, &packet);
-    if (ret < 0) {
-      printf("x11_read_frame: %s\n", av_err2str(ret));
+void x11_free(struct x11_s* pthis) {
+  frame_ring_free(pthis->queue);
+  av_frame_free(&pthis->canvas);
+  av_frame_free(&pthis->last_frame);
+  x11_cursor_free(pthis->cursor);
+  sample_window_free(pthis->jitter);
+  xvfb_framebuffer_close(pthis->framebuffer);
+  if (pthis->connection) {
+    if (pthis->damage) {
+      xcb_damage_destroy(pthis->connection, pthis->damage);
+      xcb_xfixes_destroy_region(pthis->connection, pthis->damage_region);
+    }
+    for (int i = 0; i < X11_SHM_SEGMENT_COUNT; i++) {
+      _shm_segment_release(pthis, &pthis->segments[i]);
+    }
+    if (pthis->window_pixmap) {
+      xcb_free_pixmap(pthis->connection, pthis->window_pixmap);
+    }
+    xcb_disconnect(pthis->connection);
+  }
+  worker_pool_free(pthis->convert_pool);
+  for (int i = 0; i < X11_MAX_CONVERT_BANDS; i++) {
+    sws_freeContext(pthis->band_sws[i]);
+  }
+  frame_pool_free(pthis->frame_pool);
+  uv_mutex_destroy(&pthis->stats_lock);
+  free(pthis);
+}
+
+static int _shm_segment_alloc(struct x11_s* pthis,
+                              struct x11_shm_segment_s* segment,
+                              size_t size)
+{
+  segment->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+  if (segment->shmid < 0) {
+    printf("x11_video_source: shmget failed (%zu bytes)\n", size);
+    return AVERROR(ENOMEM);
+  }
+  segment->data = (uint8_t*)shmat(segment->shmid, NULL, 0);
+  if (segment->data == (uint8_t*)-1) {
+    printf("x11_video_source: shmat failed\n");
+    segment->data = NULL;
+    shmctl(segment->shmid, IPC_RMID, NULL);
+    return AVERROR(ENOMEM);
+  }
+  segment->seg = xcb_generate_id(pthis->connection);
+  xcb_void_cookie_t cookie =
+  xcb_shm_attach_checked(pthis->connection, segment->seg, segment->shmid, 0);
+  xcb_generic_error_t* error = xcb_request_check(pthis->connection, cookie);
+  // Mark for removal now: the kernel keeps the segment alive until both this
+  // process and the X server detach, and nothing leaks if we crash.
+  shmctl(segment->shmid, IPC_RMID, NULL);
+  if (error) {
+    printf("x11_video_source: xcb_shm_attach failed (error %d)\n",
+           error->error_code);
+    free(error);
+    shmdt(segment->data);
+    segment->data = NULL;
+    return AVERROR(EIO);
+  }
+  segment->size = size;
+  return 0;
+}
+
+// Maps the pixmap format of the captured depth to a pixel format sws
+// understands.
+static int _find_pix_fmt(struct x11_s* pthis, uint8_t depth) {
+  const xcb_setup_t* setup = xcb_get_setup(pthis->connection);
+  const xcb_format_t* formats = xcb_setup_pixmap_formats(setup);
+  int length = xcb_setup_pixmap_formats_length(setup);
+  int bits_per_pixel = 0;
+  for (int i = 0; i < length; i++) {
+    if (formats[i].depth == depth) {
+      bits_per_pixel = formats[i].bits_per_pixel;
+      break;
+    }
+  }
+  if (bits_per_pixel != 32 ||
+      setup->image_byte_order != XCB_IMAGE_ORDER_LSB_FIRST)
+  {
+    printf("x11_video_source: unsupported pixmap format depth=%d bpp=%d\n",
+           depth, bits_per_pixel);
+    return AVERROR(ENOSYS);
+  }
+  pthis->pix_fmt = depth == 32 ?
+  AV_PIX_FMT_BGRA : AV_PIX_FMT_BGR0;
+  return 0;
+}
+
+// Adopts a new capture size. The output size stays put, or with
+// follow_resize keeps the ratio to the capture size it had at start. Picks
+// the conversion path for the pair, grows the SHM segments if they are too
+// small and forgets whatever described the old geometry.
+static int _set_geometry(struct x11_s* pthis, int width, int height) {
+  int ret;
+  pthis->width = width;
+  pthis->height = height;
+  if (pthis->follow_resize && pthis->start_width) {
+    pthis->out_width = FFMAX(av_rescale(width, pthis->start_out_width,
+                                        pthis->start_width) & ~1, 2);
+    pthis->out_height = FFMAX(av_rescale(height, pthis->start_out_height,
+                                         pthis->start_height) & ~1, 2);
+  }
+  if (!pthis->framebuffer) {
+    pthis->linesize = width * 4;
+  }
+  if (pthis->out_width == width && pthis->out_height == height) {
+    pthis->scale_mode = X11_SCALE_NONE;
+  } else if (pthis->out_width * 2 == width && pthis->out_height * 2 == height)
+  {
+    pthis->scale_mode = X11_SCALE_HALF;
+  } else {
+    pthis->scale_mode = X11_SCALE_SWS;
+  }
+
+  size_t size = (size_t)pthis->linesize * height;
+  for (int i = 0; !pthis->framebuffer && i < X11_SHM_SEGMENT_COUNT; i++) {
+    if (pthis->segments[i].size >= size) {
+      continue;
+    }
+    _shm_segment_release(pthis, &pthis->segments[i]);
+    ret = _shm_segment_alloc(pthis, &pthis->segments[i], size);
+    if (ret) {
       return ret;
     }
-    
-    AVFrame* frame = av_frame_alloc();
-    if (packet.stream_index == pthis->stream_index) {
-      ret = avcodec_send_packet(pthis->codec_context, &packet);
-      if (ret < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error decoding video: %s\n",
-               av_err2str(ret));
-      }
-      
-      ret = avcodec_receive_frame(pthis->codec_context, frame);
-      if (!ret) {
-        frame->pts = av_frame_get_best_effort_timestamp(frame);
-        printf("x11_video_source: extracted %lld (diff %lld)\n",
-               frame->pts, frame->pts - pthis->last_pts_read);
-        pthis->last_pts_read = frame->pts;
-        *frame_out = frame;
-        have_frame = 1;
-      } else if (ret != AVERROR(EAGAIN)) {
-        av_frame_free(&frame);
-        return ret;
-      }
+  }
+  pthis->last_segment = NULL;
+  pthis->canvas_valid = 0;
+  AVFrame* canvas = pthis->canvas;
+  if (canvas && (canvas->width != pthis->out_width ||
+                 canvas->height != pthis->out_height))
+  {
+    av_frame_unref(canvas);
+    canvas->width = pthis->out_width;
+    canvas->height = pthis->out_height;
+    canvas->format = AV_PIX_FMT_YUV420P;
+    canvas->colorspace = pthis->colorspace;
+    canvas->color_range = AVCOL_RANGE_MPEG;
+    ret = av_frame_get_buffer(canvas, 16);
+    if (ret) {
+      return ret;
     }
-    av_packet_unref(&packet);
   }
-  return !have_frame;
+  if (pthis->cursor) {
+    x11_cursor_set_capture(pthis->cursor, pthis->x, pthis->y, width, height,
+                           pthis->out_width, pthis->out_height);
+  }
+  return 0;
+}
+
+// Asks the server to copy the capture area into the next segment in the
+// rotation. Blocks for one round trip.
+static int _capture_frame(struct x11_s* pthis,
+                          struct x11_shm_segment_s** segment_out)
+{
+  struct x11_shm_segment_s* segment = &pthis->segments[pthis->next_segment];
+  pthis->next_segment = (pthis->next_segment + 1) % X11_SHM_SEGMENT_COUNT;
+  *segment_out = NULL;
+
+  xcb_generic_error_t* error = NULL;
+  xcb_shm_get_image_cookie_t cookie =
+  xcb_shm_get_image(pthis->connection, pthis->drawable,
+                    pthis->x, pthis->y, pthis->width, pthis->height,
+                    ~0, XCB_IMAGE_FORMAT_Z_PIXMAP, segment->seg, 0);
+  xcb_shm_get_image_reply_t* reply =
+  xcb_shm_get_image_reply(pthis->connection, cookie, &error);
+  free(reply);
+  if (error) {
+    printf("x11_video_source: xcb_shm_get_image failed (error %d)\n",
+           error->error_code);
+    free(error);
+    return AVERROR(EIO);
+  }
+  *segment_out = segment;
+  return 0;
 }
 
+struct x11_convert_job_s {
+  struct x11_s* pthis;
+  const uint8_t* pixels;
+  AVFrame* frame;
+};
+
+// Converts one horizontal band of a frame. Bands are an even number of rows
+// tall so every band owns whole chroma rows and none share output memory.
+static void _convert_band(void* p, int band, int nb_bands) {
+  struct x11_convert_job_s* job = (struct x11_convert_job_s*)p;
+  struct x11_s* pthis = job->pthis;
+  AVFrame* frame = job->frame;
+  int band_height = ((pthis->out_height + nb_bands - 1) / nb_bands + 1) & ~1;
+  int y = band * band_height;
+  int height = FFMIN(band_height, pthis->out_height - y);
+  if (height <= 0) {
+    return;
+  }
+  // Output rows map to source rows 1:1 or 2:1; the swscale path only ever
+  // runs as a single band covering the whole frame.
+  int src_y = pthis->scale_mode == X11_SCALE_HALF ? y * 2 : y;
+  int src_height = pthis->scale_mode == X11_SCALE_HALF ? height * 2 : height;
+  if (pthis->scale_mode == X11_SCALE_SWS) {
+    src_height = pthis->height;
+  }
+  const uint8_t* src_data[4] = {
+    job->pixels + (int64_t)src_y * pthis->linesize, NULL, NULL, NULL
+  };
+  int src_linesize[4] = { pthis->linesize, 0, 0, 0 };
+  uint8_t* dst_data[4] = {
+    frame->data[0] + (int64_t)y * frame->linesize[0],
+    frame->data[1] + (int64_t)(y / 2) * frame->linesize[1],
+    frame->data[2] + (int64_t)(y / 2) * frame->linesize[2],
+    NULL
+  };
+
+  if (pthis->scale_mode == X11_SCALE_HALF) {
+    color_convert_bgra_to_i420_half(src_data[0], pthis->linesize,
+                                    dst_data, frame->linesize,
+                                    pthis->out_width, height, pthis->matrix);
+    return;
+  }
+  if (pthis->scale_mode == X11_SCALE_NONE && color_convert_is_accelerated()) {
+    color_convert_bgra_to_i420(src_data[0], pthis->linesize,
+                               dst_data, frame->linesize,
+                               pthis->width, height, pthis->matrix);
+    return;
+  }
+
+  // swscale slices must arrive in order per context, so each band gets a
+  // context of its own, sized to the band.
+  int flags = SWS_FAST_BILINEAR;
+  if (pthis->scale_mode == X11_SCALE_SWS) {
+    flags = pthis->out_width < pthis->width ? SWS_AREA : SWS_BICUBIC;
+  }
+  struct SwsContext* sws_ctx =
+  sws_getCachedContext(pthis->band_sws[band],
+                       pthis->width, src_height, pthis->pix_fmt,
+                       pthis->out_width, height, AV_PIX_FMT_YUV420P,
+                       flags, NULL, NULL, NULL);
+  if (sws_ctx != pthis->band_sws[band] &&
+      pthis->matrix == COLOR_CONVERT_BT709)
+  {
+    sws_setColorspaceDetails(sws_ctx, sws_getCoefficients(SWS_CS_DEFAULT), 1,
+                             sws_getCoefficients(SWS_CS_ITU709), 0,
+                             0, 1 << 16, 1 << 16);
+  }
+  pthis->band_sws[band] = sws_ctx;
+  sws_scale(sws_ctx, src_data, src_linesize, 0, src_height,
+            dst_data, frame->linesize);
+}
 
-// Converts RGB frame to YUV before passing downstream.
-AVFrame* _convert_frame(struct x11_s* pthis, AVFrame* frame) {
+// Converts RGB pixels to YUV at the output size before passing downstream.
+// The native kernels do the whole job, including a 2:1 shrink, in one pass;
+// swscale remains for CPUs without them and for other scale factors. Either
+// way the source is read straight out of shared memory, never staged.
+static AVFrame* _convert_frame(struct x11_s* pthis, const uint8_t* pixels) {
   int ret;
-  pthis->sws_ctx = sws_getCachedContext(pthis->sws_ctx,
-                                        frame->width, frame->height,
-                                        (enum AVPixelFormat) frame->format,
-                                        frame->width, frame->height,
-                                        AV_PIX_FMT_YUV420P,
-                                        SWS_FAST_BILINEAR,
-                                        NULL, NULL, NULL);
-
-  AVFrame* converted_frame = av_frame_alloc();
-//  ret = av_image_alloc(converted_frame->data, converted_frame->linesize,
-//                       frame->width, frame->height, AV_PIX_FMT_YUV420P, 16);
-
-  converted_frame->width = frame->width;
-  converted_frame->height = frame->height;
-  converted_frame->format = AV_PIX_FMT_YUV420P;
-  converted_frame->pict_type = frame->pict_type;
-  converted_frame->key_frame = frame->key_frame;
-  converted_frame->pts = frame->pts;
-  converted_frame->pkt_dts = frame->pkt_dts;
-  converted_frame->pkt_duration = frame->pkt_duration;
-  // fun fact about av_image_alloc: the references on underlying buffers do not
-  // get passed along. av_image_fill_arrays does the right thing and keeps
-  // av_frame_free on this frame working as expected.
-  ret = av_frame_get_buffer(converted_frame, 16);
-
-  sws_scale(pthis->sws_ctx, frame->data, frame->linesize, 0,
-            frame->height, converted_frame->data, converted_frame->linesize);
-  av_frame_free(&frame);
+  AVFrame* converted_frame;
+  ret = frame_pool_get_video(pthis->frame_pool,
+                             pthis->out_width, pthis->out_height,
+                             AV_PIX_FMT_YUV420P, &converted_frame);
+  if (ret) {
+    printf("x11_video_source: cannot allocate frame: %s\n", av_err2str(ret));
+    return NULL;
+  }
+  converted_frame->colorspace = pthis->colorspace;
+  converted_frame->color_range = AVCOL_RANGE_MPEG;
+
+  struct x11_convert_job_s job = { pthis, pixels, converted_frame };
+  // Splitting a scaled swscale pass into bands would seam at the borders.
+  int nb_bands = pthis->scale_mode == X11_SCALE_SWS ? 1 : pthis->nb_bands;
+  worker_pool_run(pthis->convert_pool, _convert_band, &job, nb_bands);
   return converted_frame;
 }
 
+static int64_t _tick_deadline(struct x11_s* pthis, int64_t tick) {
+  return pthis->tick_origin_ns +
+  av_rescale(tick, MEDIA_CLOCK_NS_PER_SEC * pthis->framerate.den,
+             pthis->framerate.num);
+}
+
+// Sleeps until the next tick of the configured frame rate and returns its
+// deadline. Deadlines are absolute, so time spent capturing never pushes the
+// schedule back and sleep errors do not accumulate. A tick whose deadline
+// has already passed is late and runs at once; ticks that passed entirely
+// are missed and skipped.
+static int64_t _wait_next_frame(struct x11_s* pthis) {
+  int64_t now = media_clock_now();
+  if (!pthis->tick_origin_ns) {
+    pthis->tick_origin_ns = now;
+    pthis->tick_index = 0;
+  } else {
+    pthis->tick_index++;
+  }
+  int64_t deadline = _tick_deadline(pthis, pthis->tick_index);
+  int64_t missed = 0;
+  char late = now > deadline;
+  if (late) {
+    // whole periods only: the tick served must not lie in the future
+    missed = av_rescale_rnd(now - deadline, pthis->framerate.num,
+                            MEDIA_CLOCK_NS_PER_SEC * pthis->framerate.den,
+                            AV_ROUND_DOWN);
+    pthis->tick_index += missed;
+    deadline = _tick_deadline(pthis, pthis->tick_index);
+  } else {
+    struct timespec ts;
+    ts.tv_sec = deadline / MEDIA_CLOCK_NS_PER_SEC;
+    ts.tv_nsec = deadline % MEDIA_CLOCK_NS_PER_SEC;
+    // the media clock is CLOCK_MONOTONIC
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR);
+  }
+  int64_t error_us = (media_clock_now() - deadline) / 1000;
+
+  uv_mutex_lock(&pthis->stats_lock);
+  pthis->stats.ticks_late += late;
+  pthis->stats.ticks_missed += missed;
+  sample_window_add(pthis->jitter, error_us);
+  uv_mutex_unlock(&pthis->stats_lock);
+  return deadline;
+}
+
+static int _attach_meta(AVFrame* frame, const struct x11_frame_meta_s* meta) {
+  // clones of the last frame arrive carrying its meta
+  av_buffer_unref(&frame->opaque_ref);
+  frame->opaque_ref = av_buffer_alloc(sizeof(struct x11_frame_meta_s));
+  if (!frame->opaque_ref) {
+    return AVERROR(ENOMEM);
+  }
+  memcpy(frame->opaque_ref->data, meta, sizeof(struct x11_frame_meta_s));
+  return 0;
+}
+
+// Damage is tracked in capture coordinates until the frame is converted.
+static void _full_frame_meta(struct x11_s* pthis,
+                             struct x11_frame_meta_s* meta)
+{
+  meta->nb_damage_rects = 1;
+  meta->damage_rects[0].x = 0;
+  meta->damage_rects[0].y = 0;
+  meta->damage_rects[0].width = pthis->width;
+  meta->damage_rects[0].height = pthis->height;
+}
+
+// Maps damage rectangles from capture to output coordinates. Exact for the
+// unscaled and half size paths, whose rectangles are snapped to match.
+static void _meta_to_output(struct x11_s* pthis,
+                            struct x11_frame_meta_s* meta)
+{
+  for (int i = 0; i < meta->nb_damage_rects; i++) {
+    struct x11_rect_s* rect = &meta->damage_rects[i];
+    int x1 = (rect->x + rect->width) * pthis->out_width / pthis->width;
+    int y1 = (rect->y + rect->height) * pthis->out_height / pthis->height;
+    rect->x = rect->x * pthis->out_width / pthis->width;
+    rect->y = rect->y * pthis->out_height / pthis->height;
+    rect->width = x1 - rect->x;
+    rect->height = y1 - rect->y;
+  }
+}
+
+// Republishes the last frame without converting anything. The clone shares
+// the pixel buffers, so a static screen costs no copies at all.
+static int _publish_duplicate(struct x11_s* pthis,
+                              struct x11_frame_meta_s* meta,
+                              AVFrame** frame_out)
+{
+  meta->nb_damage_rects = 0;
+  meta->is_duplicate = 1;
+  *frame_out = av_frame_clone(pthis->last_frame);
+  return *frame_out ? 0 : AVERROR(ENOMEM);
+}
+
+// Grabs and converts the entire capture area, unless it is identical to the
+// previous grab. glibc's memcmp is vectorized and bails out at the first
+// difference, so a changing screen pays almost nothing for the check.
+// The Xvfb framebuffer is converted in place; there is no previous grab to
+// compare with, so static screens are only spotted in damage mode.
+static int _grab_full(struct x11_s* pthis, struct x11_frame_meta_s* meta,
+                      AVFrame** frame_out, int64_t* convert_start)
+{
+  if (pthis->framebuffer) {
+    *convert_start = av_gettime_relative();
+    *frame_out = _convert_frame(pthis, pthis->fb_pixels);
+    _full_frame_meta(pthis, meta);
+    return *frame_out ? 0 : AVERROR(ENOMEM);
+  }
+  struct x11_shm_segment_s* segment = NULL;
+  int ret = _capture_frame(pthis, &segment);
+  *convert_start = av_gettime_relative();
+  if (ret) {
+    return ret;
+  }
+  struct x11_shm_segment_s* last_segment = pthis->last_segment;
+  pthis->last_segment = segment;
+  if (last_segment && pthis->last_frame->buf[0] && !pthis->cursor_changed &&
+      !memcmp(segment->data, last_segment->data,
+              (size_t)pthis->linesize * pthis->height))
+  {
+    return _publish_duplicate(pthis, meta, frame_out);
+  }
+  *frame_out = _convert_frame(pthis, segment->data);
+  _full_frame_meta(pthis, meta);
+  return *frame_out ? 0 : AVERROR(ENOMEM);
+}
+
+// XFixes refuses requests until the client announces its version. Both
+// damage tracking and the cursor need it.
+static int _xfixes_init(struct x11_s* pthis) {
+  xcb_connection_t* conn = pthis->connection;
+  if (pthis->xfixes_ready) {
+    return 0;
+  }
+  const xcb_query_extension_reply_t* xfixes_ext =
+  xcb_get_extension_data(conn, &xcb_xfixes_id);
+  if (!xfixes_ext || !xfixes_ext->present) {
+    printf("x11_start: display does not support XFixes\n");
+    return AVERROR(ENOSYS);
+  }
+  xcb_generic_error_t* error = NULL;
+  free(xcb_xfixes_query_version_reply
+       (conn, xcb_xfixes_query_version(conn, XCB_XFIXES_MAJOR_VERSION,
+                                       XCB_XFIXES_MINOR_VERSION), &error));
+  if (error) {
+    printf("x11_start: XFixes version handshake failed (error %d)\n",
+           error->error_code);
+    free(error);
+    return AVERROR(EIO);
+  }
+  pthis->xfixes_ready = 1;
+  return 0;
+}
+
+static int _damage_init(struct x11_s* pthis) {
+  xcb_connection_t* conn = pthis->connection;
+  const xcb_query_extension_reply_t* damage_ext =
+  xcb_get_extension_data(conn, &xcb_damage_id);
+  if (!damage_ext || !damage_ext->present) {
+    printf("x11_start: display does not support XDamage\n");
+    return AVERROR(ENOSYS);
+  }
+  int ret = _xfixes_init(pthis);
+  if (ret) {
+    return ret;
+  }
+
+  // Like XFixes, XDamage wants to hear our version first.
+  xcb_generic_error_t* error = NULL;
+  free(xcb_damage_query_version_reply
+       (conn, xcb_damage_query_version(conn, XCB_DAMAGE_MAJOR_VERSION,
+                                       XCB_DAMAGE_MINOR_VERSION), &error));
+  if (error) {
+    printf("x11_start: XDamage version handshake failed (error %d)\n",
+           error->error_code);
+    free(error);
+    return AVERROR(EIO);
+  }
+
+  pthis->damage = xcb_generate_id(conn);
+  xcb_damage_create(conn, pthis->damage,
+                    pthis->window ? pthis->window : pthis->screen->root,
+                    XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+  pthis->damage_region = xcb_generate_id(conn);
+  xcb_xfixes_create_region(conn, pthis->damage_region, 0, NULL);
+
+  pthis->canvas = av_frame_alloc();
+  pthis->canvas->width = pthis->out_width;
+  pthis->canvas->height = pthis->out_height;
+  pthis->canvas->format = AV_PIX_FMT_YUV420P;
+  pthis->canvas->colorspace = pthis->colorspace;
+  pthis->canvas->color_range = AVCOL_RANGE_MPEG;
+  pthis->canvas_valid = 0;
+  return av_frame_get_buffer(pthis->canvas, 16);
+}
+
+// Clips a damaged screen rectangle to the capture area, translates it to
+// capture coordinates and snaps it outward so each rectangle owns whole
+// chroma samples of the output: even coordinates, or multiples of four when
+// shrinking by half.
+static int _clip_rect(struct x11_s* pthis, const xcb_rectangle_t* in,
+                      struct x11_rect_s* out)
+{
+  int mask = pthis->scale_mode == X11_SCALE_HALF ? 3 : 1;
+  int x0 = FFMAX(in->x - pthis->x, 0);
+  int y0 = FFMAX(in->y - pthis->y, 0);
+  int x1 = FFMIN(in->x + in->width - pthis->x, pthis->width);
+  int y1 = FFMIN(in->y + in->height - pthis->y, pthis->height);
+  if (x1 <= x0 || y1 <= y0) {
+    return 0;
+  }
+  x0 &= ~mask;
+  y0 &= ~mask;
+  x1 = FFMIN((x1 + mask) & ~mask, pthis->width);
+  y1 = FFMIN((y1 + mask) & ~mask, pthis->height);
+  out->x = x0;
+  out->y = y0;
+  out->width = x1 - x0;
+  out->height = y1 - y0;
+  return 1;
+}
+
+// Replaces the damage list with its bounding box. Used when the list
+// overflows or its rectangles overlap enough to outweigh a single grab.
+static void _collapse_damage(struct x11_frame_meta_s* meta) {
+  if (meta->nb_damage_rects < 2) {
+    return;
+  }
+  struct x11_rect_s* rects = meta->damage_rects;
+  int x0 = rects[0].x, y0 = rects[0].y;
+  int x1 = x0 + rects[0].width, y1 = y0 + rects[0].height;
+  for (int i = 1; i < meta->nb_damage_rects; i++) {
+    x0 = FFMIN(x0, rects[i].x);
+    y0 = FFMIN(y0, rects[i].y);
+    x1 = FFMAX(x1, rects[i].x + rects[i].width);
+    y1 = FFMAX(y1, rects[i].y + rects[i].height);
+  }
+  rects[0].x = x0;
+  rects[0].y = y0;
+  rects[0].width = x1 - x0;
+  rects[0].height = y1 - y0;
+  meta->nb_damage_rects = 1;
+}
+
+static int64_t _damage_area(const struct x11_frame_meta_s* meta) {
+  int64_t area = 0;
+  for (int i = 0; i < meta->nb_damage_rects; i++) {
+    area += (int64_t)meta->damage_rects[i].width *
+    meta->damage_rects[i].height;
+  }
+  return area;
+}
+
+// Moves accumulated damage into our region and reads it back.
+static int _fetch_damage(struct x11_s* pthis, struct x11_frame_meta_s* meta) {
+  xcb_connection_t* conn = pthis->connection;
+
+  meta->nb_damage_rects = 0;
+  if (!pthis->canvas_valid) {
+    _full_frame_meta(pthis, meta);
+    xcb_damage_subtract(conn, pthis->damage, XCB_NONE, XCB_NONE);
+    return 0;
+  }
+
+  xcb_damage_subtract(conn, pthis->damage, XCB_NONE, pthis->damage_region);
+  xcb_generic_error_t* error = NULL;
+  xcb_xfixes_fetch_region_reply_t* reply =
+  xcb_xfixes_fetch_region_reply(conn,
+                                xcb_xfixes_fetch_region(conn,
+                                                        pthis->damage_region),
+                                &error);
+  if (error) {
+    printf("x11_video_source: xcb_xfixes_fetch_region failed (error %d)\n",
+           error->error_code);
+    free(error);
+    free(reply);
+    return AVERROR(EIO);
+  }
+
+  const xcb_rectangle_t* rects = xcb_xfixes_fetch_region_rectangles(reply);
+  int nb_rects = xcb_xfixes_fetch_region_rectangles_length(reply);
+  for (int i = 0; i < nb_rects; i++) {
+    if (meta->nb_damage_rects == X11_MAX_DAMAGE_RECTS) {
+      _collapse_damage(meta);
+    }
+    struct x11_rect_s* rect = &meta->damage_rects[meta->nb_damage_rects];
+    if (_clip_rect(pthis, &rects[i], rect)) {
+      meta->nb_damage_rects++;
+    }
+  }
+  free(reply);
+
+  // Even snapping can make neighbours overlap, and a collapse midway leaves
+  // its bounding box on top of the rectangles after it. Packed back to back
+  // they have to fit a segment, which holds one full frame.
+  if (_damage_area(meta) > (int64_t)pthis->width * pthis->height) {
+    _collapse_damage(meta);
+  }
+  return 0;
+}
+
+// Fetches the damaged rectangles, packed back to back into one segment, in
+// one batch of requests. Fills in where each rectangle's pixels start.
+static int _fetch_damage_pixels(struct x11_s* pthis,
+                                const struct x11_frame_meta_s* meta,
+                                const uint8_t* pixels[], int linesizes[])
+{
+  xcb_connection_t* conn = pthis->connection;
+  xcb_shm_get_image_cookie_t cookies[X11_MAX_DAMAGE_RECTS];
+  struct x11_shm_segment_s* segment = &pthis->segments[pthis->next_segment];
+  if ((size_t)_damage_area(meta) * 4 > segment->size) {
+    printf("x11_video_source: %lld damaged pixels overflow a %zu byte "
+           "segment\n", _damage_area(meta), segment->size);
+    return AVERROR(EINVAL);
+  }
+  pthis->next_segment = (pthis->next_segment + 1) % X11_SHM_SEGMENT_COUNT;
+  size_t offset = 0;
+  for (int i = 0; i < meta->nb_damage_rects; i++) {
+    const struct x11_rect_s* rect = &meta->damage_rects[i];
+    pixels[i] = segment->data + offset;
+    linesizes[i] = rect->width * 4;
+    cookies[i] = xcb_shm_get_image(conn, pthis->drawable,
+                                   pthis->x + rect->x, pthis->y + rect->y,
+                                   rect->width, rect->height,
+                                   ~0, XCB_IMAGE_FORMAT_Z_PIXMAP,
+                                   segment->seg, offset);
+    offset += (size_t)rect->width * 4 * rect->height;
+  }
+  int ret = 0;
+  for (int i = 0; i < meta->nb_damage_rects; i++) {
+    xcb_generic_error_t* error = NULL;
+    free(xcb_shm_get_image_reply(conn, cookies[i], &error));
+    if (error) {
+      printf("x11_video_source: xcb_shm_get_image failed (error %d)\n",
+             error->error_code);
+      free(error);
+      ret = AVERROR(EIO);
+    }
+  }
+  return ret;
+}
+
+// Grabs only the damaged rectangles, converts them into the canvas and
+// publishes a copy of the canvas. With Xvfb's framebuffer the rectangles are
+// read straight out of the mapping.
+static int _grab_damage_rects(struct x11_s* pthis,
+                              struct x11_frame_meta_s* meta,
+                              AVFrame** frame_out, int64_t* convert_start)
+{
+  const uint8_t* pixels[X11_MAX_DAMAGE_RECTS];
+  int linesizes[X11_MAX_DAMAGE_RECTS];
+  int ret = _fetch_damage(pthis, meta);
+  if (ret) {
+    *convert_start = av_gettime_relative();
+    return ret;
+  }
+  if (!meta->nb_damage_rects && pthis->last_frame->buf[0] &&
+      !pthis->cursor_changed)
+  {
+    *convert_start = av_gettime_relative();
+    return _publish_duplicate(pthis, meta, frame_out);
+  }
+
+  if (pthis->framebuffer) {
+    for (int i = 0; i < meta->nb_damage_rects; i++) {
+      const struct x11_rect_s* rect = &meta->damage_rects[i];
+      pixels[i] = pthis->fb_pixels + (int64_t)rect->y * pthis->linesize +
+      rect->x * 4;
+      linesizes[i] = pthis->linesize;
+    }
+  } else {
+    ret = _fetch_damage_pixels(pthis, meta, pixels, linesizes);
+  }
+  *convert_start = av_gettime_relative();
+  if (ret) {
+    return ret;
+  }
+
+  AVFrame* canvas = pthis->canvas;
+  for (int i = 0; i < meta->nb_damage_rects; i++) {
+    const struct x11_rect_s* rect = &meta->damage_rects[i];
+    int shift = pthis->scale_mode == X11_SCALE_HALF ? 1 : 0;
+    int x = rect->x >> shift, y = rect->y >> shift;
+    uint8_t* dst[3] = {
+      canvas->data[0] + y * canvas->linesize[0] + x,
+      canvas->data[1] + (y / 2) * canvas->linesize[1] + x / 2,
+      canvas->data[2] + (y / 2) * canvas->linesize[2] + x / 2
+    };
+    if (shift) {
+      color_convert_bgra_to_i420_half(pixels[i],
+                                      linesizes[i], dst, canvas->linesize,
+                                      rect->width >> 1, rect->height >> 1,
+                                      pthis->matrix);
+    } else {
+      color_convert_bgra_to_i420(pixels[i], linesizes[i],
+                                 dst, canvas->linesize,
+                                 rect->width, rect->height, pthis->matrix);
+    }
+  }
+  pthis->canvas_valid = 1;
+
+  // The canvas keeps changing under us, so downstream gets its own copy.
+  AVFrame* frame;
+  ret = frame_pool_get_video(pthis->frame_pool, canvas->width, canvas->height,
+                             (enum AVPixelFormat)canvas->format, &frame);
+  if (ret) {
+    return ret;
+  }
+  frame->colorspace = canvas->colorspace;
+  frame->color_range = canvas->color_range;
+  ret = av_frame_copy(frame, canvas);
+  if (ret) {
+    av_frame_free(&frame);
+    return ret;
+  }
+  *frame_out = frame;
+  return 0;
+}
+
+static int _grab_damage(struct x11_s* pthis, struct x11_frame_meta_s* meta,
+                        AVFrame** frame_out, int64_t* convert_start)
+{
+  int ret = _grab_damage_rects(pthis, meta, frame_out, convert_start);
+  if (ret) {
+    // The server already subtracted this damage, so nothing will report it
+    // again: start over from a full grab.
+    pthis->canvas_valid = 0;
+  }
+  return ret;
+}
+
+// Drains the event queue. DamageNotify only tells us the region went
+// non-empty, so damage is polled instead; we act on cursor shape changes and
+// on the captured window or the screen changing size.
+static void _poll_events(struct x11_s* pthis) {
+  xcb_generic_event_t* event;
+  while ((event = xcb_poll_for_event(pthis->connection))) {
+    uint8_t type = event->response_type & 0x7f;
+    if (pthis->cursor && x11_cursor_handle_event(pthis->cursor, event)) {
+      free(event);
+      continue;
+    }
+    if (type == XCB_CONFIGURE_NOTIFY && pthis->window) {
+      xcb_configure_notify_event_t* configure =
+      (xcb_configure_notify_event_t*)event;
+      if (configure->window == pthis->window &&
+          (configure->width != pthis->window_width ||
+           configure->height != pthis->window_height))
+      {
+        pthis->window_width = configure->width;
+        pthis->window_height = configure->height;
+        pthis->window_changed = 1;
+      }
+    } else if (type == XCB_MAP_NOTIFY && pthis->window) {
+      pthis->window_changed = 1;
+    } else if (pthis->randr_first_event &&
+               type == pthis->randr_first_event +
+               XCB_RANDR_SCREEN_CHANGE_NOTIFY)
+    {
+      pthis->screen_changed = 1;
+    }
+    free(event);
+  }
+}
+
+// Reports the cursor's old and new spots as damage, snapped like the rest.
+static void _add_cursor_damage(struct x11_s* pthis,
+                               struct x11_frame_meta_s* meta)
+{
+  struct x11_rect_s rects[2];
+  int nb_rects = x11_cursor_get_rects(pthis->cursor, rects);
+  for (int i = 0; i < nb_rects; i++) {
+    int x0 = FFMAX(rects[i].x, 0) & ~1;
+    int y0 = FFMAX(rects[i].y, 0) & ~1;
+    int x1 = FFMIN(rects[i].x + rects[i].width, pthis->out_width);
+    int y1 = FFMIN(rects[i].y + rects[i].height, pthis->out_height);
+    x1 = FFMIN((x1 + 1) & ~1, pthis->out_width);
+    y1 = FFMIN((y1 + 1) & ~1, pthis->out_height);
+    if (x1 <= x0 || y1 <= y0) {
+      continue;
+    }
+    if (meta->nb_damage_rects == X11_MAX_DAMAGE_RECTS) {
+      _collapse_damage(meta);
+    }
+    struct x11_rect_s* rect = &meta->damage_rects[meta->nb_damage_rects++];
+    rect->x = x0;
+    rect->y = y0;
+    rect->width = x1 - x0;
+    rect->height = y1 - y0;
+  }
+}
+
+static xcb_atom_t _intern_atom(xcb_connection_t* conn, const char* name) {
+  xcb_intern_atom_reply_t* reply =
+  xcb_intern_atom_reply(conn, xcb_intern_atom(conn, 1, strlen(name), name),
+                        NULL);
+  xcb_atom_t atom = reply ? reply->atom : XCB_ATOM_NONE;
+  free(reply);
+  return atom;
+}
+
+// Whether a viewable window's _NET_WM_NAME or WM_NAME contains name.
+static char _window_title_matches(struct x11_s* pthis, xcb_window_t window,
+                                  xcb_atom_t net_wm_name, const char* name)
+{
+  xcb_connection_t* conn = pthis->connection;
+  xcb_atom_t properties[2] = { net_wm_name, XCB_ATOM_WM_NAME };
+  char matches = 0;
+  for (int i = 0; i < 2 && !matches; i++) {
+    if (properties[i] == XCB_ATOM_NONE) {
+      continue;
+    }
+    xcb_get_property_reply_t* reply =
+    xcb_get_property_reply(conn,
+                           xcb_get_property(conn, 0, window, properties[i],
+                                            XCB_GET_PROPERTY_TYPE_ANY,
+                                            0, 1024),
+                           NULL);
+    int length = reply ? xcb_get_property_value_length(reply) : 0;
+    if (length > 0 && reply->format == 8) {
+      char* title = av_strndup((const char*)xcb_get_property_value(reply),
+                               length);
+      matches = title && strstr(title, name);
+      av_free(title);
+    }
+    free(reply);
+  }
+  if (!matches) {
+    return 0;
+  }
+  xcb_get_window_attributes_reply_t* attributes =
+  xcb_get_window_attributes_reply(conn,
+                                  xcb_get_window_attributes(conn, window),
+                                  NULL);
+  matches = attributes && attributes->map_state == XCB_MAP_STATE_VIEWABLE;
+  free(attributes);
+  return matches;
+}
+
+// Depth first search below parent for a window whose title contains name,
+// topmost windows first. Titles usually sit on the client window, which a
+// window manager nests inside its frame, so the whole tree is searched.
+static xcb_window_t _find_window_by_name(struct x11_s* pthis,
+                                         xcb_window_t parent,
+                                         xcb_atom_t net_wm_name,
+                                         const char* name)
+{
+  xcb_connection_t* conn = pthis->connection;
+  xcb_query_tree_reply_t* tree =
+  xcb_query_tree_reply(conn, xcb_query_tree(conn, parent), NULL);
+  if (!tree) {
+    return XCB_NONE;
+  }
+  xcb_window_t* children = xcb_query_tree_children(tree);
+  xcb_window_t found = XCB_NONE;
+  // children are listed bottom to top
+  for (int i = xcb_query_tree_children_length(tree) - 1;
+       i >= 0 && found == XCB_NONE; i--)
+  {
+    if (_window_title_matches(pthis, children[i], net_wm_name, name)) {
+      found = children[i];
+    } else {
+      found = _find_window_by_name(pthis, children[i], net_wm_name, name);
+    }
+  }
+  free(tree);
+  return found;
+}
+
+// XComposite keeps a redirected window's contents in a pixmap, obscured or
+// not, and replaces that pixmap whenever the window is resized or remapped.
+// The old pixmap is kept until a new one is named, but is not grabbed from
+// meanwhile: the drawable is XCB_NONE and the last picture is repeated.
+static int _name_window_pixmap(struct x11_s* pthis) {
+  xcb_connection_t* conn = pthis->connection;
+  xcb_pixmap_t pixmap = xcb_generate_id(conn);
+  xcb_generic_error_t* error =
+  xcb_request_check(conn,
+                    xcb_composite_name_window_pixmap_checked
+                    (conn, pthis->window, pixmap));
+  if (error) {
+    // usually unmapped; MapNotify brings us back here
+    printf("x11_video_source: cannot get the pixmap of window 0x%x "
+           "(error %d)\n", pthis->window, error->error_code);
+    free(error);
+    pthis->drawable = XCB_NONE;
+    return AVERROR(EIO);
+  }
+  if (pthis->window_pixmap) {
+    xcb_free_pixmap(conn, pthis->window_pixmap);
+  }
+  if (pthis->drawable == XCB_NONE) {
+    // back from a gap; nothing grabbed before it still holds
+    pthis->last_segment = NULL;
+    pthis->canvas_valid = 0;
+  }
+  pthis->window_pixmap = pixmap;
+  pthis->drawable = pixmap;
+  return 0;
+}
+
+// Finds the window to capture, redirects it offscreen and starts following
+// its geometry.
+static int _window_init(struct x11_s* pthis,
+                        struct x11_grab_config_s* config)
+{
+  xcb_connection_t* conn = pthis->connection;
+  const xcb_query_extension_reply_t* composite_ext =
+  xcb_get_extension_data(conn, &xcb_composite_id);
+  if (!composite_ext || !composite_ext->present) {
+    printf("x11_start: display does not support XComposite\n");
+    return AVERROR(ENOSYS);
+  }
+  // NameWindowPixmap needs 0.2, and the server wants to hear our version
+  xcb_composite_query_version_reply_t* version =
+  xcb_composite_query_version_reply(conn,
+                                    xcb_composite_query_version(conn, 0, 2),
+                                    NULL);
+  char version_ok = version &&
+  (version->major_version > 0 || version->minor_version >= 2);
+  free(version);
+  if (!version_ok) {
+    printf("x11_start: XComposite 0.2 is required\n");
+    return AVERROR(ENOSYS);
+  }
+
+  pthis->window = config->window_id;
+  if (!pthis->window) {
+    pthis->window =
+    _find_window_by_name(pthis, pthis->screen->root,
+                         _intern_atom(conn, "_NET_WM_NAME"),
+                         config->window_name);
+    if (!pthis->window) {
+      printf("x11_start: no viewable window titled \"%s\"\n",
+             config->window_name);
+      return AVERROR(EINVAL);
+    }
+  }
+  xcb_get_geometry_reply_t* geometry =
+  xcb_get_geometry_reply(conn, xcb_get_geometry(conn, pthis->window), NULL);
+  if (!geometry) {
+    printf("x11_start: no window 0x%x\n", pthis->window);
+    return AVERROR(EINVAL);
+  }
+  pthis->window_depth = geometry->depth;
+  pthis->window_width = geometry->width;
+  pthis->window_height = geometry->height;
+  free(geometry);
+
+  xcb_composite_redirect_window(conn, pthis->window,
+                                XCB_COMPOSITE_REDIRECT_AUTOMATIC);
+  uint32_t event_mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+  xcb_change_window_attributes(conn, pthis->window, XCB_CW_EVENT_MASK,
+                               &event_mask);
+  printf("x11_start: capturing window 0x%x (%dx%d) through XComposite\n",
+         pthis->window, pthis->window_width, pthis->window_height);
+  return _name_window_pixmap(pthis);
+}
+
+// Windows can be any size, but I420 wants even dimensions: drop the odd
+// last row or column rather than scale.
+static void _window_capture_size(struct x11_s* pthis,
+                                 int* width_out, int* height_out)
+{
+  *width_out = FFMAX(pthis->window_width & ~1, 2);
+  *height_out = FFMAX(pthis->window_height & ~1, 2);
+}
+
+// Follows the captured window through resizes and remaps. The output is
+// scaled or resized to match as follow_resize says.
+static void _window_refresh(struct x11_s* pthis) {
+  int width, height;
+  pthis->window_changed = 0;
+  _window_capture_size(pthis, &width, &height);
+  if (width != pthis->width || height != pthis->height) {
+    printf("x11_video_source: window resized to %dx%d\n", width, height);
+    if (_set_geometry(pthis, width, height)) {
+      return;
+    }
+  }
+  _name_window_pixmap(pthis);
+}
+
+// Asks XRandR to report screen size changes. Without the extension the
+// screen keeps its size and there is nothing to follow.
+static void _randr_init(struct x11_s* pthis) {
+  xcb_connection_t* conn = pthis->connection;
+  const xcb_query_extension_reply_t* randr_ext =
+  xcb_get_extension_data(conn, &xcb_randr_id);
+  if (!randr_ext || !randr_ext->present) {
+    printf("x11_start: display does not support XRandR; screen resizes "
+           "will not be followed\n");
+    return;
+  }
+  free(xcb_randr_query_version_reply
+       (conn, xcb_randr_query_version(conn, XCB_RANDR_MAJOR_VERSION,
+                                      XCB_RANDR_MINOR_VERSION), NULL));
+  xcb_randr_select_input(conn, pthis->screen->root,
+                         XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE);
+  pthis->randr_first_event = randr_ext->first_event;
+}
+
+// Follows the screen through XRandR size changes. The capture rectangle
+// keeps its offset and requested size, clipped to the new screen. A screen
+// too small to hold the offset at all pauses grabbing until it grows back;
+// the last picture is repeated meanwhile.
+static void _screen_refresh(struct x11_s* pthis) {
+  xcb_connection_t* conn = pthis->connection;
+  pthis->screen_changed = 0;
+  // the event's size is pre-rotation; the root's geometry is what we grab
+  xcb_get_geometry_reply_t* geometry =
+  xcb_get_geometry_reply(conn, xcb_get_geometry(conn, pthis->screen->root),
+                         NULL);
+  if (!geometry) {
+    return;
+  }
+  int screen_width = geometry->width;
+  int screen_height = geometry->height;
+  free(geometry);
+  if (pthis->x + 2 > screen_width || pthis->y + 2 > screen_height) {
+    printf("x11_video_source: the %dx%d screen no longer contains the "
+           "capture offset %d,%d; pausing capture\n",
+           screen_width, screen_height, pthis->x, pthis->y);
+    pthis->screen_paused = 1;
+    return;
+  }
+  if (pthis->screen_paused) {
+    printf("x11_video_source: the capture offset is back on the %dx%d "
+           "screen; resuming\n", screen_width, screen_height);
+    pthis->screen_paused = 0;
+    // whatever was grabbed before the pause is stale
+    pthis->last_segment = NULL;
+    pthis->canvas_valid = 0;
+  }
+  int width = pthis->requested_width ?
+  pthis->requested_width : screen_width - pthis->x;
+  int height = pthis->requested_height ?
+  pthis->requested_height : screen_height - pthis->y;
+  width = FFMIN(width, screen_width - pthis->x);
+  height = FFMIN(height, screen_height - pthis->y);
+  if (width == pthis->width && height == pthis->height) {
+    return;
+  }
+  printf("x11_video_source: screen resized to %dx%d, capturing %dx%d\n",
+         screen_width, screen_height, width, height);
+  _set_geometry(pthis, width, height);
+}
+
 void x11grab_main(void* p) {
   int ret;
-  AVFrame* frame = NULL;
   struct x11_s* pthis = (struct x11_s*)p;
   while (!pthis->interrupted) {
-    ret = _read_frame(pthis, &frame);
-    if (ret || !frame) {
-      continue;
+    int64_t deadline = _wait_next_frame(pthis);
+    AVFrame* frame = NULL;
+    struct x11_frame_meta_s meta;
+    meta.is_duplicate = 0;
+    int64_t capture_start = av_gettime_relative();
+    int64_t convert_start;
+    int64_t pts = deadline;
+    _poll_events(pthis);
+    if (pthis->window_changed) {
+      _window_refresh(pthis);
+    }
+    if (pthis->screen_changed) {
+      _screen_refresh(pthis);
+    }
+    if (pthis->screen_paused || pthis->drawable == XCB_NONE) {
+      // Every grab would fail until the screen grows back or the window is
+      // mapped again. Repeat the last picture meanwhile, so the rate holds
+      // and the muxer keeps releasing audio behind the video head.
+      if (!pthis->last_frame->buf[0]) {
+        continue;
+      }
+      convert_start = av_gettime_relative();
+      ret = _publish_duplicate(pthis, &meta, &frame);
+    } else {
+      if (pthis->cursor) {
+        pthis->cursor_changed = x11_cursor_update(pthis->cursor);
+      }
+      // a resize can leave the window needing swscale, which damage can't
+      // use
+      if (pthis->use_damage && pthis->scale_mode != X11_SCALE_SWS) {
+        ret = _grab_damage(pthis, &meta, &frame, &convert_start);
+      } else {
+        ret = _grab_full(pthis, &meta, &frame, &convert_start);
+      }
     }
+    int64_t convert_end = av_gettime_relative();
     if (!ret) {
-      frame = _convert_frame(pthis, frame);
-      uv_mutex_lock(&pthis->queue_lock);
-      pthis->queue.push(frame);
-      uv_mutex_unlock(&pthis->queue_lock);
-      frame = NULL;
+      _meta_to_output(pthis, &meta);
+      if (pthis->cursor && !meta.is_duplicate) {
+        x11_cursor_blend(pthis->cursor, frame);
+        if (pthis->use_damage) {
+          _add_cursor_damage(pthis, &meta);
+        }
+      }
+      ret = _attach_meta(frame, &meta);
+    }
+    if (ret) {
+      av_frame_free(&frame);
+      continue;
+    }
+    frame->pts = pts;
+    if (!meta.is_duplicate) {
+      av_frame_unref(pthis->last_frame);
+      av_frame_ref(pthis->last_frame, frame);
+    }
+
+    uv_mutex_lock(&pthis->stats_lock);
+    pthis->stats.frames_captured++;
+    pthis->stats.frames_duplicate += meta.is_duplicate;
+    pthis->stats.last_capture_time_us = convert_start - capture_start;
+    pthis->stats.last_convert_time_us = convert_end - convert_start;
+    pthis->stats.capture_time_us += pthis->stats.last_capture_time_us;
+    pthis->stats.convert_time_us += pthis->stats.last_convert_time_us;
+    frame_pool_get_stats(pthis->frame_pool, &pthis->stats.frame_pool);
+    uv_mutex_unlock(&pthis->stats_lock);
+
+    printf("x11_video_source: extracted %lld (diff %lld) "
+           "capture=%lldus convert=%lldus damage_rects=%d%s\n",
+           frame->pts, frame->pts - pthis->last_pts_read,
+           convert_start - capture_start, convert_end - convert_start,
+           meta.nb_damage_rects, meta.is_duplicate ? " (duplicate)" : "");
+    pthis->last_pts_read = frame->pts;
+
+    if (!frame_ring_push(pthis->queue, frame) && pthis->on_video_data) {
+      pthis->on_video_data(pthis, pthis->video_data_cb_p);
     }
   }
 }
 
 int x11_start(struct x11_s* pthis, struct x11_grab_config_s* config) {
-  int ret;
-  pthis->input_format = av_find_input_format("x11grab");
-  if (!pthis->input_format) {
-    printf("x11_start: x11grab input device not found\n");
-    return -1;
-  }
-  AVDictionary *opts = NULL;
-  av_dict_set(&opts, "video_size", "2560x1440", 0);
-  av_dict_set(&opts, "draw_mouse", "0", 0);
-  av_dict_set(&opts, "framerate", "ntsc", 0);
-  ret = avformat_open_input(&pthis->format_context, config->device_name,
-                            pthis->input_format, &opts);
-  av_dict_free(&opts);
+  int ret, screen_num = 0;
+  pthis->connection = xcb_connect(config->device_name, &screen_num);
+  if (xcb_connection_has_error(pthis->connection)) {
+    printf("x11_start: cannot connect to display %s\n", config->device_name);
+    return AVERROR(EIO);
+  }
 
+  const xcb_setup_t* setup = xcb_get_setup(pthis->connection);
+  xcb_screen_iterator_t it = xcb_setup_roots_iterator(setup);
+  for (int i = 0; i < screen_num && it.rem; i++) {
+    xcb_screen_next(&it);
+  }
+  pthis->screen = it.data;
+  if (!pthis->screen) {
+    printf("x11_start: no screen %d on display %s\n",
+           screen_num, config->device_name);
+    return AVERROR(EINVAL);
+  }
+
+  int screen_width = pthis->screen->width_in_pixels;
+  int screen_height = pthis->screen->height_in_pixels;
+  uint8_t depth = pthis->screen->root_depth;
+  pthis->drawable = pthis->screen->root;
+  if (config->window_id || config->window_name) {
+    if (config->fbdir) {
+      printf("x11_start: window capture cannot use the Xvfb framebuffer\n");
+      return AVERROR(EINVAL);
+    }
+    if (config->x || config->y || config->width || config->height) {
+      printf("x11_start: capturing the whole window; ignoring the capture "
+             "rectangle\n");
+    }
+    ret = _window_init(pthis, config);
+    if (ret) {
+      return ret;
+    }
+    depth = pthis->window_depth;
+  }
+
+  struct xvfb_framebuffer_info_s fb_info = { 0 };
+  if (config->fbdir) {
+    // The connection stays for damage and the cursor; pixels come from the
+    // mapping.
+    ret = xvfb_framebuffer_open(&pthis->framebuffer, config->fbdir,
+                                screen_num);
+    if (ret) {
+      return ret;
+    }
+    xvfb_framebuffer_get_info(pthis->framebuffer, &fb_info);
+    pthis->pix_fmt = fb_info.pix_fmt;
+    if (config->draw_cursor) {
+      // Xvfb has no hardware cursor and paints the sprite into the
+      // framebuffer itself; blending ours on top would show it twice.
+      printf("x11_start: Xvfb draws the pointer into its framebuffer; not "
+             "compositing it again\n");
+    }
+    screen_width = FFMIN(screen_width, fb_info.width);
+    screen_height = FFMIN(screen_height, fb_info.height);
+  } else {
+    const xcb_query_extension_reply_t* shm_ext =
+    xcb_get_extension_data(pthis->connection, &xcb_shm_id);
+    if (!shm_ext || !shm_ext->present) {
+      printf("x11_start: display does not support MIT-SHM\n");
+      return AVERROR(ENOSYS);
+    }
+    ret = _find_pix_fmt(pthis, depth);
+    if (ret) {
+      return ret;
+    }
+  }
+  int width, height;
+  if (pthis->window) {
+    pthis->x = 0;
+    pthis->y = 0;
+    _window_capture_size(pthis, &width, &height);
+  } else if (config->x < 0 || config->y < 0 ||
+             config->x >= screen_width || config->y >= screen_height)
+  {
+    printf("x11_start: capture offset %d,%d is outside the %dx%d screen\n",
+           config->x, config->y, screen_width, screen_height);
+    return AVERROR(EINVAL);
+  } else {
+    pthis->x = config->x;
+    pthis->y = config->y;
+    width = config->width ? config->width : screen_width - pthis->x;
+    height = config->height ? config->height : screen_height - pthis->y;
+    width = FFMIN(width, screen_width - pthis->x);
+    height = FFMIN(height, screen_height - pthis->y);
+  }
+  if (pthis->framebuffer) {
+    pthis->linesize = fb_info.linesize;
+    pthis->fb_pixels = fb_info.pixels + (int64_t)pthis->y * fb_info.linesize +
+    pthis->x * 4;
+  }
+
+  pthis->out_width = config->output_width ? config->output_width : width;
+  pthis->out_height = config->output_height ? config->output_height : height;
+  ret = _set_geometry(pthis, width, height);
   if (ret) {
-    printf("failed to open input %s\n", pthis->input_format->name);
     return ret;
   }
+  pthis->follow_resize = config->follow_resize;
+  pthis->requested_width = config->width;
+  pthis->requested_height = config->height;
+  pthis->start_width = width;
+  pthis->start_height = height;
+  pthis->start_out_width = pthis->out_width;
+  pthis->start_out_height = pthis->out_height;
+  // Xvfb's framebuffer file keeps the size the server started with
+  if (!pthis->window && !pthis->framebuffer) {
+    _randr_init(pthis);
+  }
 
-  ret = avformat_find_stream_info(pthis->format_context, NULL);
-  if (ret < 0) {
-    printf("Could not find stream information\n");
-    return ret;
+  if (config->colorspace == AVCOL_SPC_BT709) {
+    pthis->colorspace = AVCOL_SPC_BT709;
+    pthis->matrix = COLOR_CONVERT_BT709;
+  } else {
+    pthis->colorspace = AVCOL_SPC_SMPTE170M;
+    pthis->matrix = COLOR_CONVERT_BT601;
   }
-  
-  ret = av_find_best_stream(pthis->format_context,
-                            AVMEDIA_TYPE_VIDEO,
-                            -1, -1,
-                            &pthis->codec, 0);
-  if (ret < 0) {
-    av_log(NULL, AV_LOG_ERROR,
-           "Cannot find a video stream in the input file\n");
-    return ret;
+
+  pthis->use_damage = config->use_damage;
+  if (pthis->use_damage && pthis->scale_mode == X11_SCALE_SWS) {
+    // Scaled rectangles would not line up with the rest of the canvas.
+    printf("x11_start: damage tracking needs an unscaled or half size "
+           "output; grabbing full frames\n");
+    pthis->use_damage = 0;
   }
-  pthis->stream_index = ret;
-  pthis->stream = pthis->format_context->streams[pthis->stream_index];
-  pthis->codec = avcodec_find_decoder(pthis->stream->codecpar->codec_id);
-  if (!pthis->codec) {
-    printf("Failed to find audio codec\n");
-    return AVERROR(EINVAL);
+  if (pthis->use_damage) {
+    ret = _damage_init(pthis);
+    if (ret) {
+      return ret;
+    }
+  }
+
+  if (config->draw_cursor && !pthis->framebuffer) {
+    ret = _xfixes_init(pthis);
+    if (!ret) {
+      struct x11_cursor_config_s cursor_config;
+      cursor_config.connection = pthis->connection;
+      cursor_config.root = pthis->screen->root;
+      cursor_config.window =
+      pthis->window ? pthis->window : pthis->screen->root;
+      cursor_config.x = pthis->x;
+      cursor_config.y = pthis->y;
+      cursor_config.width = pthis->width;
+      cursor_config.height = pthis->height;
+      cursor_config.out_width = pthis->out_width;
+      cursor_config.out_height = pthis->out_height;
+      cursor_config.matrix = pthis->matrix;
+      x11_cursor_alloc(&pthis->cursor);
+      ret = x11_cursor_start(pthis->cursor, &cursor_config);
+    }
+    if (ret) {
+      // a recording without a pointer beats no recording
+      printf("x11_start: cannot track the cursor; recording without it\n");
+      x11_cursor_free(pthis->cursor);
+      pthis->cursor = NULL;
+    }
   }
-  
-  // Allocate a codec context for the decoder
-  pthis->codec_context = avcodec_alloc_context3(pthis->codec);
-  
-  ret = avcodec_parameters_to_context(pthis->codec_context,
-                                      pthis->stream->codecpar);
-  if (ret < 0) {
-    printf("Failed to copy stream codec parameters to codec context\n");
+
+  int nb_threads = config->convert_threads;
+  if (nb_threads <= 0) {
+    nb_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  nb_threads = av_clip(nb_threads, 1, X11_MAX_CONVERT_BANDS);
+  ret = worker_pool_alloc(&pthis->convert_pool, nb_threads);
+  if (ret) {
     return ret;
   }
-  
-  av_opt_set_int(pthis->codec_context, "refcounted_frames", 1, 0);
-  
-  /* init the decoder */
-  ret = avcodec_open2(pthis->codec_context, pthis->codec, NULL);
-  if (ret < 0) {
-    av_log(NULL, AV_LOG_ERROR, "x11_open: cannot open video decoder\n");
+  pthis->nb_bands = worker_pool_get_size(pthis->convert_pool);
+
+  ret = frame_ring_alloc(&pthis->queue,
+                         config->queue_capacity ?
+                         config->queue_capacity : default_queue_capacity,
+                         config->overflow_policy);
+  if (ret) {
+    return AVERROR(ret);
+  }
+
+  pthis->on_video_data = config->on_video_data;
+  pthis->video_data_cb_p = config->video_data_cb_p;
+
+  pthis->time_base = av_make_q(1, MEDIA_CLOCK_NS_PER_SEC);
+  pthis->framerate = config->framerate.num > 0 && config->framerate.den > 0 ?
+  config->framerate : default_framerate;
+  pthis->tick_origin_ns = 0;
+  ret = sample_window_alloc(&pthis->jitter, jitter_window_size);
+  if (ret) {
+    return AVERROR(ret);
   }
-  
+  printf("x11_start: capturing %dx%d+%d+%d at %d/%d fps "
+         "from %s via %s%s%s, "
+         "output %dx%d, %s conversion on %d threads\n",
+         pthis->width, pthis->height, pthis->x, pthis->y,
+         pthis->framerate.num, pthis->framerate.den, config->device_name,
+         pthis->framebuffer ? "the Xvfb framebuffer" : "MIT-SHM",
+         pthis->use_damage ? " (damage tracking)" : "",
+         pthis->cursor ? " with cursor" : "",
+         pthis->out_width, pthis->out_height,
+         pthis->scale_mode == X11_SCALE_SWS ?
+         "swscale" : color_convert_kernel_name(), pthis->nb_bands);
+
   pthis->interrupted = 0;
   return uv_thread_create(&pthis->worker_thread, x11grab_main, pthis);
 }
 
 int x11_stop(struct x11_s* pthis) {
   pthis->interrupted = 1;
+  frame_ring_abort(pthis->queue);
   return uv_thread_join(&pthis->worker_thread);
 }
 
 char x11_has_next(struct x11_s* pthis) {
-  char ret = 0;
-  uv_mutex_lock(&pthis->queue_lock);
-  ret = pthis->queue.size() > 0;
-  uv_mutex_unlock(&pthis->queue_lock);
-  return ret;
+  return frame_ring_has_next(pthis->queue);
 }
 
 int x11_get_next(struct x11_s* pthis, AVFrame** frame_out) {
-  AVFrame* frame = NULL;
-  int ret;
-  uv_mutex_lock(&pthis->queue_lock);
-  if (pthis->queue.empty()) {
-    ret = EAGAIN;
-  } else {
-    frame = pthis->queue.front();
-    pthis->queue.pop();
-    ret = 0;
-  }
-  uv_mutex_unlock(&pthis->queue_lock);
-  *frame_out = frame;
-  return ret;
-}
-
-double x11_get_initial_ts(struct x11_s* pthis) {
-  return (double)pthis->stream->start_time /
-  (double)pthis->stream->time_base.den;
+  return frame_ring_pop(pthis->queue, frame_out);
 }
 
 int64_t x11_get_head_ts(struct x11_s* pthis) {
   int64_t ret;
-  uv_mutex_lock(&pthis->queue_lock);
-  if (pthis->queue.empty()) {
+  if (frame_ring_peek_pts(pthis->queue, &ret)) {
     ret = EAGAIN;
-  } else {
-    AVFrame* frame = pthis->queue.front();
-    ret = frame->pts;
   }
-  uv_mutex_unlock(&pthis->queue_lock);
   return ret;
 }
 
 double x11_convert_pts(struct x11_s* pthis, int64_t pts) {
   double result = pts;
-  AVRational time_base = pthis->stream->time_base;
+  AVRational time_base = pthis->time_base;
   result *= time_base.num;
   result /= time_base.den;
   return result;
 }
+
+void x11_get_stats(struct x11_s* pthis, struct x11_stats_s* stats_out) {
+  uv_mutex_lock(&pthis->stats_lock);
+  memcpy(stats_out, &pthis->stats, sizeof(struct x11_stats_s));
+  if (pthis->jitter) {
+    stats_out->jitter_p50_us =
+    sample_window_get_percentile(pthis->jitter, 50);
+    stats_out->jitter_p95_us =
+    sample_window_get_percentile(pthis->jitter, 95);
+    stats_out->jitter_p99_us =
+    sample_window_get_percentile(pthis->jitter, 99);
+    stats_out->jitter_max_us =
+    sample_window_get_percentile(pthis->jitter, 100);
+  }
+  uv_mutex_unlock(&pthis->stats_lock);
+  if (pthis->queue) {
+    frame_ring_get_stats(pthis->queue, &stats_out->queue);
+  }
+}
+
+const struct x11_frame_meta_s* x11_frame_get_meta(const AVFrame* frame) {
+  if (!frame->opaque_ref ||
+      frame->opaque_ref->size < sizeof(struct x11_frame_meta_s))
+  {
+    return NULL;
+  }
+  return (const struct x11_frame_meta_s*)frame->opaque_ref->data;
+}
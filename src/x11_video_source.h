@@ -9,14 +9,103 @@
 #define x11_video_source_h
 
 #include <libavutil/frame.h>
+#include "frame_ring.h"
+#include "frame_pool.h"
+
+struct x11_s;
 
 struct x11_grab_config_s {
+  // notify when new data hits the queue; called on the capture thread
+  void (*on_video_data)(struct x11_s* x11, void* p);
+  void* video_data_cb_p;
   const char* device_name;
+  // Xvfb's -fbdir directory. When set, pixels are read from the mapped
+  // framebuffer there instead of through MIT-SHM requests.
+  const char* fbdir;
+  // Capture one window instead of the screen, chosen by id or else by a
+  // title substring. The window is redirected with XComposite, so it is
+  // captured even when obscured, and the capture follows its size (see
+  // follow_resize).
+  uint32_t window_id;
+  const char* window_name;
+  // Capture rectangle in screen coordinates. A zero size extends to the
+  // right/bottom edge of the screen.
+  int x;
+  int y;
   int width;
   int height;
+  // Size of the frames handed downstream. Zero keeps the capture size.
+  // Exactly half the capture size takes a fused native path; anything else
+  // goes through swscale.
+  int output_width;
+  int output_height;
+  // When the screen (XRandR) or captured window changes size, either keep
+  // the output size and scale the new capture size into it (0), or resize
+  // the output too, keeping the ratio it had to the capture at start (1).
+  // Only the latter hands downstream frames of a new size.
+  char follow_resize;
+  // Track XDamage and only grab/convert the regions that changed.
+  char use_damage;
+  // Composite the pointer (via XFixes) into each frame. Ignored with fbdir:
+  // Xvfb's framebuffer already has the pointer drawn in.
+  char draw_cursor;
+  // Capture rate. 0/0 keeps the default (ntsc, 30000/1001).
+  AVRational framerate;
+  // AVCOL_SPC_BT709 selects the BT.709 matrix; anything else means BT.601.
+  enum AVColorSpace colorspace;
+  // Threads converting each frame in bands. 0 picks one per online CPU.
+  int convert_threads;
+  // Frames waiting for the muxer. 0 picks the default capacity.
+  int queue_capacity;
+  enum frame_ring_overflow overflow_policy;
 };
 
-struct x11_s;
+#define X11_MAX_DAMAGE_RECTS 32
+
+struct x11_rect_s {
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+/**
+ * Attached to every published frame (see x11_frame_get_meta). Damage
+ * rectangles are in frame coordinates and describe what changed since the
+ * previous frame. A full grab reports one rectangle covering the frame; an
+ * unchanged screen reports none and is flagged as a duplicate, whose pixels
+ * are shared with the previous frame.
+ */
+struct x11_frame_meta_s {
+  char is_duplicate;
+  int nb_damage_rects;
+  struct x11_rect_s damage_rects[X11_MAX_DAMAGE_RECTS];
+};
+
+/**
+ * Running capture cost counters. Times are wall clock microseconds spent on
+ * the capture thread, so that backends can be compared frame for frame.
+ */
+struct x11_stats_s {
+  int64_t frames_captured;
+  // frames identical to the one before, published without converting
+  int64_t frames_duplicate;
+  int64_t capture_time_us;
+  int64_t convert_time_us;
+  int64_t last_capture_time_us;
+  int64_t last_convert_time_us;
+  // Scheduler health. A late tick started after its deadline because the
+  // previous frame overran; missed ticks were skipped outright. Jitter is
+  // how long after its deadline each tick actually woke, over recent ticks.
+  int64_t ticks_late;
+  int64_t ticks_missed;
+  int64_t jitter_p50_us;
+  int64_t jitter_p95_us;
+  int64_t jitter_p99_us;
+  int64_t jitter_max_us;
+  struct frame_ring_stats_s queue;
+  struct frame_pool_stats_s frame_pool;
+};
 
 void x11_alloc(struct x11_s** x11_out);
 void x11_free(struct x11_s* x11);
@@ -26,7 +115,12 @@ int x11_stop(struct x11_s* x11);
 
 char x11_has_next(struct x11_s* x11);
 int x11_get_next(struct x11_s* x11, AVFrame** frame_out);
+// Frame pts are on the media clock timeline (ns).
 int64_t x11_get_head_ts(struct x11_s* pthis);
 double x11_convert_pts(struct x11_s* pthis, int64_t pts);
+void x11_get_stats(struct x11_s* pthis, struct x11_stats_s* stats_out);
+
+// Returns NULL for frames that did not come from an x11 source.
+const struct x11_frame_meta_s* x11_frame_get_meta(const AVFrame* frame);
 
 #endif /* x11_video_source_h */
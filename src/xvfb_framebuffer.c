@@ -0,0 +1,166 @@
+//
+//  xvfb_framebuffer.c
+//  x11pulsemux
+//
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libavutil/error.h>
+#include <libavutil/intreadwrite.h>
+#include "xvfb_framebuffer.h"
+
+// XWDFileHeader from X11/XWDFile.h: 25 CARD32 fields, always big endian in
+// the file, followed by the window name (within header_size) and ncolors
+// 12 byte XWDColor entries. The image comes right after the colormap.
+enum xwd_field {
+  XWD_HEADER_SIZE = 0,
+  XWD_FILE_VERSION = 1,
+  XWD_PIXMAP_FORMAT = 2,
+  XWD_PIXMAP_DEPTH = 3,
+  XWD_PIXMAP_WIDTH = 4,
+  XWD_PIXMAP_HEIGHT = 5,
+  XWD_BYTE_ORDER = 7,
+  XWD_BITS_PER_PIXEL = 11,
+  XWD_BYTES_PER_LINE = 12,
+  XWD_VISUAL_CLASS = 13,
+  XWD_RED_MASK = 14,
+  XWD_GREEN_MASK = 15,
+  XWD_BLUE_MASK = 16,
+  XWD_NCOLORS = 19,
+  XWD_FIELD_COUNT = 25,
+};
+
+#define XWD_FILE_VERSION_7 7
+#define XWD_Z_PIXMAP 2
+#define XWD_LSB_FIRST 0
+#define XWD_TRUE_COLOR 4
+#define XWD_COLOR_SIZE 12
+
+struct xvfb_framebuffer_s {
+  int fd;
+  uint8_t* map;
+  size_t map_size;
+  struct xvfb_framebuffer_info_s info;
+};
+
+static uint32_t _header_field(const uint8_t* header, enum xwd_field field) {
+  return AV_RB32(header + field * 4);
+}
+
+static int _parse_header(struct xvfb_framebuffer_s* pthis, const char* path) {
+  const uint8_t* header = pthis->map;
+  if (pthis->map_size < XWD_FIELD_COUNT * 4) {
+    printf("xvfb_framebuffer: %s is too short for an XWD header\n", path);
+    return AVERROR_INVALIDDATA;
+  }
+  uint32_t header_size = _header_field(header, XWD_HEADER_SIZE);
+  uint32_t ncolors = _header_field(header, XWD_NCOLORS);
+  uint32_t width = _header_field(header, XWD_PIXMAP_WIDTH);
+  uint32_t height = _header_field(header, XWD_PIXMAP_HEIGHT);
+  uint32_t linesize = _header_field(header, XWD_BYTES_PER_LINE);
+  uint32_t bpp = _header_field(header, XWD_BITS_PER_PIXEL);
+  if (_header_field(header, XWD_FILE_VERSION) != XWD_FILE_VERSION_7 ||
+      _header_field(header, XWD_PIXMAP_FORMAT) != XWD_Z_PIXMAP ||
+      header_size < XWD_FIELD_COUNT * 4)
+  {
+    printf("xvfb_framebuffer: %s is not an XWD ZPixmap file\n", path);
+    return AVERROR_INVALIDDATA;
+  }
+  if (bpp != 32 ||
+      _header_field(header, XWD_BYTE_ORDER) != XWD_LSB_FIRST ||
+      _header_field(header, XWD_VISUAL_CLASS) != XWD_TRUE_COLOR ||
+      _header_field(header, XWD_RED_MASK) != 0xff0000 ||
+      _header_field(header, XWD_GREEN_MASK) != 0xff00 ||
+      _header_field(header, XWD_BLUE_MASK) != 0xff)
+  {
+    printf("xvfb_framebuffer: unsupported framebuffer depth=%u bpp=%u\n",
+           _header_field(header, XWD_PIXMAP_DEPTH), bpp);
+    return AVERROR(ENOSYS);
+  }
+  if (!width || !height || width > INT_MAX / 4 || height > INT_MAX ||
+      linesize < width * 4 || linesize > INT_MAX)
+  {
+    printf("xvfb_framebuffer: bad geometry %ux%u linesize %u\n",
+           width, height, linesize);
+    return AVERROR_INVALIDDATA;
+  }
+  uint64_t offset = header_size + (uint64_t)ncolors * XWD_COLOR_SIZE;
+  if (offset + (uint64_t)linesize * height > pthis->map_size) {
+    printf("xvfb_framebuffer: %s is shorter than its %ux%u image\n",
+           path, width, height);
+    return AVERROR_INVALIDDATA;
+  }
+  pthis->info.width = width;
+  pthis->info.height = height;
+  pthis->info.linesize = linesize;
+  pthis->info.pix_fmt =
+  _header_field(header, XWD_PIXMAP_DEPTH) == 32 ?
+  AV_PIX_FMT_BGRA : AV_PIX_FMT_BGR0;
+  pthis->info.pixels = pthis->map + offset;
+  return 0;
+}
+
+int xvfb_framebuffer_open(struct xvfb_framebuffer_s** fb_out,
+                          const char* fbdir, int screen)
+{
+  char path[PATH_MAX];
+  *fb_out = NULL;
+  snprintf(path, sizeof(path), "%s/Xvfb_screen%d", fbdir, screen);
+
+  struct xvfb_framebuffer_s* pthis = (struct xvfb_framebuffer_s*)
+  calloc(1, sizeof(struct xvfb_framebuffer_s));
+  pthis->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (pthis->fd < 0) {
+    printf("xvfb_framebuffer: cannot open %s\n", path);
+    xvfb_framebuffer_close(pthis);
+    return AVERROR(ENOENT);
+  }
+  struct stat st;
+  if (fstat(pthis->fd, &st) || st.st_size <= 0) {
+    printf("xvfb_framebuffer: cannot stat %s\n", path);
+    xvfb_framebuffer_close(pthis);
+    return AVERROR(EIO);
+  }
+  pthis->map_size = st.st_size;
+  // Shared, so we see the server's writes as they happen.
+  pthis->map = (uint8_t*)mmap(NULL, pthis->map_size, PROT_READ, MAP_SHARED,
+                              pthis->fd, 0);
+  if (pthis->map == MAP_FAILED) {
+    printf("xvfb_framebuffer: cannot map %s\n", path);
+    pthis->map = NULL;
+    xvfb_framebuffer_close(pthis);
+    return AVERROR(ENOMEM);
+  }
+  int ret = _parse_header(pthis, path);
+  if (ret) {
+    xvfb_framebuffer_close(pthis);
+    return ret;
+  }
+  *fb_out = pthis;
+  return 0;
+}
+
+void xvfb_framebuffer_close(struct xvfb_framebuffer_s* pthis) {
+  if (!pthis) {
+    return;
+  }
+  if (pthis->map) {
+    munmap(pthis->map, pthis->map_size);
+  }
+  if (pthis->fd >= 0) {
+    close(pthis->fd);
+  }
+  free(pthis);
+}
+
+void xvfb_framebuffer_get_info(struct xvfb_framebuffer_s* pthis,
+                               struct xvfb_framebuffer_info_s* info_out)
+{
+  memcpy(info_out, &pthis->info, sizeof(struct xvfb_framebuffer_info_s));
+}
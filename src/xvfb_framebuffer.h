@@ -0,0 +1,42 @@
+//
+//  xvfb_framebuffer.h
+//  x11pulsemux
+//
+
+#ifndef xvfb_framebuffer_h
+#define xvfb_framebuffer_h
+
+#include <stdint.h>
+#include <libavutil/pixfmt.h>
+
+/**
+ * Read-only view of a screen that Xvfb keeps in a memory mapped file
+ * (Xvfb -fbdir DIR writes DIR/Xvfb_screenN in XWD format). The XWD header is
+ * parsed once when opening; after that the pixels are plain memory, updated
+ * by the server as it draws, and can be converted without any X requests.
+ *
+ * Nothing synchronizes us with the server's rendering, so a read that races
+ * a redraw may see part of the old and part of the new picture. The next
+ * frame picks up the rest.
+ */
+struct xvfb_framebuffer_s;
+
+struct xvfb_framebuffer_info_s {
+  int width;
+  int height;
+  int linesize;
+  enum AVPixelFormat pix_fmt;
+  // first pixel of the screen inside the mapping
+  const uint8_t* pixels;
+};
+
+// Maps fbdir/Xvfb_screen<screen>. Only 32 bit little endian TrueColor
+// framebuffers (Xvfb's -screen WxHx24 and x32 on x86) are supported.
+int xvfb_framebuffer_open(struct xvfb_framebuffer_s** fb_out,
+                          const char* fbdir, int screen);
+void xvfb_framebuffer_close(struct xvfb_framebuffer_s* fb);
+
+void xvfb_framebuffer_get_info(struct xvfb_framebuffer_s* fb,
+                               struct xvfb_framebuffer_info_s* info_out);
+
+#endif /* xvfb_framebuffer_h */
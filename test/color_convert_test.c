@@ -0,0 +1,220 @@
+//
+//  color_convert_test.c
+//  x11pulsemux
+//
+// Every SIMD kernel this CPU runs must match the C path bit for bit, on
+// noise that reaches every lane and the scalar tail. The C path must stay
+// close to swscale on a gradient. On each grey level every kernel must give
+// chroma of exactly 128 and luma within 2 of swscale's, whose own fixed
+// point rounds differently from our 8 bit matrix.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libswscale/swscale.h>
+#include "color_convert.h"
+#include "test_util.h"
+
+// 64 + 32 + 16 pixels of vector work, then a C tail; odd height
+#define NOISE_WIDTH 118
+#define NOISE_HEIGHT 7
+// one column per grey level
+#define GREY_WIDTH 256
+#define GREY_HEIGHT 2
+
+static const enum color_convert_matrix matrices[] = {
+  COLOR_CONVERT_BT601, COLOR_CONVERT_BT709
+};
+#define MATRIX_COUNT (int)(sizeof(matrices) / sizeof(matrices[0]))
+
+struct picture_s {
+  int width;
+  int height;
+  uint8_t* bgra;
+  uint8_t* planes[3];
+  int strides[3];
+};
+
+static void picture_alloc(struct picture_s* pic, int width, int height) {
+  pic->width = width;
+  pic->height = height;
+  pic->bgra = calloc(width * height, 4);
+  pic->strides[0] = width;
+  pic->strides[1] = pic->strides[2] = (width + 1) / 2;
+  pic->planes[0] = calloc(width, height);
+  pic->planes[1] = calloc(pic->strides[1], (height + 1) / 2);
+  pic->planes[2] = calloc(pic->strides[2], (height + 1) / 2);
+}
+
+static void picture_free(struct picture_s* pic) {
+  free(pic->bgra);
+  for (int i = 0; i < 3; i++) {
+    free(pic->planes[i]);
+  }
+}
+
+static int plane_size(struct picture_s* pic, int plane) {
+  return pic->strides[plane] * (plane ? (pic->height + 1) / 2 : pic->height);
+}
+
+static void convert(struct picture_s* pic, enum color_convert_matrix matrix,
+                    char half)
+{
+  if (half) {
+    color_convert_bgra_to_i420_half(pic->bgra, pic->width * 4, pic->planes,
+                                    pic->strides, pic->width / 2,
+                                    pic->height / 2, matrix);
+  } else {
+    color_convert_bgra_to_i420(pic->bgra, pic->width * 4, pic->planes,
+                               pic->strides, pic->width, pic->height,
+                               matrix);
+  }
+}
+
+static void convert_swscale(struct picture_s* pic,
+                            enum color_convert_matrix matrix)
+{
+  struct SwsContext* sws = sws_getContext(pic->width, pic->height,
+                                          AV_PIX_FMT_BGR0,
+                                          pic->width, pic->height,
+                                          AV_PIX_FMT_YUV420P,
+                                          SWS_FAST_BILINEAR,
+                                          NULL, NULL, NULL);
+  if (!sws) {
+    CHECK(0, "cannot set up swscale");
+    return;
+  }
+  if (matrix == COLOR_CONVERT_BT709) {
+    sws_setColorspaceDetails(sws, sws_getCoefficients(SWS_CS_DEFAULT), 1,
+                             sws_getCoefficients(SWS_CS_ITU709), 0,
+                             0, 1 << 16, 1 << 16);
+  }
+  const uint8_t* src[4] = { pic->bgra, NULL, NULL, NULL };
+  const int src_stride[4] = { pic->width * 4, 0, 0, 0 };
+  uint8_t* dst[4] = { pic->planes[0], pic->planes[1], pic->planes[2], NULL };
+  const int dst_stride[4] = { pic->strides[0], pic->strides[1],
+    pic->strides[2], 0 };
+  sws_scale(sws, src, src_stride, 0, pic->height, dst, dst_stride);
+  sws_freeContext(sws);
+}
+
+static int max_diff(struct picture_s* a, struct picture_s* b, int plane) {
+  int diff = 0;
+  for (int i = 0; i < plane_size(a, plane); i++) {
+    diff = FFMAX(diff, abs(a->planes[plane][i] - b->planes[plane][i]));
+  }
+  return diff;
+}
+
+static void test_kernels_match_c(char half) {
+  struct picture_s ref, out;
+  picture_alloc(&ref, NOISE_WIDTH, NOISE_HEIGHT);
+  picture_alloc(&out, NOISE_WIDTH, NOISE_HEIGHT);
+  unsigned int seed = 0x9e3779b9;
+  for (int i = 0; i < NOISE_WIDTH * NOISE_HEIGHT * 4; i++) {
+    seed = seed * 1103515245 + 12345;
+    ref.bgra[i] = out.bgra[i] = seed >> 24;
+  }
+  int count = color_convert_get_kernel_count();
+  for (int m = 0; m < MATRIX_COUNT; m++) {
+    color_convert_use_kernel(count - 1);
+    convert(&ref, matrices[m], half);
+    for (int i = 0; i < count - 1; i++) {
+      const char* name = color_convert_get_kernel_name(i);
+      if (color_convert_use_kernel(i)) {
+        printf("%s kernel not supported here, skipped\n", name);
+        continue;
+      }
+      convert(&out, matrices[m], half);
+      for (int p = 0; p < 3; p++) {
+        CHECK(!max_diff(&ref, &out, p), "%s kernel, matrix %d%s: plane %d "
+              "differs from C", name, matrices[m], half ? ", half" : "", p);
+      }
+    }
+  }
+  picture_free(&ref);
+  picture_free(&out);
+}
+
+static void test_gradient_against_swscale(void) {
+  struct picture_s ref, out;
+  picture_alloc(&ref, 104, 6);
+  picture_alloc(&out, 104, 6);
+  for (int j = 0; j < ref.height; j++) {
+    for (int i = 0; i < ref.width; i++) {
+      uint8_t* px = ref.bgra + (j * ref.width + i) * 4;
+      px[0] = i;
+      px[1] = 40 + j * 8;
+      px[2] = 255 - i;
+      px[3] = 255;
+    }
+  }
+  memcpy(out.bgra, ref.bgra, ref.width * ref.height * 4);
+  color_convert_use_kernel(color_convert_get_kernel_count() - 1);
+  for (int m = 0; m < MATRIX_COUNT; m++) {
+    convert_swscale(&ref, matrices[m]);
+    convert(&out, matrices[m], 0);
+    // chroma siting differs a little on a gradient
+    int y = max_diff(&ref, &out, 0);
+    int u = max_diff(&ref, &out, 1);
+    int v = max_diff(&ref, &out, 2);
+    CHECK(y <= 2 && u <= 3 && v <= 3, "matrix %d gradient differs from "
+          "swscale (y=%d u=%d v=%d)", matrices[m], y, u, v);
+  }
+  picture_free(&ref);
+  picture_free(&out);
+}
+
+static void test_greys(void) {
+  struct picture_s ref, out;
+  picture_alloc(&ref, GREY_WIDTH, GREY_HEIGHT);
+  picture_alloc(&out, GREY_WIDTH, GREY_HEIGHT);
+  for (int j = 0; j < GREY_HEIGHT; j++) {
+    for (int i = 0; i < GREY_WIDTH; i++) {
+      uint8_t* px = ref.bgra + (j * GREY_WIDTH + i) * 4;
+      px[0] = px[1] = px[2] = i;
+      px[3] = 255;
+    }
+  }
+  memcpy(out.bgra, ref.bgra, GREY_WIDTH * GREY_HEIGHT * 4);
+  int count = color_convert_get_kernel_count();
+  for (int m = 0; m < MATRIX_COUNT; m++) {
+    color_convert_use_kernel(count - 1);
+    convert_swscale(&ref, matrices[m]);
+    for (int k = 0; k < count; k++) {
+      if (color_convert_use_kernel(k)) {
+        continue;
+      }
+      const char* name = color_convert_get_kernel_name(k);
+      convert(&out, matrices[m], 0);
+      // rounding only; the chroma below has to be exact
+      int y = max_diff(&ref, &out, 0);
+      CHECK(y <= 2, "%s kernel, matrix %d: grey luma differs from swscale "
+            "by %d", name, matrices[m], y);
+      for (int p = 1; p < 3; p++) {
+        for (int i = 0; i < plane_size(&out, p); i++) {
+          CHECK(out.planes[p][i] == 128, "%s kernel, matrix %d: grey %d "
+                "has chroma %d in plane %d", name, matrices[m], i * 2,
+                out.planes[p][i], p);
+        }
+      }
+    }
+    for (int g = 0; g < 256; g++) {
+      uint8_t y, u, v;
+      color_convert_pixel(g, g, g, matrices[m], &y, &u, &v);
+      CHECK(u == 128 && v == 128, "matrix %d: pixel grey %d has chroma "
+            "%d/%d", matrices[m], g, u, v);
+    }
+  }
+  picture_free(&ref);
+  picture_free(&out);
+}
+
+int main(int argc, char** argv) {
+  test_kernels_match_c(0);
+  test_kernels_match_c(1);
+  test_gradient_against_swscale();
+  test_greys();
+  return test_result();
+}
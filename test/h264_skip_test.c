@@ -0,0 +1,265 @@
+//
+//  h264_skip_test.c
+//  x11pulsemux
+//
+// Encodes a short clip with libx264 as the file writer configures it,
+// splices in skip frames for runs of repeated pictures, and decodes the
+// result with libavcodec's h264 decoder. The decoder must take every packet
+// without complaint or a frame_num gap, each skip frame must repeat the
+// picture before it, the encoded pictures must come out exactly as they do
+// without the skips, and only the first frame may be a keyframe.
+//
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include "h264_skip.h"
+#include "test_util.h"
+
+#define WIDTH 128
+#define HEIGHT 96
+#define FRAME_COUNT 24
+#define MAX_PACKETS 64
+
+// skip frames to follow each encoded frame
+static int repeats_after(int index) {
+  switch (index) {
+    case 2: return 1;
+    case 7: return 3;
+    case 15: return 10;
+    default: return 0;
+  }
+}
+
+struct stream_s {
+  AVPacket* packets[MAX_PACKETS];
+  char is_skip[MAX_PACKETS];
+  int count;
+};
+
+static void stream_append(struct stream_s* stream, AVPacket* pkt,
+                          char is_skip)
+{
+  if (stream->count == MAX_PACKETS) {
+    CHECK(0, "more than %d packets", MAX_PACKETS);
+    return;
+  }
+  stream->packets[stream->count] = av_packet_clone(pkt);
+  stream->is_skip[stream->count] = is_skip;
+  stream->count++;
+}
+
+static void stream_free(struct stream_s* stream) {
+  for (int i = 0; i < stream->count; i++) {
+    av_packet_free(&stream->packets[i]);
+  }
+}
+
+static void fill_frame(AVFrame* frame, int index) {
+  for (int y = 0; y < HEIGHT; y++) {
+    for (int x = 0; x < WIDTH; x++) {
+      frame->data[0][y * frame->linesize[0] + x] = (x + y + index * 4) & 255;
+    }
+  }
+  for (int y = 0; y < HEIGHT / 2; y++) {
+    memset(frame->data[1] + y * frame->linesize[1], 128 + index, WIDTH / 2);
+    memset(frame->data[2] + y * frame->linesize[2], 128 - index, WIDTH / 2);
+  }
+}
+
+static AVCodecContext* open_encoder(const AVCodec* codec) {
+  AVCodecContext* ctx = avcodec_alloc_context3(codec);
+  ctx->width = WIDTH;
+  ctx->height = HEIGHT;
+  ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  ctx->time_base = (AVRational){ 1, 30 };
+  ctx->max_b_frames = 0;
+  ctx->thread_count = 1;
+  ctx->profile = FF_PROFILE_H264_BASELINE;
+  av_opt_set(ctx->priv_data, "preset", "ultrafast", 0);
+  av_opt_set(ctx->priv_data, "crf", "18", 0);
+  if (avcodec_open2(ctx, codec, NULL) < 0) {
+    avcodec_free_context(&ctx);
+  }
+  return ctx;
+}
+
+// Hands each encoder packet to both streams, then any skip frames due
+// behind it. pending[i] is how many skips follow encoder packet i.
+static void receive_packets(AVCodecContext* ctx, struct h264_skip_s* skip,
+                            const int* pending, int* packets_out,
+                            struct stream_s* plain, struct stream_s* spliced)
+{
+  AVPacket* pkt = av_packet_alloc();
+  while (!avcodec_receive_packet(ctx, pkt)) {
+    stream_append(plain, pkt, 0);
+    CHECK(!h264_skip_renumber(skip, pkt), "renumbering packet %d failed",
+          *packets_out);
+    stream_append(spliced, pkt, 0);
+    CHECK(!(pkt->flags & AV_PKT_FLAG_KEY) || !*packets_out,
+          "encoder packet %d is a keyframe", *packets_out);
+    av_packet_unref(pkt);
+    for (int i = 0; i < pending[*packets_out]; i++) {
+      CHECK(h264_skip_is_ready(skip), "no skip frame after packet %d",
+            *packets_out);
+      if (h264_skip_build(skip, pkt)) {
+        CHECK(0, "h264_skip_build failed after packet %d", *packets_out);
+        break;
+      }
+      stream_append(spliced, pkt, 1);
+      av_packet_unref(pkt);
+    }
+    (*packets_out)++;
+  }
+  av_packet_free(&pkt);
+}
+
+static int encode(struct stream_s* plain, struct stream_s* spliced) {
+  const AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+  if (!codec) {
+    return 77;
+  }
+  AVCodecContext* ctx = open_encoder(codec);
+  if (!ctx) {
+    printf("cannot open libx264\n");
+    return 1;
+  }
+  struct h264_skip_s* skip;
+  h264_skip_alloc(&skip);
+  int pending[FRAME_COUNT];
+  for (int i = 0; i < FRAME_COUNT; i++) {
+    pending[i] = repeats_after(i);
+  }
+  int packets_out = 0;
+  AVFrame* frame = av_frame_alloc();
+  frame->width = WIDTH;
+  frame->height = HEIGHT;
+  frame->format = AV_PIX_FMT_YUV420P;
+  av_frame_get_buffer(frame, 0);
+  for (int i = 0; i < FRAME_COUNT; i++) {
+    av_frame_make_writable(frame);
+    fill_frame(frame, i);
+    frame->pts = i;
+    avcodec_send_frame(ctx, frame);
+    receive_packets(ctx, skip, pending, &packets_out, plain, spliced);
+  }
+  avcodec_send_frame(ctx, NULL);
+  receive_packets(ctx, skip, pending, &packets_out, plain, spliced);
+  CHECK(packets_out == FRAME_COUNT, "encoded %d of %d frames", packets_out,
+        FRAME_COUNT);
+  av_frame_free(&frame);
+  h264_skip_free(skip);
+  avcodec_free_context(&ctx);
+  return 0;
+}
+
+static int decoder_complaints = 0;
+
+// Anything the decoder says at warning level or above counts, as does the
+// frame_num gap it only notes at debug level.
+static void log_callback(void* avcl, int level, const char* fmt, va_list vl)
+{
+  if (level <= AV_LOG_WARNING || strstr(fmt, "Frame num gap")) {
+    char line[256];
+    vsnprintf(line, sizeof(line), fmt, vl);
+    printf("decoder: %s", line);
+    decoder_complaints++;
+  }
+}
+
+// Decodes a stream; frames_out[i] is the picture of packet i.
+static int decode(struct stream_s* stream, AVFrame** frames_out) {
+  const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  AVCodecContext* ctx = avcodec_alloc_context3(codec);
+  ctx->thread_count = 1;
+  ctx->err_recognition = AV_EF_EXPLODE | AV_EF_BITSTREAM | AV_EF_BUFFER;
+  if (avcodec_open2(ctx, codec, NULL) < 0) {
+    avcodec_free_context(&ctx);
+    return 0;
+  }
+  int count = 0;
+  AVFrame* frame = av_frame_alloc();
+  for (int i = 0; i <= stream->count; i++) {
+    int ret = avcodec_send_packet(ctx, i < stream->count ?
+                                  stream->packets[i] : NULL);
+    CHECK(ret >= 0, "decoder rejected packet %d: %s", i, av_err2str(ret));
+    while (!avcodec_receive_frame(ctx, frame)) {
+      if (count < stream->count) {
+        frames_out[count] = av_frame_clone(frame);
+      }
+      count++;
+      av_frame_unref(frame);
+    }
+  }
+  av_frame_free(&frame);
+  avcodec_free_context(&ctx);
+  return count;
+}
+
+static char same_picture(AVFrame* a, AVFrame* b) {
+  for (int p = 0; p < 3; p++) {
+    int width = p ? WIDTH / 2 : WIDTH;
+    int height = p ? HEIGHT / 2 : HEIGHT;
+    for (int y = 0; y < height; y++) {
+      if (memcmp(a->data[p] + y * a->linesize[p],
+                 b->data[p] + y * b->linesize[p], width))
+      {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  struct stream_s plain = { { 0 } };
+  struct stream_s spliced = { { 0 } };
+  int ret = encode(&plain, &spliced);
+  if (ret) {
+    if (ret == 77) {
+      printf("libx264 not available, skipped\n");
+    }
+    stream_free(&plain);
+    stream_free(&spliced);
+    return ret;
+  }
+
+  AVFrame* plain_frames[MAX_PACKETS] = { 0 };
+  AVFrame* spliced_frames[MAX_PACKETS] = { 0 };
+  int plain_count = decode(&plain, plain_frames);
+  CHECK(plain_count == plain.count, "decoded %d of %d plain frames",
+        plain_count, plain.count);
+  av_log_set_callback(log_callback);
+  int spliced_count = decode(&spliced, spliced_frames);
+  av_log_set_callback(av_log_default_callback);
+  CHECK(spliced_count == spliced.count, "decoded %d of %d spliced frames",
+        spliced_count, spliced.count);
+  CHECK(!decoder_complaints, "the decoder complained %d times",
+        decoder_complaints);
+
+  int encoded = 0;
+  for (int i = 0; i < FFMIN(spliced_count, spliced.count); i++) {
+    AVFrame* frame = spliced_frames[i];
+    if (spliced.is_skip[i]) {
+      CHECK(i && same_picture(frame, spliced_frames[i - 1]),
+            "skip frame %d does not repeat the picture before it", i);
+      CHECK(!(spliced.packets[i]->flags & AV_PKT_FLAG_KEY),
+            "skip frame %d is a keyframe", i);
+      continue;
+    }
+    if (encoded < plain_count) {
+      CHECK(same_picture(frame, plain_frames[encoded]),
+            "encoded frame %d differs once skips are spliced in", encoded);
+    }
+    encoded++;
+  }
+  for (int i = 0; i < MAX_PACKETS; i++) {
+    av_frame_free(&plain_frames[i]);
+    av_frame_free(&spliced_frames[i]);
+  }
+  stream_free(&plain);
+  stream_free(&spliced);
+  return test_result();
+}
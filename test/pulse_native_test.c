@@ -0,0 +1,86 @@
+//
+//  pulse_native_test.c
+//  x11pulsemux
+//
+// Records from a null sink's monitor (see with_null_sink.sh) through the
+// native backend. The muxer's blocking queue policy is asked for and the
+// queue left unread, so the mainloop would stall if the read callback
+// waited on it: frames must be dropped instead and stop must come back.
+// A source that does not exist must fail to start and clean up.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <libavutil/frame.h>
+#include "pulse_audio_source.h"
+#include "media_clock.h"
+#include "test_util.h"
+
+static void load_config(struct pulse_s* pulse, const char* device) {
+  struct pulse_config_s config = { 0 };
+  config.backend = PULSE_BACKEND_NATIVE;
+  config.device = device;
+  config.queue_capacity = 8;
+  config.overflow_policy = FRAME_RING_BLOCK;
+  pulse_load_config(pulse, &config);
+}
+
+static void test_record(const char* device) {
+  struct pulse_s* pulse;
+  pulse_alloc(&pulse);
+  load_config(pulse, device);
+  int ret = pulse_start(pulse);
+  CHECK(!ret, "pulse_start(%s) failed with %d", device, ret);
+  if (ret) {
+    pulse_free(pulse);
+    return;
+  }
+  // 8 frames of 1024 samples are ~170ms; a second overflows the queue
+  usleep(1000000);
+
+  struct pulse_stats_s stats;
+  pulse_get_stats(pulse, &stats);
+  CHECK(stats.queue.frames_pushed == 8, "queued %lld frames, expected 8",
+        stats.queue.frames_pushed);
+  CHECK(stats.queue.dropped_newest > 0, "a full queue dropped nothing");
+
+  int64_t stop_start = media_clock_now();
+  pulse_stop(pulse);
+  int64_t stop_ms = (media_clock_now() - stop_start) / 1000000;
+  CHECK(stop_ms < 500, "pulse_stop took %lldms", stop_ms);
+
+  int64_t last_pts = INT64_MIN;
+  int frames = 0;
+  AVFrame* frame;
+  while (!pulse_get_next(pulse, &frame)) {
+    CHECK(frame->pts > last_pts, "pts %lld after %lld", frame->pts,
+          last_pts);
+    CHECK(frame->nb_samples == 1024, "frame of %d samples",
+          frame->nb_samples);
+    last_pts = frame->pts;
+    frames++;
+    av_frame_free(&frame);
+  }
+  CHECK(frames == 8, "popped %d frames, expected 8", frames);
+  pulse_free(pulse);
+}
+
+static void test_missing_source(void) {
+  struct pulse_s* pulse;
+  pulse_alloc(&pulse);
+  load_config(pulse, "x11pulsemux_no_such_source");
+  int ret = pulse_start(pulse);
+  CHECK(ret, "pulse_start of a missing source succeeded");
+  pulse_stop(pulse);
+  pulse_free(pulse);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("usage: pulse_native_test SOURCE\n");
+    return 1;
+  }
+  test_record(argv[1]);
+  test_missing_source();
+  return test_result();
+}
@@ -0,0 +1,31 @@
+//
+//  test_util.h
+//  x11pulsemux
+//
+// What every test program shares: CHECK records a failure with its location
+// and keeps going, and test_result prints the verdict and gives the exit
+// status for ctest. Each test is a single translation unit.
+//
+
+#ifndef test_util_h
+#define test_util_h
+
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+  if (!(cond)) { \
+    printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+    printf(__VA_ARGS__); \
+    printf("\n"); \
+    failures++; \
+  } \
+} while (0)
+
+static inline int test_result(void) {
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
+
+#endif /* test_util_h */
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+#  with_null_sink.sh
+#  x11pulsemux
+#
+# Runs a command against a private pulseaudio server that has one null sink,
+# x11pulsemux_test, passing it the sink's monitor source. Exits 77 (skipped)
+# when pulseaudio is not installed.
+
+command -v pulseaudio >/dev/null 2>&1 || exit 77
+command -v pactl >/dev/null 2>&1 || exit 77
+
+PULSE_RUNTIME_PATH=$(mktemp -d)
+export PULSE_RUNTIME_PATH
+unset PULSE_SERVER
+
+pulseaudio -n --daemonize=no --exit-idle-time=-1 --log-target=stderr \
+  --load="module-native-protocol-unix" \
+  --load="module-null-sink sink_name=x11pulsemux_test" &
+server=$!
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null; rm -rf "$PULSE_RUNTIME_PATH"' EXIT
+
+tries=0
+until pactl info >/dev/null 2>&1; do
+  tries=$((tries + 1))
+  if [ $tries -gt 50 ]; then
+    echo "pulseaudio did not come up" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+"$@" x11pulsemux_test.monitor